@@ -0,0 +1,71 @@
+/**
+ * Replacement global allocation functions that count every allocation, for the parse
+ * benchmark. They live in a translation unit of their own so the compiler doesn't see
+ * malloc-backed new and free-backed delete side by side with code using them.
+ *
+ * Every form is replaced - array, nothrow and, when built as C++17 or later, aligned -
+ * so none of them slip past the count. Under C++14 over-aligned types go through the
+ * plain forms anyway.
+ */
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "alloc_count.h"
+
+namespace {
+	std::atomic<size_t> allocations { 0 };
+	std::atomic<size_t> bytes { 0 };
+
+	void *counted(size_t n) {
+		++allocations;
+		bytes += n;
+		return std::malloc(n ? n : 1);
+	}
+	void *counted_or_throw(size_t n) {
+		if(void *p = counted(n)) return p;
+		throw std::bad_alloc();
+	}
+}
+
+size_t pmat::allocation_count() { return allocations; }
+size_t pmat::allocated_bytes() { return bytes; }
+
+void *operator new(size_t n) { return counted_or_throw(n); }
+void *operator new[](size_t n) { return counted_or_throw(n); }
+void *operator new(size_t n, const std::nothrow_t &) noexcept { return counted(n); }
+void *operator new[](size_t n, const std::nothrow_t &) noexcept { return counted(n); }
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { std::free(p); }
+
+#ifdef __cpp_aligned_new
+namespace {
+	void *counted_aligned(size_t n, std::align_val_t al) {
+		++allocations;
+		bytes += n;
+		void *p = nullptr;
+		const size_t alignment = std::max(static_cast<size_t>(al), sizeof(void *));
+		return ::posix_memalign(&p, alignment, n ? n : 1) == 0 ? p : nullptr;
+	}
+	void *counted_aligned_or_throw(size_t n, std::align_val_t al) {
+		if(void *p = counted_aligned(n, al)) return p;
+		throw std::bad_alloc();
+	}
+}
+
+void *operator new(size_t n, std::align_val_t al) { return counted_aligned_or_throw(n, al); }
+void *operator new[](size_t n, std::align_val_t al) { return counted_aligned_or_throw(n, al); }
+void *operator new(size_t n, std::align_val_t al, const std::nothrow_t &) noexcept { return counted_aligned(n, al); }
+void *operator new[](size_t n, std::align_val_t al, const std::nothrow_t &) noexcept { return counted_aligned(n, al); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept { std::free(p); }
+#endif
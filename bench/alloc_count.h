@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstddef>
+
+namespace pmat {
+	/** Allocations made through the global operator new so far, see alloc_count.cpp */
+	size_t allocation_count();
+	/** Bytes asked for by those allocations */
+	size_t allocated_bytes();
+};
@@ -0,0 +1,92 @@
+/**
+ * Synthetic dump generator.
+ *
+ * Writes a made-up PMAT file of the requested size and shape, see pmat::synthetic_dump,
+ * to a file or stdout. Handy for benchmarking at sizes we have no real dumps for, and
+ * for trying the parser on layouts (big-endian, 32-bit, long double) we have no perl for.
+ */
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/positional_options.hpp>
+
+#include "synthetic_dump.h"
+#include "Log.h"
+
+int
+main(int argc, char **argv) {
+	namespace po = boost::program_options;
+
+	pmat::synthetic_dump::options opt;
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", u8"show program options")
+		("output", po::value<std::string>()->default_value("-"), u8"file to write, - for stdout")
+		("svs", po::value<size_t>(&opt.svs)->default_value(opt.svs), u8"heap SVs to write")
+		("scalars", po::value<unsigned>(&opt.scalars)->default_value(opt.scalars), u8"weight for scalars")
+		("refs", po::value<unsigned>(&opt.refs)->default_value(opt.refs), u8"weight for refs")
+		("arrays", po::value<unsigned>(&opt.arrays)->default_value(opt.arrays), u8"weight for arrays")
+		("hashes", po::value<unsigned>(&opt.hashes)->default_value(opt.hashes), u8"weight for hashes")
+		("code", po::value<unsigned>(&opt.code)->default_value(opt.code), u8"weight for subs, each a CV, glob and three pad arrays")
+		("string-size", po::value<size_t>(&opt.string_size)->default_value(opt.string_size), u8"mean string length")
+		("fanout", po::value<size_t>(&opt.fanout)->default_value(opt.fanout), u8"mean elements per array, hash and pad")
+		("classes", po::value<size_t>(&opt.classes)->default_value(opt.classes), u8"stashes to bless into")
+		("blessed", po::value<unsigned>(&opt.blessed)->default_value(opt.blessed), u8"percentage of hashes that are blessed")
+		("keys", po::value<size_t>(&opt.keys)->default_value(opt.keys), u8"distinct hash keys")
+		("seed", po::value<uint64_t>(&opt.seed)->default_value(opt.seed), u8"random seed")
+		("big-endian", u8"write a big-endian dump")
+		("int32", u8"32-bit integers")
+		("ptr32", u8"32-bit pointers")
+		("long-double", u8"NVs as long doubles")
+	;
+	po::positional_options_description pos;
+	pos.add("output", 1);
+
+	po::variables_map vm;
+	po::store(po::command_line_parser(argc, argv).options(desc).positional(pos).run(), vm);
+	po::notify(vm);
+	if(vm.count("help")) {
+		std::cout << desc << "\n";
+		return 1;
+	}
+	opt.flags = (vm.count("big-endian") ? 0x01 : 0)
+		| (vm.count("int32") ? 0 : 0x02)
+		| (vm.count("ptr32") ? 0 : 0x04)
+		| (vm.count("long-double") ? 0x08 : 0);
+
+	try {
+		const pmat::synthetic_dump dump { opt };
+		const auto filename = vm["output"].as<std::string>();
+		std::vector<char> buffer(1024 * 1024);
+		std::ofstream file;
+		if(filename != "-") {
+			file.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+			file.open(filename, std::ios::binary);
+			if(!file) {
+				ERROR << "Could not open " << filename;
+				return -1;
+			}
+		}
+		std::ostream &out = filename == "-" ? std::cout : file;
+
+		const auto start = std::chrono::steady_clock::now();
+		const auto bytes = dump.write(out);
+		out.flush();
+		if(!out) {
+			ERROR << "Failed writing " << filename;
+			return -1;
+		}
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		std::cerr << "Wrote " << dump.sv_count() << " SVs in " << bytes << " bytes, "
+			<< std::fixed << std::setprecision(2) << elapsed.count() << "s" << std::endl;
+	} catch(const std::exception &e) {
+		ERROR << e.what();
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,102 @@
+/**
+ * Heap parser scaling benchmark.
+ *
+ * Loads the same dump repeatedly with an increasing number of heap decoding threads
+ * and reports the best wall time for each, along with throughput, speedup over the
+ * single-threaded run and how many heap allocations a single load makes.
+ *
+ * pneumatic-bench-logged is the same with all logging compiled in (but filtered out at
+ * run time), as it was before PMAT_LOG_LEVEL: comparing the two on the same dump shows
+ * what the log statements on the decode path cost.
+ */
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/positional_options.hpp>
+
+#include "alloc_count.h"
+#include "pmat_file.h"
+#include "parallel.h"
+#include "Log.h"
+
+int
+main(int argc, char **argv) {
+	namespace po = boost::program_options;
+
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", u8"show program options")
+		("file", po::value<std::string>()->default_value("pmat/sample.pmat"), u8"dump to parse")
+		("max-threads", po::value<size_t>()->default_value(pmat::default_threads()), u8"largest thread count to try")
+		("runs", po::value<size_t>()->default_value(5), u8"runs per thread count, best is reported")
+	;
+	po::positional_options_description pos;
+	pos.add("file", 1);
+
+	po::variables_map vm;
+	po::store(po::command_line_parser(argc, argv).options(desc).positional(pos).run(), vm);
+	po::notify(vm);
+	if(vm.count("help")) {
+		std::cout << desc << "\n";
+		return 1;
+	}
+
+	namespace logging = boost::log;
+	logging::core::get()->set_filter(
+		logging::trivial::severity > logging::trivial::severity_level::info
+	);
+
+	const auto filename = vm["file"].as<std::string>();
+	const auto max_threads = vm["max-threads"].as<size_t>();
+	const auto runs = vm["runs"].as<size_t>();
+
+	boost::iostreams::mapped_file_source file;
+	file.open(filename);
+	if(!file.is_open()) {
+		ERROR << "Could not mmap() " << filename;
+		return -1;
+	}
+
+	std::cout << "File: " << filename << " (" << file.size() << " bytes)" << std::endl;
+	std::cout << "Logging compiled in from: " << boost::log::trivial::to_string(static_cast<boost::log::trivial::severity_level>(PMAT_LOG_LEVEL)) << std::endl;
+	std::cout << std::setw(8) << "threads"
+		<< std::setw(12) << "seconds"
+		<< std::setw(12) << "MB/s"
+		<< std::setw(14) << "SVs/s"
+		<< std::setw(10) << "speedup"
+		<< std::setw(10) << "allocs"
+		<< std::setw(12) << "alloc MB" << std::endl;
+
+	double single = 0;
+	for(size_t threads = 1; ; threads = std::min(threads * 2, max_threads)) {
+		double best = 0;
+		size_t svs = 0, allocs = 0, bytes = 0;
+		for(size_t run = 0; run < runs; ++run) {
+			const size_t allocs_before = pmat::allocation_count(), bytes_before = pmat::allocated_bytes();
+			auto start = std::chrono::steady_clock::now();
+			pmat_file pf { file.data(), file.size(), threads };
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			if(run == 0 || elapsed.count() < best) best = elapsed.count();
+			svs = pf.state().sv_count();
+			allocs = pmat::allocation_count() - allocs_before;
+			bytes = pmat::allocated_bytes() - bytes_before;
+		}
+		if(threads == 1) single = best;
+		std::cout << std::setw(8) << threads
+			<< std::setw(12) << std::fixed << std::setprecision(4) << best
+			<< std::setw(12) << std::setprecision(1) << (file.size() / best / 1e6)
+			<< std::setw(14) << std::setprecision(0) << (svs / best)
+			<< std::setw(10) << std::setprecision(2) << (single / best)
+			<< std::setw(10) << allocs
+			<< std::setw(12) << std::setprecision(2) << (bytes / 1e6) << std::endl;
+		if(threads >= max_threads) break;
+	}
+	return 0;
+}
@@ -0,0 +1,144 @@
+/**
+ * Parser scaling benchmark.
+ *
+ * Generates synthetic dumps (see pmat::synthetic_dump) at sizes going up by a fixed
+ * factor, from 1K SVs to as many as asked for - 100M is about 6GB of dump - and loads
+ * each one, reporting parse throughput, the time finish() takes and memory per SV: both
+ * what the SV table, arena and reference graph hold, and how much the resident set grew
+ * over the load, which includes the mapped dump itself.
+ *
+ * Dumps go to a temporary directory and are removed after each size unless --keep is
+ * given.
+ */
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/program_options/parsers.hpp>
+
+#include "synthetic_dump.h"
+#include "pmat_file.h"
+#include "parallel.h"
+#include "Log.h"
+
+namespace {
+	/** Current resident set, in bytes - unlike load_stats::peak_rss() this comes down again */
+	size_t current_rss() {
+		std::ifstream statm { "/proc/self/statm" };
+		size_t pages = 0, resident = 0;
+		statm >> pages >> resident;
+		return resident * ::sysconf(_SC_PAGESIZE);
+	}
+
+	double phase(const pmat::load_stats &stats, const std::string &name) {
+		for(const auto &p : stats.phases())
+			if(p.name == name) return p.wall;
+		return 0;
+	}
+}
+
+int
+main(int argc, char **argv) {
+	namespace po = boost::program_options;
+	namespace fs = boost::filesystem;
+
+	pmat::synthetic_dump::options opt;
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", u8"show program options")
+		("min-svs", po::value<size_t>()->default_value(1000), u8"smallest dump, in SVs")
+		("max-svs", po::value<size_t>()->default_value(1000000), u8"largest dump, in SVs - up to 100M or so")
+		("factor", po::value<size_t>()->default_value(10), u8"growth from one size to the next")
+		("threads", po::value<size_t>()->default_value(1), u8"heap decoding threads")
+		("fanout", po::value<size_t>(&opt.fanout)->default_value(opt.fanout), u8"mean elements per array, hash and pad")
+		("string-size", po::value<size_t>(&opt.string_size)->default_value(opt.string_size), u8"mean string length")
+		("seed", po::value<uint64_t>(&opt.seed)->default_value(opt.seed), u8"random seed")
+		("dir", po::value<std::string>()->default_value(fs::temp_directory_path().string()), u8"where to write the dumps")
+		("keep", u8"leave the dumps behind")
+	;
+
+	po::variables_map vm;
+	po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+	po::notify(vm);
+	if(vm.count("help")) {
+		std::cout << desc << "\n";
+		return 1;
+	}
+
+	namespace logging = boost::log;
+	logging::core::get()->set_filter(
+		logging::trivial::severity > logging::trivial::severity_level::info
+	);
+
+	const auto threads = vm["threads"].as<size_t>();
+	const auto max_svs = vm["max-svs"].as<size_t>();
+	const auto factor = std::max<size_t>(vm["factor"].as<size_t>(), 2);
+	const fs::path dir { vm["dir"].as<std::string>() };
+
+	std::cout << std::setw(11) << "SVs"
+		<< std::setw(10) << "dump MB"
+		<< std::setw(9) << "gen s"
+		<< std::setw(9) << "heap s"
+		<< std::setw(10) << "finish s"
+		<< std::setw(9) << "total s"
+		<< std::setw(9) << "MB/s"
+		<< std::setw(12) << "SVs/s"
+		<< std::setw(8) << "B/SV"
+		<< std::setw(10) << "RSS B/SV"
+		<< std::setw(10) << "dangling" << std::endl;
+
+	for(size_t svs = vm["min-svs"].as<size_t>(); svs <= max_svs; svs *= factor) {
+		opt.svs = svs;
+		const pmat::synthetic_dump dump { opt };
+		const auto path = dir / fs::unique_path("pneumatic-%%%%-%%%%.pmat");
+
+		auto start = std::chrono::steady_clock::now();
+		{
+			std::vector<char> buffer(1024 * 1024);
+			std::ofstream out;
+			out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+			out.open(path.string(), std::ios::binary);
+			dump.write(out);
+			if(!out.flush()) {
+				ERROR << "Could not write " << path;
+				return -1;
+			}
+		}
+		const std::chrono::duration<double> generated = std::chrono::steady_clock::now() - start;
+
+		{
+			auto file = std::make_shared<boost::iostreams::mapped_file_source>(path.string());
+			const size_t rss_before = current_rss();
+			start = std::chrono::steady_clock::now();
+			pmat_file pf { file->data(), file->size(), threads, file };
+			const std::chrono::duration<double> loaded = std::chrono::steady_clock::now() - start;
+			const size_t rss_after = current_rss();
+			const size_t rss = rss_after > rss_before ? rss_after - rss_before : 0;
+
+			const auto &state = pf.state();
+			const size_t n = state.sv_count();
+			const size_t held = state.svs().memory_used() + state.arena().bytes() + state.graph().memory_used();
+			std::cout << std::setw(11) << n
+				<< std::setw(10) << std::fixed << std::setprecision(1) << file->size() / 1e6
+				<< std::setw(9) << std::setprecision(3) << generated.count()
+				<< std::setw(9) << phase(pf.stats(), "heap")
+				<< std::setw(10) << phase(pf.stats(), "finish")
+				<< std::setw(9) << loaded.count()
+				<< std::setw(9) << std::setprecision(1) << file->size() / loaded.count() / 1e6
+				<< std::setw(12) << std::setprecision(0) << n / loaded.count()
+				<< std::setw(8) << static_cast<double>(held) / n
+				<< std::setw(10) << static_cast<double>(rss) / n
+				<< std::setw(10) << state.graph().dangling() << std::endl;
+		}
+		if(!vm.count("keep")) fs::remove(path);
+		if(svs > max_svs / factor) break;
+	}
+	return 0;
+}
@@ -0,0 +1,331 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "detail.h"
+
+namespace pmat {
+	/**
+	 * A made-up dump of whatever size we like, for benchmarking the parser without a perl
+	 * to hand. Records follow doc/format.txt as a 0.1 dump, in any of the layouts the
+	 * header flags allow, and everything is derived from the seed so a given set of
+	 * options always gives the same file.
+	 *
+	 * The heap is built from units: a single SV for scalars, refs, arrays and hashes, or a
+	 * CV with its glob, padlist, padnames and pad. Unit 0 is the default stash, then one
+	 * stash for each class, then units of random kinds by weight. Arrays, hashes and pads
+	 * take the next units not yet claimed as their elements, so the containers form a tree
+	 * from the default stash, and refs point anywhere for the cross links. A type mix with
+	 * too few containers runs out of tree before it runs out of units, and what's left is
+	 * unreachable.
+	 *
+	 * Nothing is held per SV while writing, so 100M SVs needs no more memory than 1K.
+	 */
+	class synthetic_dump {
+	public:
+		struct options {
+			/** Heap SVs to write, rounded up to a whole unit */
+			size_t svs = 100000;
+			/** Relative weights for each kind of unit */
+			unsigned scalars = 50, refs = 10, arrays = 15, hashes = 15, code = 5;
+			/** Mean string length, lengths are uniform up to twice this */
+			size_t string_size = 16;
+			/** Mean elements per array, hash and pad, uniform up to twice this */
+			size_t fanout = 4;
+			/** Stashes for hashes to be blessed into */
+			size_t classes = 16;
+			/** Percentage of hashes that are blessed */
+			unsigned blessed = 25;
+			/** Distinct hash keys to draw from */
+			size_t keys = 1000;
+			uint64_t seed = 1;
+			/** Header flags, for the layout - see pmat::flags_t */
+			uint8_t flags = 0x06;
+		};
+
+		explicit synthetic_dump(const options &o):opt_(o),units_{0},svs_{0} {
+			if(opt_.scalars + opt_.refs + opt_.arrays + opt_.hashes + opt_.code == 0)
+				throw std::invalid_argument("At least one kind of SV needs a weight");
+			if(!opt_.keys) opt_.keys = 1;
+			while(svs_ < opt_.svs || units_ < first_unit())
+				svs_ += unit_size(kind(units_++));
+			if(!(opt_.flags & 0x04) && address(units_, 0) > UINT32_MAX)
+				throw std::invalid_argument("Too many SVs for 32-bit pointers");
+		}
+
+		/** SVs in the heap, not counting the immortals */
+		size_t sv_count() const { return svs_; }
+
+		/** Writes the dump, returning its size in bytes */
+		size_t write(std::ostream &out) const {
+			pmat::flags_t flags;
+			flags.data = opt_.flags;
+			size_t written = 0;
+			detail::with_layout(flags, [&](auto layout) { written = this->write_as<decltype(layout)>(out); });
+			return written;
+		}
+
+	private:
+		enum class unit_kind { defstash, stash, scalar, ref, array, hash, code };
+
+		/** Immortals sit below the heap, as they do in perl's data segment */
+		static constexpr pmat::ptr_t immortals = 0x1000;
+		static constexpr pmat::ptr_t heap_base = 0x100000;
+		static constexpr pmat::ptr_t sv_head_size = 24;
+		static constexpr size_t code_svs = 5;
+
+		/** splitmix64, which is all we need for a stream of draws per unit */
+		class rng {
+		public:
+			explicit rng(uint64_t seed):state_{seed} { }
+			uint64_t operator()() {
+				uint64_t z = (state_ += 0x9e3779b97f4a7c15ULL);
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+				return z ^ (z >> 31);
+			}
+			/** Uniform over [0, 2 * mean] */
+			size_t around(size_t mean) { return (*this)() % (2 * mean + 1); }
+
+		private:
+			uint64_t state_;
+		};
+
+		rng draws(size_t u) const { return rng { opt_.seed * 0x2545f4914f6cdd1dULL + u }; }
+		size_t first_unit() const { return 1 + opt_.classes; }
+
+		unit_kind kind(size_t u) const {
+			if(u == 0) return unit_kind::defstash;
+			if(u < first_unit()) return unit_kind::stash;
+			const unsigned total = opt_.scalars + opt_.refs + opt_.arrays + opt_.hashes + opt_.code;
+			auto r = draws(u)() % total;
+			if(r < opt_.scalars) return unit_kind::scalar;
+			r -= opt_.scalars;
+			if(r < opt_.refs) return unit_kind::ref;
+			r -= opt_.refs;
+			if(r < opt_.arrays) return unit_kind::array;
+			r -= opt_.arrays;
+			if(r < opt_.hashes) return unit_kind::hash;
+			return unit_kind::code;
+		}
+		static size_t unit_size(unit_kind k) { return k == unit_kind::code ? code_svs : 1; }
+
+		/** The kth SV of unit u - units are spaced for the largest, so this needs no lookup */
+		static pmat::ptr_t address(size_t u, size_t k) {
+			return heap_base + (u * code_svs + k) * sv_head_size;
+		}
+		pmat::ptr_t class_stash(size_t c) const { return address(1 + c % opt_.classes, 0); }
+
+		static std::string class_name(size_t c) { return "Synthetic::Class" + std::to_string(c); }
+		std::string key(size_t k) const { return "key_" + std::to_string(k % opt_.keys); }
+
+		/** Hands out the next n unclaimed units as children of u, as addresses */
+		std::vector<pmat::ptr_t> &children(size_t u, size_t n, size_t &next, std::vector<pmat::ptr_t> &out) const {
+			out.clear();
+			if(next <= u) next = u + 1;
+			for(; n && next < units_; --n)
+				out.push_back(address(next++, 0));
+			return out;
+		}
+
+		template<class L>
+		size_t write_as(std::ostream &out) const {
+			const detail::basic_writer<L> w { out };
+
+			pmat::header hdr;
+			hdr.flags.data = opt_.flags;
+			hdr.major_ver = 0;
+			hdr.minor_ver = 1;
+			/* 5.20.1, as perl would write it */
+			hdr.perl_ver = 5 << 24 | 20 << 16 | 1;
+			hdr.types = detail::basic_writer<L>::types();
+			w(hdr);
+
+			pmat::roots roots;
+			roots.undef = immortals;
+			roots.yes = immortals + sv_head_size;
+			roots.no = immortals + 2 * sv_head_size;
+			roots.other_roots.items = {
+				pmat::root { "main_cv", 0 },
+				pmat::root { "defstash", address(0, 0) },
+				pmat::root { "mainstack", 0 },
+			};
+			w(roots);
+
+			pmat::stack stack;
+			for(size_t u = first_unit(); u < units_ && stack.elem.items.size() < 4; ++u)
+				stack.elem.items.push_back(address(u, 0));
+			w(stack);
+
+			size_t next = first_unit();
+			std::vector<pmat::ptr_t> elems;
+			std::string pv;
+			for(size_t u = 0; u < units_; ++u) {
+				auto r = draws(u);
+				r();
+				switch(kind(u)) {
+				case unit_kind::defstash:
+					stash(w, address(u, 0), "main", children(u, 4 * opt_.fanout + 1, next, elems), true);
+					break;
+				case unit_kind::stash:
+					stash(w, address(u, 0), class_name(u - 1), children(u, 0, next, elems), false);
+					break;
+				case unit_kind::scalar: {
+					pmat::sv v { pmat::sv_type_t::SVtSCALAR, address(u, 0) };
+					v.refcnt = 1;
+					const auto what = r() % 4;
+					const size_t len = what < 2 ? r.around(opt_.string_size) : 0;
+					v.size = sv_head_size + (what < 2 ? 16 + (len + 8) / 8 * 8 : 8);
+					w.sv_header(v);
+					w(static_cast<uint8_t>(what < 2 ? 0x08 : what == 2 ? 0x01 : 0x04));
+					w(static_cast<pmat::uint_t>(what == 2 ? r() % 1000000 : 0));
+					w(what == 3 ? static_cast<double>(r() % 1000000) / 1000 : 0.0);
+					w(static_cast<pmat::uint_t>(len));
+					w.write_ptr(0);
+					if(what < 2) {
+						pv.assign(len, 'a' + u % 26);
+						w(pv);
+					} else {
+						w.undef_str();
+					}
+					break;
+				}
+				case unit_kind::ref: {
+					pmat::sv v { pmat::sv_type_t::SVtREF, address(u, 0) };
+					v.refcnt = 1;
+					v.size = sv_head_size;
+					w.sv_header(v);
+					/* One in eight is weak */
+					w(static_cast<uint8_t>(r() % 8 == 0 ? 0x01 : 0x00));
+					w.write_ptr(address(r() % units_, 0));
+					w.write_ptr(0);
+					break;
+				}
+				case unit_kind::array:
+					array(w, address(u, 0), children(u, r.around(opt_.fanout), next, elems));
+					break;
+				case unit_kind::hash: {
+					const auto blessed = r() % 100 < opt_.blessed && opt_.classes ? class_stash(r()) : 0;
+					children(u, r.around(opt_.fanout), next, elems);
+					pmat::sv v { pmat::sv_type_t::SVtHASH, address(u, 0) };
+					v.refcnt = 1;
+					v.size = 64 + 24 * elems.size();
+					v.blessed = blessed;
+					w.sv_header(v);
+					w(static_cast<pmat::uint_t>(elems.size()));
+					w.write_ptr(0);
+					const size_t first_key = r();
+					for(size_t i = 0; i < elems.size(); ++i) {
+						w(key(first_key + i));
+						w.write_ptr(elems[i]);
+					}
+					break;
+				}
+				case unit_kind::code:
+					code(w, u, r, children(u, r.around(opt_.fanout), next, elems));
+					break;
+				}
+			}
+			w(pmat::sv_type_t::SVtEND);
+			return w.offset();
+		}
+
+		template<class L>
+		void stash(const detail::basic_writer<L> &w, pmat::ptr_t addr, const std::string &name, const std::vector<pmat::ptr_t> &elems, bool with_classes) const {
+			const size_t count = elems.size() + (with_classes ? opt_.classes : 0);
+			pmat::sv v { pmat::sv_type_t::SVtSTASH, addr };
+			v.refcnt = 1;
+			v.size = 64 + 24 * count;
+			w.sv_header(v);
+			w(static_cast<pmat::uint_t>(count));
+			for(size_t i = 0; i < 5; ++i) w.write_ptr(0);
+			w(name);
+			for(size_t i = 0; i < elems.size(); ++i) {
+				w("var_" + std::to_string(i));
+				w.write_ptr(elems[i]);
+			}
+			if(with_classes) {
+				for(size_t c = 0; c < opt_.classes; ++c) {
+					w(class_name(c) + "::");
+					w.write_ptr(class_stash(c));
+				}
+			}
+		}
+
+		template<class L>
+		void array(const detail::basic_writer<L> &w, pmat::ptr_t addr, const std::vector<pmat::ptr_t> &elems) const {
+			pmat::sv v { pmat::sv_type_t::SVtARRAY, addr };
+			v.refcnt = 1;
+			v.size = 56 + 8 * elems.size();
+			w.sv_header(v);
+			w(static_cast<pmat::uint_t>(elems.size()));
+			w(static_cast<uint8_t>(0));
+			w.write_ptrs(elems.data(), elems.size());
+		}
+
+		/**
+		 * A sub: the CV, its glob, and the padlist holding the padnames and a pad at depth
+		 * 1. The pad's lexicals are the unit's children. finish() turns the three arrays into
+		 * PADLIST, PADNAMES and PAD from the CV's body entries.
+		 */
+		template<class L>
+		void code(const detail::basic_writer<L> &w, size_t u, rng &r, std::vector<pmat::ptr_t> &lexicals) const {
+			const auto cv = address(u, 0), gv = address(u, 1), padlist = address(u, 2), padnames = address(u, 3), pad = address(u, 4);
+			const auto stash = opt_.classes ? class_stash(r()) : address(0, 0);
+			const std::string file = "lib/Synthetic/Unit" + std::to_string(u % 100) + ".pm";
+			const pmat::uint_t line = 1 + r() % 1000;
+
+			pmat::sv v { pmat::sv_type_t::SVtCODE, cv };
+			v.refcnt = 1;
+			v.size = 136;
+			w.sv_header(v);
+			w(line);
+			w(static_cast<uint8_t>(0x10));
+			/* Somewhere in the op tree, which isn't in the dump */
+			w.write_ptr(0);
+			w.write_ptr(stash);
+			w.write_ptr(gv);
+			w.write_ptr(0);
+			w.write_ptr(padlist);
+			w.write_ptr(0);
+			w(file);
+			w(pmat::sv_code_type_t::SVCtPADNAMES);
+			w.write_ptr(padnames);
+			for(size_t i = 0; i < lexicals.size(); ++i) {
+				w(pmat::sv_code_type_t::SVCtPADNAME);
+				w(pmat::sv_code_padname { i + 1, "$lex_" + std::to_string(i), 0 });
+			}
+			w(pmat::sv_code_type_t::SVCtPAD);
+			w(pmat::sv_code_pad { 1, pad });
+			w(pmat::sv_code_type_t::SVCtEND);
+
+			pmat::sv g { pmat::sv_type_t::SVtGLOB, gv };
+			g.refcnt = 1;
+			g.size = 88;
+			w.sv_header(g);
+			w(line);
+			w.write_ptr(stash);
+			for(size_t i = 0; i < 3; ++i) w.write_ptr(0);
+			w.write_ptr(cv);
+			w.write_ptr(gv);
+			w.write_ptr(0);
+			w.write_ptr(0);
+			w("sub_" + std::to_string(u));
+			w(file);
+
+			array(w, padlist, std::vector<pmat::ptr_t> { padnames, pad });
+			array(w, padnames, std::vector<pmat::ptr_t>(lexicals.size() + 1, 0));
+			/* Slot 0 is @_, which we leave out */
+			lexicals.insert(lexicals.begin(), 0);
+			array(w, pad, lexicals);
+		}
+
+		options opt_;
+		size_t units_;
+		size_t svs_;
+	};
+};
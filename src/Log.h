@@ -2,10 +2,24 @@
 
 #include <boost/log/trivial.hpp>
 
-#define TRACE BOOST_LOG_TRIVIAL(trace)
-#define DEBUG BOOST_LOG_TRIVIAL(debug)
-#define INFO BOOST_LOG_TRIVIAL(info)
-#define WARN BOOST_LOG_TRIVIAL(warn)
-#define ERROR BOOST_LOG_TRIVIAL(error)
-#define FATAL BOOST_LOG_TRIVIAL(fatal)
+/**
+ * The most verbose level compiled in, as a boost::log::trivial severity (0 for trace up
+ * to 5 for fatal). Anything below it is dead code: the statement is still type-checked
+ * but its arguments are never evaluated, so the per-SV logging on the decode path costs
+ * nothing rather than a filter check each time. Release builds set this to info, see
+ * CMakeLists.txt; by default everything is compiled in and filtered at run time.
+ */
+#ifndef PMAT_LOG_LEVEL
+#define PMAT_LOG_LEVEL 0
+#endif
+
+/* A loop rather than if/else, so it's safe as the body of an if without braces */
+#define PMAT_LOG(level, n) for(bool pmat_log_on = PMAT_LOG_LEVEL <= n; pmat_log_on; pmat_log_on = false) BOOST_LOG_TRIVIAL(level)
+
+#define TRACE PMAT_LOG(trace, 0)
+#define DEBUG PMAT_LOG(debug, 1)
+#define INFO PMAT_LOG(info, 2)
+#define WARN PMAT_LOG(warning, 3)
+#define ERROR PMAT_LOG(error, 4)
+#define FATAL PMAT_LOG(fatal, 5)
 
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cassert>
+#include <utility>
+#include <vector>
+
+namespace pmat {
+	/**
+	 * A vector of trivially-copyable items that can also borrow its storage from
+	 * elsewhere - in practice a mapped index file, see pmat::index_file - so a table
+	 * can be used straight from the mapping without copying it in.
+	 *
+	 * Reads and in-place writes go to whichever storage is current. Anything that changes
+	 * the size copies a borrowed column into storage of its own first.
+	 */
+	template<typename T>
+	class column {
+	public:
+		using value_type = T;
+		using iterator = T *;
+		using const_iterator = const T *;
+
+		column():data_{nullptr},size_{0},borrowed_{false} { }
+		explicit column(std::vector<T> &&items):owned_{std::move(items)},borrowed_{false} { sync(); }
+		column(column &&other):owned_{std::move(other.owned_)},data_{other.data_},size_{other.size_},borrowed_{other.borrowed_} {
+			other.reset();
+		}
+		column &operator=(column &&other) {
+			owned_ = std::move(other.owned_);
+			data_ = other.data_;
+			size_ = other.size_;
+			borrowed_ = other.borrowed_;
+			other.reset();
+			return *this;
+		}
+		column(const column &) = delete;
+		column &operator=(const column &) = delete;
+
+		/** Uses n items at data, which must stay valid for as long as the column does */
+		void borrow(T *data, size_t n) {
+			std::vector<T>().swap(owned_);
+			data_ = data;
+			size_ = n;
+			borrowed_ = true;
+		}
+		bool borrowed() const { return borrowed_; }
+
+		size_t size() const { return size_; }
+		bool empty() const { return size_ == 0; }
+		/** Items we have room for - for a borrowed column, just the ones we were given */
+		size_t capacity() const { return borrowed_ ? size_ : owned_.capacity(); }
+
+		T *data() { return data_; }
+		const T *data() const { return data_; }
+		T &operator[](size_t i) { return data_[i]; }
+		const T &operator[](size_t i) const { return data_[i]; }
+		T &back() { return data_[size_ - 1]; }
+		const T &back() const { return data_[size_ - 1]; }
+
+		iterator begin() { return data_; }
+		iterator end() { return data_ + size_; }
+		const_iterator begin() const { return data_; }
+		const_iterator end() const { return data_ + size_; }
+		const_iterator cbegin() const { return data_; }
+		const_iterator cend() const { return data_ + size_; }
+
+		void reserve(size_t n) { own(); owned_.reserve(n); sync(); }
+		void resize(size_t n) { own(); owned_.resize(n); sync(); }
+		void assign(size_t n, const T &v) { own(); owned_.assign(n, v); sync(); }
+		void push_back(const T &v) { own(); owned_.push_back(v); sync(); }
+		template<typename... Args>
+		void emplace_back(Args &&... args) { own(); owned_.emplace_back(std::forward<Args>(args)...); sync(); }
+		template<typename It>
+		void insert(const_iterator pos, It first, It last) {
+			const size_t at = pos - data_;
+			own();
+			owned_.insert(owned_.begin() + at, first, last);
+			sync();
+		}
+
+	private:
+		void own() {
+			if(!borrowed_) return;
+			owned_.assign(data_, data_ + size_);
+			borrowed_ = false;
+		}
+		void sync() {
+			data_ = owned_.data();
+			size_ = owned_.size();
+		}
+		void reset() {
+			data_ = nullptr;
+			size_ = 0;
+			borrowed_ = false;
+		}
+
+		std::vector<T> owned_;
+		T *data_;
+		size_t size_;
+		bool borrowed_;
+	};
+};
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/io/ios_state.hpp>
+
+#include "pmat_file.h"
+#include "Log.h"
+
+namespace pmat {
+	/**
+	 * The changes in state between two dumps of the same process, as described in
+	 * notes.txt: what was added, what went away and what grew, per class.
+	 *
+	 * Both SV tables are sorted by address, so this is a single merge pass over the two
+	 * of them, with no extra per-SV storage.
+	 */
+	class state_delta {
+	public:
+		/** Per-class totals, bytes are the SVs' own sizes */
+		struct row {
+			size_t added = 0, removed = 0, grown = 0;
+			int64_t added_bytes = 0, removed_bytes = 0, grown_bytes = 0;
+			int64_t net() const { return added_bytes - removed_bytes + grown_bytes; }
+		};
+
+		/** SVs seen in both dumps whose contents got bigger */
+		struct growth {
+			size_t pv = 0, refcnt = 0, array = 0, hash = 0;
+			uint64_t pv_bytes = 0, refs = 0, array_elements = 0, hash_elements = 0;
+		};
+
+		/**
+		 * A delta only makes sense between dumps from the same perl build, see notes.txt.
+		 * Logs each mismatch and returns false if there were any.
+		 */
+		static bool compatible(const pmat_file &from, const pmat_file &to) {
+			bool ok = true;
+			auto check = [&ok](bool same, const std::string &what) {
+				if(!same) {
+					ERROR << "Dumps differ in " << what;
+					ok = false;
+				}
+			};
+			const auto a = from.header_flags(), b = to.header_flags();
+			check(from.perl_version() == to.perl_version(), "perl version (" + from.perl_version_string() + " vs " + to.perl_version_string() + ")");
+			auto same = [&a, &b](uint8_t mask) { return !((a.data ^ b.data) & mask); };
+			check(same(0x01), "byte order");
+			check(same(0x02 | 0x04 | 0x08), "uint/pointer/NV size");
+			check(same(0x10), "ithreads");
+			const auto &ra = from.state().roots(), &rb = to.state().roots();
+			for(size_t i = 0; i < 3; ++i)
+				check(i < ra.size() && i < rb.size() && ra[i] == rb[i], "the yes/no/undef SVs");
+			return ok;
+		}
+
+		state_delta(const pmat::state_t &from, const pmat::state_t &to) {
+			const auto &a = from.svs(), &b = to.svs();
+			class_names names_a { from }, names_b { to };
+			pmat::sv_id_t i = 0, j = 0;
+			while(i < a.size() || j < b.size()) {
+				if(j == b.size() || (i < a.size() && a.address(i) < b.address(j))) {
+					removed(names_a(i), a.sv_size(i));
+					++i;
+				} else if(i == a.size() || b.address(j) < a.address(i)) {
+					added(names_b(j), b.sv_size(j));
+					++j;
+				} else {
+					/* Same address, but a different type or class is a new SV */
+					if(a.type(i) != b.type(j) || names_a(i) != names_b(j)) {
+						removed(names_a(i), a.sv_size(i));
+						added(names_b(j), b.sv_size(j));
+					} else {
+						compare(a, i, b, j, names_b(j));
+					}
+					++i;
+					++j;
+				}
+			}
+		}
+
+		const std::map<std::string, row> &classes() const { return classes_; }
+		const pmat::state_delta::growth &grown() const { return growth_; }
+
+		/** Prints the per-class table, biggest change first, then the growth summary */
+		void report(std::ostream &out) const {
+			std::vector<std::pair<std::string, row>> rows(classes_.cbegin(), classes_.cend());
+			std::sort(rows.begin(), rows.end(), [](const std::pair<std::string, row> &l, const std::pair<std::string, row> &r) {
+				return std::abs(l.second.net()) > std::abs(r.second.net());
+			});
+			row total;
+			boost::io::ios_all_saver ias { out };
+			out << std::setiosflags(std::ios::left) << std::setw(24) << "Type" << " | " << std::setw(8) << "Added" << " | " << std::setw(8) << "Removed"
+				<< " | " << std::setw(8) << "Grown" << " | " << "Net bytes" << std::endl;
+			auto line = [&out](const std::string &name, const row &r) {
+				out << std::setw(24) << name << " | " << std::setw(8) << r.added << " | " << std::setw(8) << r.removed
+					<< " | " << std::setw(8) << r.grown << " | " << std::showpos << r.net() << std::noshowpos << std::endl;
+			};
+			for(const auto &it : rows) {
+				if(!it.second.added && !it.second.removed && !it.second.grown) continue;
+				line(it.first, it.second);
+				total.added += it.second.added;
+				total.removed += it.second.removed;
+				total.grown += it.second.grown;
+				total.added_bytes += it.second.added_bytes;
+				total.removed_bytes += it.second.removed_bytes;
+				total.grown_bytes += it.second.grown_bytes;
+			}
+			line("Total", total);
+			out << "Growing:" << std::endl;
+			out << "  PV:                " << growth_.pv << " SVs, +" << growth_.pv_bytes << " bytes" << std::endl;
+			out << "  Refcount:          " << growth_.refcnt << " SVs, +" << growth_.refs << " references" << std::endl;
+			out << "  Array elements:    " << growth_.array << " arrays, +" << growth_.array_elements << " elements" << std::endl;
+			out << "  Hash elements:     " << growth_.hash << " hashes, +" << growth_.hash_elements << " elements" << std::endl;
+		}
+
+	private:
+		/** sv_blessed_type() for each SV, built once per (type, stash) */
+		class class_names {
+		public:
+			explicit class_names(const pmat::state_t &state):state_(state) { }
+			const std::string &operator()(pmat::sv_id_t id) {
+				const auto &svs = state_.svs();
+				auto it = names_.find(std::make_pair(svs.type(id), svs.blessed(id)));
+				if(it == names_.end())
+					it = names_.emplace(std::make_pair(svs.type(id), svs.blessed(id)), state_.sv_blessed_type(id)).first;
+				return it->second;
+			}
+		private:
+			const pmat::state_t &state_;
+			std::map<std::pair<pmat::sv_type_t, pmat::ptr_t>, std::string> names_;
+		};
+
+		void added(const std::string &name, uint64_t size) {
+			auto &r = classes_[name];
+			++r.added;
+			r.added_bytes += size;
+		}
+		void removed(const std::string &name, uint64_t size) {
+			auto &r = classes_[name];
+			++r.removed;
+			r.removed_bytes += size;
+		}
+
+		template<typename T>
+		static bool grew(T from, T to, size_t &count, uint64_t &total) {
+			if(to <= from) return false;
+			++count;
+			total += to - from;
+			return true;
+		}
+
+		void compare(const pmat::sv_table &a, pmat::sv_id_t i, const pmat::sv_table &b, pmat::sv_id_t j, const std::string &name) {
+			bool bigger = b.sv_size(j) > a.sv_size(i);
+			grew(a.refcnt(i), b.refcnt(j), growth_.refcnt, growth_.refs);
+			switch(b.type(j)) {
+			case pmat::sv_type_t::SVtSCALAR:
+				bigger |= grew(a.body<pmat::sv_scalar>(i).pvlen, b.body<pmat::sv_scalar>(j).pvlen, growth_.pv, growth_.pv_bytes);
+				break;
+			case pmat::sv_type_t::SVtARRAY:
+			case pmat::sv_type_t::SVtPADLIST:
+			case pmat::sv_type_t::SVtPADNAMES:
+			case pmat::sv_type_t::SVtPAD:
+				bigger |= grew(a.body<pmat::sv_array>(i).count, b.body<pmat::sv_array>(j).count, growth_.array, growth_.array_elements);
+				break;
+			case pmat::sv_type_t::SVtHASH:
+				bigger |= grew(a.body<pmat::sv_hash>(i).count, b.body<pmat::sv_hash>(j).count, growth_.hash, growth_.hash_elements);
+				break;
+			case pmat::sv_type_t::SVtSTASH:
+				bigger |= grew(a.body<pmat::sv_stash>(i).count, b.body<pmat::sv_stash>(j).count, growth_.hash, growth_.hash_elements);
+				break;
+			default:
+				break;
+			}
+			if(!bigger && b.sv_size(j) == a.sv_size(i)) return;
+			auto &r = classes_[name];
+			if(bigger) ++r.grown;
+			r.grown_bytes += static_cast<int64_t>(b.sv_size(j)) - static_cast<int64_t>(a.sv_size(i));
+		}
+
+		std::map<std::string, row> classes_;
+		growth growth_;
+	};
+};
@@ -4,5 +4,11 @@ namespace detail {
 	boost::system::system_error bad_message() {
 		return boost::system::system_error(boost::system::errc::make_error_code(boost::system::errc::bad_message));
 	}
+	boost::system::system_error short_read() {
+		return boost::system::system_error(boost::system::errc::make_error_code(boost::system::errc::no_message_available));
+	}
+	bool is_short_read(const boost::system::system_error &e) {
+		return e.code() == boost::system::errc::no_message_available;
+	}
 }
 
@@ -2,15 +2,20 @@
 
 // for the reader/writer
 #include <boost/asio/buffer.hpp>
+#include <boost/endian/conversion.hpp>
 #include <boost/optional.hpp>
 #include <boost/fusion/include/for_each.hpp>
 #include <boost/fusion/include/is_sequence.hpp>
 #include <boost/system/system_error.hpp>
 
 #include "pmat.h"
+#include "state.h"
 #include "net.h"
+#include "parallel.h"
 #include "Log.h"
 
+#include <cmath>
+#include <cstring>
 #include <string>
 #include <iostream>
 #include <iomanip>
@@ -48,6 +53,92 @@ namespace detail {
 
     namespace bs = boost::system;
 	bs::system_error bad_message();
+	/** The data ran out part way through something, see reader::need() */
+	bs::system_error short_read();
+	bool is_short_read(const bs::system_error &e);
+
+/**
+ * How the perl that wrote a dump lays out its numbers, from the header flags: the byte
+ * order, whether UINTs and pointers are 32 or 64 bits, and whether NVs are doubles or
+ * long doubles (10 bytes of x87 extended precision).
+ */
+template<bool BigEndian, bool Uint64, bool Ptr64, bool LongDouble>
+struct layout {
+	/** Multi-byte values need their bytes reversing on this host */
+	static constexpr bool big_endian = BigEndian;
+	static constexpr bool swap = BigEndian != (boost::endian::order::native == boost::endian::order::big);
+	static constexpr bool long_double = LongDouble;
+	using uint_type = typename std::conditional<Uint64, uint64_t, uint32_t>::type;
+	using ptr_type = typename std::conditional<Ptr64, uint64_t, uint32_t>::type;
+	static constexpr size_t uint_size = sizeof(uint_type);
+	static constexpr size_t ptr_size = sizeof(ptr_type);
+	static constexpr size_t nv_size = LongDouble ? 10 : 8;
+};
+
+/** The layout for flags_t bits 0-3 */
+template<size_t Bits>
+using layout_for = layout<(Bits & 0x01) != 0, (Bits & 0x02) != 0, (Bits & 0x04) != 0, (Bits & 0x08) != 0>;
+
+/** A 64-bit perl on this host - also what the header is read with, being all bytes and u32s */
+using native_layout = layout_for<(boost::endian::order::native == boost::endian::order::big ? 0x01 : 0x00) | 0x06>;
+
+template<size_t Bits, typename F>
+void call_with_layout(F &f) { f(layout_for<Bits>{}); }
+
+template<typename F, size_t... Bits>
+void with_layout(pmat::flags_t flags, F &f, std::index_sequence<Bits...>) {
+	using call_t = void (*)(F &);
+	static const call_t calls[] = { &call_with_layout<Bits, F>... };
+	calls[flags.data & 0x0f](f);
+}
+
+/**
+ * Calls f with the layout matching the dump's header flags, as an empty object of the
+ * right layout<> type. Everything f does with a reader over that layout has the widths
+ * and byte order fixed at compile time, so this is the only place we look at the flags.
+ */
+template<typename F>
+void with_layout(pmat::flags_t flags, F &&f) {
+	with_layout(flags, f, std::make_index_sequence<16>{});
+}
+
+/** x87 extended precision, as found in the dump for a long-double perl, to a double */
+inline double extended_to_double(const unsigned char *p, bool big_endian) {
+	unsigned char b[10];
+	for(size_t i = 0; i < 10; ++i) b[i] = big_endian ? p[9 - i] : p[i];
+	uint64_t mantissa = 0;
+	for(size_t i = 8; i; --i) mantissa = (mantissa << 8) | b[i - 1];
+	const unsigned int se = static_cast<unsigned int>(b[9]) << 8 | b[8];
+	const int exponent = se & 0x7fff;
+	double v;
+	if(exponent == 0x7fff) v = (mantissa << 1) ? NAN : INFINITY;
+	else v = std::ldexp(static_cast<double>(mantissa), exponent - 16383 - 63);
+	return (se & 0x8000) ? -v : v;
+}
+
+/** The other way round, for writing a long-double dump: 10 bytes of x87 extended precision from a double */
+inline void double_to_extended(double v, unsigned char *p, bool big_endian) {
+	unsigned char b[10] = { };
+	unsigned int se = std::signbit(v) ? 0x8000 : 0;
+	uint64_t mantissa = 0;
+	if(std::isnan(v)) {
+		se |= 0x7fff;
+		mantissa = 0xc000000000000000ULL;
+	} else if(std::isinf(v)) {
+		se |= 0x7fff;
+		mantissa = 0x8000000000000000ULL;
+	} else if(v != 0) {
+		int e = 0;
+		const double m = std::frexp(std::fabs(v), &e);
+		/* Every double is a normal number in extended precision, with the top bit explicit */
+		mantissa = static_cast<uint64_t>(std::ldexp(m, 64));
+		se |= static_cast<unsigned int>(e - 1 + 16383);
+	}
+	for(size_t i = 0; i < 8; ++i) b[i] = static_cast<unsigned char>(mantissa >> (8 * i));
+	b[8] = static_cast<unsigned char>(se);
+	b[9] = static_cast<unsigned char>(se >> 8);
+	for(size_t i = 0; i < 10; ++i) p[i] = big_endian ? b[9 - i] : b[i];
+}
 
 /*
  * The reader class is responsible for pulling data from the buffer and mapping it to the
@@ -58,55 +149,230 @@ namespace detail {
  *
  * * Buffer offset changes
  * * PMAT state changes
- * 
+ *
+ * It's specialised on the dump's layout, see with_layout(). Within it, a 64-bit integer
+ * (pmat::uint_t) is read as a UINT of whatever width the dump has; pointers are the same
+ * C++ type, so they're read with read_ptr() instead, and fusion structs that hold
+ * pointers get operators of their own below.
  */
-class reader {
+template<class Layout>
+class basic_reader {
 public:
     mutable asio::const_buffer buf_;
     mutable size_t offset_;
 	pmat::state_t &pmat_state_;
 
-    explicit reader(
+    explicit basic_reader(
 		asio::const_buffer buf,
-		pmat::state_t &state
+		pmat::state_t &state,
+		size_t threads = 1
 	):buf_{std::move(buf)},
 	  offset_{state.file_offset()},
-	  pmat_state_(state)
+	  pmat_state_(state),
+	  start_{offset_},
+	  threads_{threads},
+	  tracks_offset_{true}
     {
 	}
 
-virtual ~reader()
+virtual ~basic_reader()
 	{
+		if(!tracks_offset_) return;
 		DEBUG << "Finish reader, offset was " << offset_;
-		pmat_state_.add_file_offset(offset_);
+		pmat_state_.add_file_offset(offset_ - start_);
+	}
+
+	/**
+	 * Throws short_read() unless there are at least n more bytes. Every read goes through
+	 * this, so a truncated dump - or a partial record from a stream - is an error rather
+	 * than a read past the end.
+	 */
+	void need(size_t n) const {
+		if(asio::buffer_size(buf_) < n) throw short_read();
 	}
 
 	/** Move buffer offset forward - we don't update the buffer directly, but let this method do it for us */
 	void forward(size_t v) const {
+		need(v);
 		buf_ = buf_ + v;
 		offset_ += v;
 		TRACE << "Forward " << v << " - offset now " << offset_;
 	}
 
+	/**
+	 * A reader positioned the given number of bytes ahead of us. Used by the heap workers,
+	 * so it leaves the state's file offset alone when it goes away.
+	 */
+	basic_reader slice(size_t from) const {
+		basic_reader r { *this };
+		r.forward(from);
+		r.tracks_offset_ = false;
+		r.arena_.reset();
+		r.pads_.clear();
+		return r;
+	}
+
+	/**
+	 * A reader over a whole dump for decoding records out of order, see seek(). Like a
+	 * slice, it leaves the state's file offset alone.
+	 */
+	static basic_reader over(asio::const_buffer dump, pmat::state_t &state, size_t threads = 1) {
+		basic_reader r { dump, state, threads };
+		r.offset_ = r.start_ = 0;
+		r.tracks_offset_ = false;
+		r.origin_ = dump;
+		return r;
+	}
+
+	/** Moves to an absolute offset in the dump, only for readers from over() */
+	void seek(size_t to) const {
+		buf_ = origin_ + to;
+		offset_ = to;
+	}
+
+	/** Space for n objects from the state's arena, which owns them from then on */
+	template<class T>
+	T *allocate(size_t n) const {
+		return arena_.allocate<T>(pmat_state_.arena(), n);
+	}
+
+	/** Section sizes for the given SV type from the header, or an empty entry if it wasn't listed */
+	const pmat::type &type_info(pmat::sv_type_t t) const {
+		static const pmat::type none { 0, 0, 0 };
+		const auto idx = static_cast<size_t>(t);
+		return idx < pmat_state_.types.size() ? pmat_state_.types[idx] : none;
+	}
+
+	/**
+	 * Section helpers. The header type table tells us how many header bytes, pointers and
+	 * strings each SV type carries, which may be more (newer dumper) or fewer (older dumper)
+	 * than we know about. We read what's there and skip anything we don't understand.
+	 */
+	template<class T>
+	void header_field(T &val, size_t end) const {
+		if(offset_ + wire_size<T>() <= end) (*this)(val);
+		else val = T{};
+	}
+	void header_ptr(pmat::ptr_t &val, size_t end) const {
+		if(offset_ + Layout::ptr_size <= end) read_ptr(val);
+		else val = 0;
+	}
+	void ptr_field(pmat::ptr_t &val, size_t &remaining) const {
+		if(remaining) { read_ptr(val); --remaining; }
+		else val = 0;
+	}
+	template<class T>
+	void str_field(T &val, size_t &remaining) const {
+		if(remaining) { (*this)(val); --remaining; }
+	}
+	/** A string we keep as an id in the names table, no_string if it's undef or missing */
+	void name_field(pmat::string_id_t &val, size_t &remaining, pmat::string_table &names) const {
+		val = pmat::no_string;
+		if(!remaining) return;
+		--remaining;
+		pmat::uint_t length = 0;
+		if(!str_length(length)) return;
+		need(length);
+		val = intern(pmat::str_t { asio::buffer_cast<char const*>(buf_), length }, names);
+		forward(length);
+	}
+	void skip_to(size_t end) const {
+		if(end > offset_) forward(end - offset_);
+	}
+	void skip_ptrs(size_t n) const {
+		need_items(n, Layout::ptr_size);
+		forward(n * Layout::ptr_size);
+	}
+	void skip_strs(size_t n) const {
+		for(; n; --n) {
+			pmat::uint_t length = 0;
+			if(str_length(length)) forward(length);
+		}
+	}
+
+	/** How many bytes a T takes up in the dump */
+	template<class T>
+	static constexpr size_t wire_size() {
+		return std::is_same<T, pmat::uint_t>::value ? Layout::uint_size
+			: std::is_same<T, double>::value ? Layout::nv_size
+			: sizeof(T);
+	}
+
+	/** A fixed-width integer in the dump's byte order */
+	template<class T>
+	T load() const {
+		need(sizeof(T));
+		T v;
+		std::memcpy(&v, asio::buffer_cast<const void *>(buf_), sizeof(T));
+		if(Layout::swap && sizeof(T) > 1) boost::endian::endian_reverse_inplace(v);
+		forward(sizeof(T));
+		return v;
+	}
+
+	/** A UINT, widened to 64 bits */
+	void operator()(pmat::uint_t &val) const {
+		val = load<typename Layout::uint_type>();
+	}
+	void read_ptr(pmat::ptr_t &val) const {
+		val = load<typename Layout::ptr_type>();
+	}
+
+	/** Throws short_read() unless n items of the given size follow, without overflowing on a bogus n */
+	void need_items(size_t n, size_t size) const {
+		if(n > asio::buffer_size(buf_) / size) throw short_read();
+	}
+
+	/**
+	 * A run of n pointers straight into out, with one bounds check and one forward() for
+	 * the lot rather than one per element. When the dump's layout matches ours that's a
+	 * memcpy; otherwise it's a loop of fixed-width loads, byte reversals and widening
+	 * stores with nothing in between, which leaves the compiler free to vectorise it.
+	 */
+	void read_ptrs(pmat::ptr_t *out, size_t n) const {
+		using ptr_type = typename Layout::ptr_type;
+		need_items(n, Layout::ptr_size);
+		auto src = asio::buffer_cast<const unsigned char *>(buf_);
+		if(!Layout::swap && sizeof(ptr_type) == sizeof(pmat::ptr_t)) {
+			std::memcpy(out, src, n * sizeof(pmat::ptr_t));
+		} else {
+			for(size_t i = 0; i < n; ++i) {
+				ptr_type v;
+				std::memcpy(&v, src + i * sizeof(ptr_type), sizeof(ptr_type));
+				if(Layout::swap) v = boost::endian::endian_reverse(v);
+				out[i] = v;
+			}
+		}
+		forward(n * Layout::ptr_size);
+	}
+	/** A string length, false for the all-ones marker an undef string has instead */
+	bool str_length(pmat::uint_t &length) const {
+		const auto v = load<typename Layout::uint_type>();
+		length = v;
+		return v != static_cast<typename Layout::uint_type>(~typename Layout::uint_type{0});
+	}
+
     void operator()(double &val) const {
-        val = *asio::buffer_cast<double const*>(buf_);
-        forward(sizeof(double));
+		if(Layout::long_double) {
+			need(Layout::nv_size);
+			val = extended_to_double(asio::buffer_cast<const unsigned char *>(buf_), Layout::big_endian);
+			forward(Layout::nv_size);
+			return;
+		}
+		const auto bits = load<uint64_t>();
+		std::memcpy(&val, &bits, sizeof(val));
     }
     void operator()(float &val) const {
-        val = *asio::buffer_cast<float const*>(buf_);
-        forward(sizeof(float));
+		const auto bits = load<uint32_t>();
+		std::memcpy(&val, &bits, sizeof(val));
     }
 
 	/**
-	 * Deal with numeric types. We assume everything needs an endian flip, and let the ntoh
-	 * templating sort out the details.
+	 * Deal with the other numeric types, which are fixed width in the dump.
 	 */
     template<class T>
     auto operator()(T & val) const ->
         typename std::enable_if<std::is_integral<T>::value>::type {
-        val = *asio::buffer_cast<T const*>(buf_);
-// TRACE << " Working with numeric value " << val;
-        forward(sizeof(T));
+		val = load<T>();
     }
 
 	/**
@@ -152,17 +418,39 @@ virtual ~reader()
 		TRACE << " String " << val;
 #else
 		pmat::uint_t length = 0;
-        (*this)(length);
 		// TRACE << " String length " << length;
-		if(0 == ~length) {
+		if(!str_length(length)) {
 			return;
 		}
+		need(length);
 		val = std::string(asio::buffer_cast<char const*>(buf_), length);
 		forward(length);
 		// TRACE << " String " << val;
 #endif
     }
 
+	/**
+	 * Dump strings either point straight into the buffer, when the state is keeping the
+	 * dump data alive for us, or get copied into the state's arena.
+	 */
+    void operator()(pmat::str_t& val) const {
+		pmat::uint_t length = 0;
+		if(!str_length(length)) {
+			val = pmat::str_t { };
+			return;
+		}
+		need(length);
+		auto src = asio::buffer_cast<char const*>(buf_);
+		if(pmat_state_.zero_copy()) {
+			val = pmat::str_t { src, length };
+		} else {
+			auto copy = allocate<char>(length);
+			std::memcpy(copy, src, length);
+			val = pmat::str_t { copy, length };
+		}
+		forward(length);
+    }
+
     void operator()(pmat::flags_t &val) const {
         (*this)(val.data);
 		TRACE << "Applied flags: " << (uint32_t) val.data;
@@ -198,11 +486,12 @@ virtual ~reader()
         uint64_t length = 0;
         (*this)(length);
 		TRACE << DEBUG_TYPE((T)) << " - read " << length << " items";
-		auto items = val.items;
+		val.count = length;
+		val.items.reserve(length);
         for (; length; --length) {
             T v;
             (*this)(v);
-            items.emplace_back(v);
+            val.items.emplace_back(v);
         }
     }
     template<class T>
@@ -210,11 +499,12 @@ virtual ~reader()
         uint32_t length = 0;
         (*this)(length);
 		TRACE << DEBUG_TYPE((T)) << " - read " << length << " items";
-		auto items = val.items;
+		val.count = length;
+		val.items.reserve(length);
         for (; length; --length) {
             T v;
             (*this)(v);
-            items.emplace_back(v);
+            val.items.emplace_back(v);
         }
     }
     template<class T>
@@ -232,287 +522,499 @@ virtual ~reader()
 	/**
 	 * Reading an entire SV is mildly complicated.
 	 *
-	 * We have a "magic" type which is handled differently - more on that later.
+	 * We have a "magic" type which is handled differently - it's a record about an SV
+	 * elsewhere in the heap, which the table attaches once it's sealed.
 	 * Other types have a two-level size+count lookup:
 	 * * Standard SV fields
 	 * * Type-specific fields
+	 *
+	 * Both levels are sized from the header type table, see the section helpers above.
 	 */
     void
 	operator()(pmat::sv& val) const {
+		decode_sv(val, pmat_state_.svs());
+	}
+
+	/**
+	 * Decodes the next SV record. The common fields end up in val (type is SVtEND once we
+	 * reach the end of the heap), and SVs we keep are added to the given table.
+	 * Only reads the type table from the state, so it's safe to call from several threads
+	 * at once as long as each has its own table.
+	 */
+	void
+	decode_sv(pmat::sv& val, pmat::sv_table &into) const {
 		TRACE << "We have an SV starting at " << offset_;
 		pmat::sv v;
 		(*this)(v.type);
 		switch(v.type) {
 		case pmat::sv_type_t::SVtEND:
 			TRACE << "Last entry";
+			val = v;
 			return;
-			break;
 		case pmat::sv_type_t::SVtMAGIC: {
 			TRACE << "Magic?";
 			pmat::magic_t m;
-			(*this)(m.addr);
+			read_ptr(m.addr);
 			(*this)(m.type);
 			(*this)(m.flags);
 			TRACE << "Address " << (void *) m.addr << " is type " << (uint32_t) m.type << " with flags " << (uint32_t) m.flags;
-			(*this)(m.obj);
-			(*this)(m.ptr);
-			TRACE << "Obj = " << (void *) m.obj << ", ptr = " << (void *) m.obj;
-			// FIXME At this point, we want to look up the SV(s) and apply the magic.
+			read_ptr(m.obj);
+			read_ptr(m.ptr);
+			TRACE << "Obj = " << (void *) m.obj << ", ptr = " << (void *) m.ptr;
+			/* Usually follows the SV it belongs to, but that may be in another thread's table */
+			into.add_magic(m);
 			val = v;
 			return;
 		}
-		default: {
-			TRACE << " Have " << pmat_state_.types.size() << " to choose from";
-			pmat::type base_type = pmat_state_.types[0];
-			pmat::type spec_type = pmat_state_.types[(int) v.type];
-			DEBUG << "Scalar - will expect " << (size_t)base_type.headerlen << " bytes header, " << (size_t)base_type.nptrs << " pointers, " << (size_t)base_type.nstrs << " strings";
-			const size_t total = (size_t)base_type.headerlen + sizeof(pmat::ptr_t) * (size_t)base_type.nptrs;
-			DEBUG << " Calculated " << total << " bytes, plus " << (uint32_t)base_type.nstrs << " strings";
-
-			/* so we now have information about the total size of the serialized SV data, isolate it into
-			 * a new const_buffer and work with that first
-			 */
-			// auto sv_buf = const_buffer { buf_, 
-
-			/* Generic */
-			(*this)(v.address);
-			(*this)(v.refcnt);
-			(*this)(v.size);
-			(*this)(v.blessed);
-			if(pmat_state_.have_sv_at(v.address)) {
-				ERROR << "We read an SV that already exists? " << (void *)v.address << " at offset " << offset_;
-			}
+		default:
+			break;
+		}
 
-			/* Specific */
-			switch(v.type) {
-			case pmat::sv_type_t::SVtSCALAR: {
-				TRACE << "This is a scalar";
-				auto scalar = std::make_shared<pmat::sv_scalar>(v);
-				(*this)(scalar->flags);
-				if(scalar->flags & ~0x1f) {
-					ERROR << "Invalid flags " << (int)scalar->flags;
-				}
-				TRACE << " flags (" << (int)scalar->flags << ") => " << (scalar->flags & 1 ? "has IV" : "no IV")
-					<< (scalar->flags & 2 ? ", IV is UV" : "")
-					<< (scalar->flags & 4 ? ", NV" : "")
-					<< (scalar->flags & 8 ? ", STR" : "")
-					<< (scalar->flags & 16 ? ", UTF8" : "");
-				(*this)(scalar->iv);
-				TRACE << "IV = " << scalar->iv;
-				(*this)(scalar->nv);
-				TRACE << "NV = " << scalar->nv;
-				(*this)(scalar->pvlen);
-				TRACE << "pvlen = " << scalar->pvlen;
-				(*this)(scalar->ourstash);
-				TRACE << "stash = " << (void *) scalar->ourstash;
-				TRACE << "reading pv data";
-				(*this)(scalar->pv);
-				TRACE << "pv = " << scalar->pv;
-				pmat_state_.add_sv(scalar);
-				break;
+		const pmat::type &base_type = type_info(pmat::sv_type_t::SVtEND);
+		TRACE << "Will expect " << (size_t)base_type.headerlen << " bytes header, " << (size_t)base_type.nptrs << " pointers, " << (size_t)base_type.nstrs << " strings";
+
+		/* Generic */
+		{
+			const size_t hdr = offset_ + base_type.headerlen;
+			header_ptr(v.address, hdr);
+			header_field(v.refcnt, hdr);
+			header_field(v.size, hdr);
+			skip_to(hdr);
+			size_t nptrs = base_type.nptrs;
+			ptr_field(v.blessed, nptrs);
+			skip_ptrs(nptrs);
+			skip_strs(base_type.nstrs);
+		}
+		val = v;
+
+		if(pmat_state_.deferred() && has_body(v.type)) {
+			into.add_pending(v, offset_);
+			skip_body(v.type);
+			return;
+		}
+		decode_body(v, into.keys(), into.names(), [&into, &v](auto &&... body) { into.add(v, std::forward<decltype(body)>(body)...); });
+	}
+
+	/**
+	 * Decodes the type-specific part of an SV, which starts at the current offset, and hands
+	 * it to add() - or calls add() with nothing for types without a body. Hash keys are
+	 * interned in keys, and glob, stash and code names and files in names.
+	 */
+	template<typename F>
+	void
+	decode_body(const pmat::sv &v, pmat::string_table &keys, pmat::string_table &names, F &&add) const {
+		const pmat::type &spec_type = type_info(v.type);
+		const size_t hdr = offset_ + spec_type.headerlen;
+		size_t nptrs = spec_type.nptrs;
+		size_t nstrs = spec_type.nstrs;
+		switch(v.type) {
+		case pmat::sv_type_t::SVtSCALAR: {
+			TRACE << "This is a scalar";
+			pmat::sv_scalar scalar;
+			header_field(scalar.flags, hdr);
+			if(scalar.flags & ~0x1f) {
+				ERROR << "Invalid flags " << (int)scalar.flags;
 			}
-			case pmat::sv_type_t::SVtGLOB: {
-				TRACE << "This is a glob";
-				auto glob = std::make_shared<pmat::sv_glob>(v);
-				(*this)(*glob);
-				TRACE << " glob name " << glob->name << " from file " << std::string { glob->file };
-				pmat_state_.add_sv(glob);
-				break;
+			TRACE << " flags (" << (int)scalar.flags << ") => " << (scalar.flags & 1 ? "has IV" : "no IV")
+				<< (scalar.flags & 2 ? ", IV is UV" : "")
+				<< (scalar.flags & 4 ? ", NV" : "")
+				<< (scalar.flags & 8 ? ", STR" : "")
+				<< (scalar.flags & 16 ? ", UTF8" : "");
+			header_field(scalar.iv, hdr);
+			TRACE << "IV = " << scalar.iv;
+			header_field(scalar.nv, hdr);
+			TRACE << "NV = " << scalar.nv;
+			header_field(scalar.pvlen, hdr);
+			TRACE << "pvlen = " << scalar.pvlen;
+			skip_to(hdr);
+			ptr_field(scalar.ourstash, nptrs);
+			TRACE << "stash = " << (void *) scalar.ourstash;
+			TRACE << "reading pv data";
+			str_field(scalar.pv, nstrs);
+			TRACE << "pv = " << scalar.pv;
+			add(std::move(scalar));
+			break;
+		}
+		case pmat::sv_type_t::SVtGLOB: {
+			TRACE << "This is a glob";
+			pmat::sv_glob glob;
+			header_field(glob.line, hdr);
+			skip_to(hdr);
+			ptr_field(glob.stash, nptrs);
+			ptr_field(glob.scalar, nptrs);
+			ptr_field(glob.array, nptrs);
+			ptr_field(glob.hash, nptrs);
+			ptr_field(glob.code, nptrs);
+			ptr_field(glob.egv, nptrs);
+			ptr_field(glob.io, nptrs);
+			ptr_field(glob.form, nptrs);
+			name_field(glob.name, nstrs, names);
+			name_field(glob.file, nstrs, names);
+			TRACE << " glob name " << names.str(glob.name) << " from file " << names.str(glob.file);
+			add(std::move(glob));
+			break;
+		}
+		case pmat::sv_type_t::SVtARRAY: {
+			TRACE << "This be array";
+			pmat::sv_array array;
+			header_field(array.count, hdr);
+			header_field(array.flags, hdr);
+			skip_to(hdr);
+			skip_ptrs(nptrs);
+			skip_strs(nstrs);
+			nptrs = nstrs = 0;
+			TRACE << " has " << array.count << " elements with flags " << (int) array.flags;
+			need_items(array.count, Layout::ptr_size);
+			array.elements = pmat::span<pmat::ptr_t> { allocate<pmat::ptr_t>(array.count), array.count };
+			read_ptrs(array.elements.data(), array.count);
+			add(std::move(array));
+			break;
+		}
+		case pmat::sv_type_t::SVtHASH: {
+			TRACE << "Hash time";
+			pmat::sv_hash hash;
+			header_field(hash.count, hdr);
+			skip_to(hdr);
+			ptr_field(hash.backrefs, nptrs);
+			skip_ptrs(nptrs);
+			skip_strs(nstrs);
+			nptrs = nstrs = 0;
+			TRACE << "Has " << (int)hash.count << " key/value pairs";
+			hash_elements(hash, keys);
+			add(std::move(hash));
+			break;
+		}
+		case pmat::sv_type_t::SVtSTASH: {
+			TRACE << "Stash time";
+			pmat::sv_stash stash;
+			header_field(stash.count, hdr);
+			skip_to(hdr);
+			ptr_field(stash.backrefs, nptrs);
+			ptr_field(stash.mro_linear_all, nptrs);
+			ptr_field(stash.mro_linear_current, nptrs);
+			ptr_field(stash.mro_nextmethod, nptrs);
+			ptr_field(stash.mro_isa, nptrs);
+			name_field(stash.name, nstrs, names);
+			skip_ptrs(nptrs);
+			skip_strs(nstrs);
+			nptrs = nstrs = 0;
+			DEBUG << "Stash [" << names.str(stash.name) << "] " << " at offset " << offset_ << " has " << (int)stash.count << " key/value pairs, count = " << (int)(stash.count) << " backrefs " << (void *)stash.backrefs << " isa " << (void *)stash.mro_isa;
+			hash_elements(stash, keys);
+			add(std::move(stash));
+			break;
+		}
+		case pmat::sv_type_t::SVtREF: {
+			TRACE << "REF time";
+			pmat::sv_ref ref;
+			header_field(ref.flags, hdr);
+			skip_to(hdr);
+			ptr_field(ref.rv, nptrs);
+			ptr_field(ref.ourstash, nptrs);
+			if(ref.flags & 1) {
+				TRACE << "This ref is weak";
 			}
-			case pmat::sv_type_t::SVtARRAY: {
-				TRACE << "This be array";
-				auto array = std::make_shared<pmat::sv_array>(v);
-				(*this)(array->count);
-				(*this)(array->flags);
-				TRACE << " has " << array->count << " elements with flags " << (int) array->flags;
-				for(int i = 0; i < array->count; ++i) {
-					pmat::ptr_t ptr;
-					(*this)(ptr);
-					array->elements.emplace_back(ptr);
+			add(std::move(ref));
+			break;
+		}
+		case pmat::sv_type_t::SVtCODE: {
+			DEBUG << "We have code";
+			pmat::sv_code code;
+			header_field(code.line, hdr);
+			header_field(code.flags, hdr);
+			DEBUG << " has " << code.line << " with flags " << (int) code.flags;
+			header_ptr(code.op_root, hdr);
+			header_field(code.depth, hdr);
+			skip_to(hdr);
+			ptr_field(code.stash, nptrs);
+			ptr_field(code.glob, nptrs);
+			ptr_field(code.outside, nptrs);
+			ptr_field(code.padlist, nptrs);
+			ptr_field(code.constval, nptrs);
+			name_field(code.file, nstrs, names);
+			name_field(code.name, nstrs, names);
+			skip_ptrs(nptrs);
+			skip_strs(nstrs);
+			nptrs = nstrs = 0;
+			DEBUG << " file " << names.str(code.file) << ", name " << names.str(code.name);
+			pads_.clear();
+			pmat::sv_code_type_t type;
+			(*this)(type);
+			while(type != pmat::sv_code_type_t::SVCtEND) {
+				DEBUG << "Type is " << (int)type;
+				switch(type) {
+				case pmat::sv_code_type_t::SVCtCONSTSV: {
+					read_ptr(code.constsv_);
+					DEBUG << "Had constsv " << (void*)code.constsv_;
+					break;
 				}
-				assert(array->count == array->elements.size());
-				pmat_state_.add_sv(array);
-				break;
-			}
-			case pmat::sv_type_t::SVtHASH: {
-				TRACE << "Hash time";
-				auto hash = std::make_shared<pmat::sv_hash>(v);
-				(*this)(hash->count);
-				(*this)(hash->backrefs);
-				std::map<std::string, pmat::ptr_t> out;
-				TRACE << "Has " << (int)hash->count << " key/value pairs";
-				for(int i = 0; i < hash->count; ++i) {
-					std::string k;
-					pmat::ptr_t ptr;
-					(*this)(k);
-					(*this)(ptr);
-					out[k] = ptr;
-					TRACE << " key " << k << " == " << (void *) ptr;
+				case pmat::sv_code_type_t::SVCtCONSTIX: {
+					(*this)(code.constix_);
+					DEBUG << "Had constix " << code.constix_;
+					break;
 				}
-				pmat_state_.add_sv(hash);
-				break;
-			}
-			case pmat::sv_type_t::SVtSTASH: {
-				TRACE << "Stash time";
-				auto stash = std::make_shared<pmat::sv_stash>(v);
-				(*this)(stash->count);
-				(*this)(stash->backrefs);
-				(*this)(stash->mro_linear_all);
-				(*this)(stash->mro_linear_current);
-				(*this)(stash->mro_nextmethod);
-				(*this)(stash->mro_isa);
-				(*this)(stash->name);
-				// if(stash->name == "main");
-				std::map<std::string, pmat::ptr_t> out;
-				DEBUG << "Stash [" << stash->name << "] " << " at offset " << offset_ << " has " << (int)stash->count << " key/value pairs, count = " << (int)(stash->count) << " backrefs " << (void *)stash->backrefs << " isa " << (void *)stash->mro_isa;
-				for(int i = 0; i < stash->count; ++i) {
-					std::string k;
-					pmat::ptr_t ptr;
-					(*this)(k);
-					(*this)(ptr);
-					out[k] = ptr;
-					TRACE << " key " << k << " == " << (void *) ptr;
+				case pmat::sv_code_type_t::SVCtGVSV: {
+					read_ptr(code.gvsv_);
+					DEBUG << "Had GVSV " << (void *)code.gvsv_;
+					break;
 				}
-				pmat_state_.add_sv(stash);
-				break;
-			}
-			case pmat::sv_type_t::SVtREF: {
-				TRACE << "REF time";
-				auto ref = std::make_shared<pmat::sv_ref>(v);
-				(*this)(*ref);
-				if(ref->flags & 1) {
-					TRACE << "This ref is weak";
+				case pmat::sv_code_type_t::SVCtGVIX: {
+					(*this)(code.gvix_);
+					DEBUG << "Had GVIX " << code.gvix_;
+					break;
 				}
-				pmat_state_.add_sv(ref);
-				break;
-			}
-			case pmat::sv_type_t::SVtCODE: {
-				DEBUG << "We have code";
-				auto code = std::make_shared<pmat::sv_code>(v);
-				(*this)(code->line);
-				(*this)(code->flags);
-				DEBUG << " has " << code->line << " with flags " << (int) code->flags;
-				(*this)(code->op_root);
-				(*this)(code->depth);
-				(*this)(code->stash);
-				(*this)(code->glob);
-				(*this)(code->outside);
-				(*this)(code->padlist);
-				(*this)(code->constval);
-				(*this)(code->file);
-				(*this)(code->name);
-				DEBUG << " file " << code->file << ", name " << code->name;
-				pmat::sv_code_type_t type;
-				(*this)(type);
-				while(type != pmat::sv_code_type_t::SVCtEND) {
-					DEBUG << "Type is " << (int)type;
-					switch(type) {
-					case pmat::sv_code_type_t::SVCtCONSTSV: {
-						(*this)(code->constsv_);
-						DEBUG << "Had constsv " << (void*)code->constsv_;
-						break;
-					}
-					case pmat::sv_code_type_t::SVCtCONSTIX: {
-						(*this)(code->constix_);
-						DEBUG << "Had constix " << code->constix_;
-						break;
-					}
-					case pmat::sv_code_type_t::SVCtGVSV: {
-						(*this)(code->gvsv_);
-						DEBUG << "Had GVSV " << (void *)code->gvsv_;
-						break;
-					}
-					case pmat::sv_code_type_t::SVCtGVIX: {
-						(*this)(code->gvix_);
-						DEBUG << "Had GVIX " << code->gvix_;
-						break;
-					}
-					case pmat::sv_code_type_t::SVCtPADNAMES: {
-						(*this)(code->padnames_);
-						DEBUG << "Had padnames " << (void *)code->padnames_;
-						break;
-					}
-					case pmat::sv_code_type_t::SVCtPAD: {
-						auto cp = std::make_shared<pmat::sv_code_pad>();
-						(*this)(*cp);
-						DEBUG << "Had pad, depth " << cp->depth << " pad " << (void *)cp->pad;
-						if(cp->depth >= code->pads_.size()) code->pads_.resize(cp->depth + 1);
-						code->pads_[cp->depth] = cp->pad; // .emplace_back(cp);
-						break;
-					}
-					case pmat::sv_code_type_t::SVCtPADNAME: {
-						auto cp = std::make_shared<pmat::sv_code_padname>();
-						(*this)(*cp);
-						DEBUG << "Had padix " << cp->padix << " for pad " << cp->padname << " with stash " << (void *)cp->ourstash;
-						//if(cp.depth >= code->pads_.size()) code->pads_.resize(cp.depth + 1);
-						//code->pads_[cp.depth] = cp.pad; // .emplace_back(cp);
+				case pmat::sv_code_type_t::SVCtPADNAMES: {
+					read_ptr(code.padnames_);
+					DEBUG << "Had padnames " << (void *)code.padnames_;
+					break;
+				}
+				case pmat::sv_code_type_t::SVCtPAD: {
+					pmat::sv_code_pad cp;
+					(*this)(cp);
+					DEBUG << "Had pad, depth " << cp.depth << " pad " << (void *)cp.pad;
+					if(cp.depth > max_pad_depth) {
+						ERROR << "Pad depth " << cp.depth << " is beyond anything perl would recurse to, ignoring pad " << (void *)cp.pad << " at offset " << offset_;
 						break;
 					}
-					default: ERROR << "unknwon thing";
-					}
-					(*this)(type);
+					if(cp.depth >= pads_.size()) pads_.resize(cp.depth + 1);
+					pads_[cp.depth] = cp.pad;
+					break;
 				}
-				pmat_state_.add_sv(code);
-				break;
-			}
-			case pmat::sv_type_t::SVtIO: {
-				TRACE << "IO";
-				auto io = std::make_shared<pmat::sv_io>(v);
-				(*this)(*io);
-				pmat_state_.add_sv(io);
-				break;
-			}
-			case pmat::sv_type_t::SVtLVALUE: {
-				TRACE << "LVALUE";
-				auto lv = std::make_shared<pmat::sv_lvalue>(v);
-				(*this)(*lv);
-				pmat_state_.add_sv(lv);
-				break;
-			}
-			case pmat::sv_type_t::SVtREGEXP: {
-				TRACE << "Regexp";
-				auto re = std::make_shared<pmat::sv_regexp>(v);
-				pmat_state_.add_sv(re);
-				break;
+				case pmat::sv_code_type_t::SVCtPADNAME: {
+					pmat::sv_code_padname cp;
+					(*this)(cp);
+					DEBUG << "Had padix " << cp.padix << " for pad " << cp.padname << " with stash " << (void *)cp.ourstash;
+					break;
+				}
+				case pmat::sv_code_type_t::SVCtPADSV: {
+					pmat::sv_code_padsv cp;
+					(*this)(cp);
+					DEBUG << "Had padsv depth " << cp.depth << " padix " << cp.padix << " sv " << (void *)cp.sv;
+					break;
+				}
+				default:
+					ERROR << "Unknown code body type " << (int)type << " at offset " << offset_;
+					throw bad_message();
+				}
+				(*this)(type);
 			}
-			case pmat::sv_type_t::SVtFORMAT: {
-				TRACE << "Format";
-				auto form = std::make_shared<pmat::sv_format>(v);
-				pmat_state_.add_sv(form);
-				break;
+			if(!pads_.empty()) {
+				code.pads_ = pmat::span<pmat::ptr_t> { allocate<pmat::ptr_t>(pads_.size()), pads_.size() };
+				std::copy(pads_.begin(), pads_.end(), code.pads_.begin());
 			}
-			case pmat::sv_type_t::SVtINVLIST: {
-				TRACE << "Invlist";
-				auto invlist = std::make_shared<pmat::sv_invlist>(v);
-				pmat_state_.add_sv(invlist);
-				break;
+			add(std::move(code));
+			break;
+		}
+		case pmat::sv_type_t::SVtIO: {
+			TRACE << "IO";
+			pmat::sv_io io;
+			header_field(io.ifileno_, hdr);
+			header_field(io.ofileno_, hdr);
+			skip_to(hdr);
+			ptr_field(io.top, nptrs);
+			ptr_field(io.format, nptrs);
+			ptr_field(io.bottom, nptrs);
+			add(std::move(io));
+			break;
+		}
+		case pmat::sv_type_t::SVtLVALUE: {
+			TRACE << "LVALUE";
+			pmat::sv_lvalue lv;
+			header_field(lv.type, hdr);
+			header_field(lv.offset, hdr);
+			header_field(lv.length, hdr);
+			skip_to(hdr);
+			ptr_field(lv.target, nptrs);
+			add(std::move(lv));
+			break;
+		}
+		case pmat::sv_type_t::SVtREGEXP: {
+			TRACE << "Regexp";
+			add();
+			break;
+		}
+		case pmat::sv_type_t::SVtFORMAT: {
+			TRACE << "Format";
+			add();
+			break;
+		}
+		case pmat::sv_type_t::SVtINVLIST: {
+			TRACE << "Invlist";
+			add();
+			break;
+		}
+		case pmat::sv_type_t::SVtUNKNOWN: {
+			TRACE << "Unknown type, skipping by size field " << v.size;
+			return;
+		}
+		default:
+			ERROR << "Unknown type " << (uint32_t) v.type;
+			break;
+		}
+		skip_to(hdr);
+		skip_ptrs(nptrs);
+		skip_strs(nstrs);
+	}
+
+	/**
+	 * Reads the key/value pairs for a hash or stash into arena arrays, interning the keys in
+	 * the given table.
+	 */
+	void hash_elements(pmat::sv_hash &hash, pmat::string_table &keys) const {
+		/* Each pair is at least a length and a pointer, so a bogus count fails before we allocate for it */
+		need_items(hash.count, Layout::uint_size + Layout::ptr_size);
+		hash.keys = pmat::span<pmat::string_id_t> { allocate<pmat::string_id_t>(hash.count), hash.count };
+		hash.values = pmat::span<pmat::ptr_t> { allocate<pmat::ptr_t>(hash.count), hash.count };
+		for(pmat::uint_t i = 0; i < hash.count; ++i) {
+			pmat::uint_t length = 0;
+			pmat::str_t k;
+			if(str_length(length)) {
+				need(length);
+				k = pmat::str_t { asio::buffer_cast<char const*>(buf_), length };
+				forward(length);
 			}
-			case pmat::sv_type_t::SVtUNKNOWN: {
-				TRACE << "Unknown type, skipping by size field " << v.size;
-				// pmat_state_.add_sv(v);
-				break;
+			hash.keys[i] = intern(k, keys);
+			read_ptr(hash.values[i]);
+			TRACE << " key " << k << " == " << (void *) hash.values[i];
+		}
+	}
+
+	/**
+	 * The id for a string that's still a view into the buffer, which only gets copied (when
+	 * we're not zero-copy) the first time the table sees it.
+	 */
+	pmat::string_id_t intern(pmat::str_t s, pmat::string_table &table) const {
+		auto id = table.find(s);
+		if(id != pmat::no_string) return id;
+		if(!pmat_state_.zero_copy() && !s.empty()) {
+			auto copy = allocate<char>(s.size());
+			std::memcpy(copy, s.data(), s.size());
+			s = pmat::str_t { copy, s.size() };
+		}
+		return table.add(s);
+	}
+
+	/**
+	 * Steps over the next SV record without decoding it, using only the type table and the
+	 * element counts. Returns false once we've stepped over the end-of-heap marker.
+	 */
+	bool skip_sv() const {
+		pmat::sv_type_t type;
+		(*this)(type);
+		switch(type) {
+		case pmat::sv_type_t::SVtEND:
+			return false;
+		case pmat::sv_type_t::SVtMAGIC:
+			forward(3 * Layout::ptr_size + 2);
+			return true;
+		default:
+			break;
+		}
+		const pmat::type &base_type = type_info(pmat::sv_type_t::SVtEND);
+		forward(base_type.headerlen);
+		skip_ptrs(base_type.nptrs);
+		skip_strs(base_type.nstrs);
+		if(type != pmat::sv_type_t::SVtUNKNOWN)
+			skip_body(type);
+		return true;
+	}
+
+	/** Types that have a type-specific part to decode, see pmat::sv_table */
+	static bool has_body(pmat::sv_type_t type) {
+		switch(type) {
+		case pmat::sv_type_t::SVtSCALAR:
+		case pmat::sv_type_t::SVtREF:
+		case pmat::sv_type_t::SVtGLOB:
+		case pmat::sv_type_t::SVtARRAY:
+		case pmat::sv_type_t::SVtHASH:
+		case pmat::sv_type_t::SVtSTASH:
+		case pmat::sv_type_t::SVtCODE:
+		case pmat::sv_type_t::SVtIO:
+		case pmat::sv_type_t::SVtLVALUE:
+			return true;
+		default:
+			return false;
+		}
+	}
+
+	/** Steps over the type-specific part of an SV, as for skip_sv() */
+	void skip_body(pmat::sv_type_t type) const {
+		const pmat::type &spec_type = type_info(type);
+		const size_t hdr = offset_ + spec_type.headerlen;
+		pmat::uint_t count = 0;
+		const bool counted = type == pmat::sv_type_t::SVtARRAY
+			|| type == pmat::sv_type_t::SVtHASH
+			|| type == pmat::sv_type_t::SVtSTASH;
+		if(counted) header_field(count, hdr);
+		skip_to(hdr);
+		skip_ptrs(spec_type.nptrs);
+		skip_strs(spec_type.nstrs);
+
+		switch(type) {
+		case pmat::sv_type_t::SVtARRAY:
+			skip_ptrs(count);
+			break;
+		case pmat::sv_type_t::SVtHASH:
+		case pmat::sv_type_t::SVtSTASH:
+			for(; count; --count) {
+				skip_strs(1);
+				skip_ptrs(1);
 			}
-			default:
-				ERROR << "Unknown type " << (uint32_t) v.type;
-				for(int i = 0; i < (uint32_t)spec_type.headerlen; ++i) {
-					char ch;
-					(*this)(ch);
-				}
-				for(int i = 0; i < (uint32_t)spec_type.nptrs; ++i) {
-					pmat::ptr_t ptr;
-					(*this)(ptr);
-				}
-				for(int i = 0; i < (uint32_t)spec_type.nstrs; ++i) {
-					std::string str;
-					(*this)(str);
+			break;
+		case pmat::sv_type_t::SVtCODE: {
+			pmat::sv_code_type_t body;
+			for((*this)(body); body != pmat::sv_code_type_t::SVCtEND; (*this)(body)) {
+				switch(body) {
+				case pmat::sv_code_type_t::SVCtCONSTSV:
+				case pmat::sv_code_type_t::SVCtGVSV:
+				case pmat::sv_code_type_t::SVCtPADNAMES:
+					skip_ptrs(1);
+					break;
+				case pmat::sv_code_type_t::SVCtCONSTIX:
+				case pmat::sv_code_type_t::SVCtGVIX:
+					forward(Layout::uint_size);
+					break;
+				case pmat::sv_code_type_t::SVCtPAD:
+					forward(Layout::uint_size);
+					skip_ptrs(1);
+					break;
+				case pmat::sv_code_type_t::SVCtPADNAME:
+					forward(Layout::uint_size);
+					skip_strs(1);
+					skip_ptrs(1);
+					break;
+				case pmat::sv_code_type_t::SVCtPADSV:
+					forward(2 * Layout::uint_size);
+					skip_ptrs(1);
+					break;
+				default:
+					ERROR << "Unknown code body type " << (int)body << " at offset " << offset_;
+					throw bad_message();
 				}
-				// pmat_state_.add_sv(v);
-				break;
 			}
 			break;
 		}
+		default:
+			break;
 		}
-		val = v;
+	}
+
+	/**
+	 * The header is a plain sequence, other than the context type table which only
+	 * appears from format 0.2 onwards.
+	 */
+    void operator()(pmat::header& val) const {
+		(*this)(val.magic);
+		(*this)(val.flags);
+		(*this)(val.reserved1);
+		(*this)(val.major_ver);
+		(*this)(val.minor_ver);
+		(*this)(val.perl_ver);
+		/* We read the header before knowing the byte order, and perl_ver is the only part it matters for */
+		if(static_cast<bool>(val.flags.data & 0x01) != Layout::big_endian)
+			boost::endian::endian_reverse_inplace(val.perl_ver);
+		(*this)(val.types);
+		if(val.major_ver > 0 || val.minor_ver >= 2)
+			(*this)(val.contexts);
 	}
 
     void operator()(pmat::type& v) const {
@@ -533,22 +1035,122 @@ virtual ~reader()
 		TRACE << "PMAT state now has " << pmat_state_.contexts.size() << " contexts - " << (void*)(&pmat_state_);
 	}
 
+	/* Sections and code body entries with pointers in, see read_ptr() */
+    void operator()(pmat::roots& v) const {
+		read_ptr(v.undef);
+		read_ptr(v.yes);
+		read_ptr(v.no);
+		(*this)(v.other_roots);
+	}
+    void operator()(pmat::root& v) const {
+		(*this)(v.rootname);
+		read_ptr(v.ptr);
+	}
+    void operator()(pmat::stack& v) const {
+		(*this)(v.elem.count);
+		TRACE << "Stack - read " << v.elem.count << " items";
+		need_items(v.elem.count, Layout::ptr_size);
+		v.elem.items.resize(v.elem.count);
+		read_ptrs(v.elem.items.data(), v.elem.count);
+	}
+    void operator()(pmat::sv_code_pad& v) const {
+		(*this)(v.depth);
+		read_ptr(v.pad);
+	}
+    void operator()(pmat::sv_code_padname& v) const {
+		(*this)(v.padix);
+		(*this)(v.padname);
+		read_ptr(v.ourstash);
+	}
+    void operator()(pmat::sv_code_padsv& v) const {
+		(*this)(v.depth);
+		(*this)(v.padix);
+		read_ptr(v.sv);
+	}
+
+	/**
+	 * The heap is read in two phases when we have more than one thread: a quick scan
+	 * over the records to find where each SV starts, then the records are decoded in
+	 * chunks on a pool of workers. The results are added to the state in file order,
+	 * so the outcome is the same as the single-threaded path.
+	 */
     void operator()(pmat::heap& val) const {
 		TRACE << "Starting on the heap";
-		std::vector<pmat::sv> items;
-		bool active = true;
-		while(active) {
-			pmat::sv item;
-			(*this)(item);
-			if(item.type == pmat::sv_type_t::SVtEND) {
-				TRACE << "Item type 0 == end";
-				active = false;
-			} else {
-				TRACE << "Item type " << (uint32_t) item.type << ", size was " << item.size << " at address " << item.address;
+		if(threads_ <= 1) {
+			bool active = true;
+			while(active) {
+				pmat::sv item;
+				(*this)(item);
+				if(item.type == pmat::sv_type_t::SVtEND) {
+					TRACE << "Item type 0 == end";
+					active = false;
+				} else {
+					TRACE << "Item type " << (uint32_t) item.type << ", size was " << item.size << " at address " << item.address;
+				}
 			}
-        }
+			return;
+		}
+
+		std::vector<size_t> starts;
+		bool finished = false;
+		const size_t length = scan_records(starts, finished);
+		if(!finished) throw short_read();
+		DEBUG << "Heap has " << starts.size() << " records in " << length << " bytes, decoding on " << threads_ << " threads";
+		decode_records(starts);
+		forward(length);
     }
 
+	/**
+	 * Phase 1: finds where each complete SV record from the current offset starts, stopping
+	 * at the end-of-heap marker (setting finished) or at a record that runs past the end of
+	 * the buffer. Returns how many bytes the complete records, and the marker if we got to
+	 * it, take up.
+	 */
+	size_t scan_records(std::vector<size_t> &starts, bool &finished) const {
+		auto scan = slice(0);
+		size_t complete = 0;
+		finished = false;
+		try {
+			for(size_t at = 0; ; at = complete) {
+				if(!scan.skip_sv()) {
+					finished = true;
+					complete = scan.offset_ - offset_;
+					break;
+				}
+				starts.push_back(at);
+				complete = scan.offset_ - offset_;
+			}
+		} catch(const bs::system_error &e) {
+			if(!is_short_read(e)) throw;
+		}
+		return complete;
+	}
+
+	/**
+	 * Phases 2 and 3: decodes the records at the given offsets from here, in chunks on a
+	 * pool of workers, each chunk into its own table. The tables are then added to the
+	 * state in file order.
+	 */
+	void decode_records(const std::vector<size_t> &starts) const {
+		const size_t chunks = (starts.size() + heap_chunk_size - 1) / heap_chunk_size;
+		std::vector<pmat::sv_table> decoded(chunks);
+		pmat::parallel_for(threads_, starts.size(), heap_chunk_size, [&](size_t begin, size_t end) {
+			auto r = slice(starts[begin]);
+			auto &into = decoded[begin / heap_chunk_size];
+			for(size_t i = begin; i < end; ++i) {
+				pmat::sv item;
+				r.decode_sv(item, into);
+			}
+		});
+
+		/* Called once for a mapped dump, but once a window for a stream, so grow geometrically */
+		auto &svs = pmat_state_.svs();
+		const size_t want = svs.size() + starts.size();
+		if(want > svs.capacity()) svs.reserve(std::max(want, 2 * svs.capacity()));
+		for(auto &chunk : decoded)
+			svs.append(std::move(chunk));
+	}
+
 #if(0)
     void operator()(boost::posix_time::ptime& val) const {
         std::string iso_str;
@@ -601,23 +1203,230 @@ virtual ~reader()
     auto operator()(T & val) const ->
     typename std::enable_if<boost::fusion::traits::is_sequence<T>::value>::type {
 		TRACE << DEBUG_TYPE((T)) << " - iteration";
-        boost::fusion::for_each(val, *this);
+        boost::fusion::for_each(val, [this](auto &v) { (*this)(v); });
     }
+
+private:
+	/** How many heap records each worker takes at a time */
+	static constexpr size_t heap_chunk_size = 4096;
+	/**
+	 * Deepest CV recursion we take a pad for. Pads are indexed by depth, so without a
+	 * limit a corrupt depth would have us allocating gigabytes for one CV.
+	 */
+	static constexpr pmat::uint_t max_pad_depth = 1 << 20;
+
+	size_t start_;
+	size_t threads_;
+	bool tracks_offset_;
+	/** The whole dump, for seek() */
+	asio::const_buffer origin_;
+	/** Our block in the state's arena */
+	mutable pmat::arena_cursor arena_;
+	/** Pad addresses for the CV being read, before they're moved to the arena */
+	mutable std::vector<pmat::ptr_t> pads_;
 };
 
+/** For the header, and anything else that doesn't depend on the layout */
+using reader = basic_reader<native_layout>;
+
 /**
  * When reading, we provide the base object and the state structure.
  * The base object is the one we're populating - header, roots, stack etc.
  * - and the state object acts as a manager for the updates to internal state.
  */
-template<typename T>
-std::pair<T, asio::const_buffer> read(asio::const_buffer b, pmat::state_t &s)
+template<typename T, class Layout = native_layout>
+std::pair<T, asio::const_buffer> read(asio::const_buffer b, pmat::state_t &s, size_t threads = 1)
 {
-	auto r = reader { std::move(b), s };
+	auto r = basic_reader<Layout> { std::move(b), s, threads };
 	T res;
 	(r)(res);
 	return std::make_pair(res, r.buf_);
 }
 
+/**
+ * The writer is the reader in reverse: it takes the same Fusion definitions and puts
+ * them out in the byte order and widths of the given layout. Sections are written whole;
+ * SV records are made up from the helpers, following doc/format.txt, since the SV
+ * classes here only hold what we keep from a record rather than the record itself.
+ */
+template<class Layout>
+class basic_writer {
+public:
+	explicit basic_writer(std::ostream &out):out_(out),offset_{0} { }
+
+	/** Bytes written so far */
+	size_t offset() const { return offset_; }
+
+	void raw(const void *data, size_t n) const {
+		out_.write(static_cast<const char *>(data), n);
+		offset_ += n;
+	}
+
+	/** A fixed-width unsigned integer in the dump's byte order */
+	template<class T>
+	void store(T v) const {
+		static_assert(std::is_unsigned<T>::value, "store() takes unsigned types");
+		v = Layout::big_endian ? net::hton(v) : boost::endian::native_to_little(v);
+		raw(&v, sizeof(v));
+	}
+
+	/** A UINT, narrowed to the dump's width */
+	void operator()(const pmat::uint_t &val) const {
+		store(static_cast<typename Layout::uint_type>(val));
+	}
+	void write_ptr(pmat::ptr_t val) const {
+		store(static_cast<typename Layout::ptr_type>(val));
+	}
+	void write_ptrs(const pmat::ptr_t *p, size_t n) const {
+		for(size_t i = 0; i < n; ++i) write_ptr(p[i]);
+	}
+	/** The all-ones length that marks an undef string */
+	void undef_str() const {
+		store(static_cast<typename Layout::uint_type>(~typename Layout::uint_type{0}));
+	}
+
+	void operator()(const double &val) const {
+		if(Layout::long_double) {
+			unsigned char b[10];
+			double_to_extended(val, b, Layout::big_endian);
+			raw(b, sizeof(b));
+			return;
+		}
+		uint64_t bits;
+		std::memcpy(&bits, &val, sizeof(bits));
+		store(bits);
+	}
+
+	/**
+	 * Other numeric types are fixed width, enums go out as their underlying type and
+	 * constants as their value.
+	 */
+	template<class T>
+	auto operator()(const T &val) const ->
+		typename std::enable_if<std::is_integral<T>::value>::type {
+		store(static_cast<typename std::make_unsigned<T>::type>(val));
+	}
+	template<class T>
+	auto operator()(const T &val) const ->
+		typename std::enable_if<std::is_enum<T>::value>::type {
+		(*this)(static_cast<typename std::underlying_type<T>::type>(val));
+	}
+	template<class T, T v>
+	void operator()(std::integral_constant<T, v>) const {
+		(*this)(v);
+	}
+
+	void operator()(const std::string &val) const {
+		(*this)(pmat::str_t { val });
+	}
+	void operator()(const pmat::str_t &val) const {
+		(*this)(static_cast<pmat::uint_t>(val.size()));
+		raw(val.data(), val.size());
+	}
+	void operator()(const pmat::flags_t &val) const {
+		(*this)(val.data);
+	}
+
+	template<class T>
+	void operator()(const pmat::vec<uint32_t, T> &val) const {
+		(*this)(static_cast<uint32_t>(val.items.size()));
+		for(const auto &v : val.items) (*this)(v);
+	}
+	template<class T>
+	void operator()(const pmat::vec<uint8_t, T> &val) const {
+		(*this)(static_cast<uint8_t>(val.items.size()));
+		for(const auto &v : val.items) (*this)(v);
+	}
+
+	/**
+	 * As for the reader, the magic is four characters whatever the byte order, perl_ver
+	 * goes in the dump's byte order and contexts only from 0.2.
+	 */
+	void operator()(const pmat::header &val) const {
+		const uint32_t magic = val.magic;
+		raw(&magic, sizeof(magic));
+		(*this)(val.flags);
+		(*this)(val.reserved1);
+		(*this)(val.major_ver);
+		(*this)(val.minor_ver);
+		(*this)(val.perl_ver);
+		(*this)(val.types);
+		if(val.major_ver > 0 || val.minor_ver >= 2)
+			(*this)(val.contexts);
+	}
+
+	/* Sections and code body entries with pointers in, see write_ptr() */
+	void operator()(const pmat::roots &v) const {
+		write_ptr(v.undef);
+		write_ptr(v.yes);
+		write_ptr(v.no);
+		(*this)(v.other_roots);
+	}
+	void operator()(const pmat::root &v) const {
+		(*this)(v.rootname);
+		write_ptr(v.ptr);
+	}
+	void operator()(const pmat::stack &v) const {
+		(*this)(static_cast<pmat::uint_t>(v.elem.items.size()));
+		write_ptrs(v.elem.items.data(), v.elem.items.size());
+	}
+	void operator()(const pmat::sv_code_pad &v) const {
+		(*this)(v.depth);
+		write_ptr(v.pad);
+	}
+	void operator()(const pmat::sv_code_padname &v) const {
+		(*this)(v.padix);
+		(*this)(v.padname);
+		write_ptr(v.ourstash);
+	}
+	void operator()(const pmat::sv_code_padsv &v) const {
+		(*this)(v.depth);
+		(*this)(v.padix);
+		write_ptr(v.sv);
+	}
+
+	/** The fields common to every SV record, sized as types() has them. The type-specific part follows */
+	void sv_header(const pmat::sv &v) const {
+		(*this)(v.type);
+		write_ptr(v.address);
+		(*this)(v.refcnt);
+		(*this)(static_cast<pmat::uint_t>(v.size));
+		write_ptr(v.blessed);
+	}
+
+	/** The type table a format 0.1 dump from a perl with this layout would have */
+	static pmat::typevec8_t types() {
+		const uint8_t u = Layout::uint_size, p = Layout::ptr_size, n = Layout::nv_size;
+		pmat::typevec8_t t;
+		t.items = {
+			pmat::type { static_cast<uint8_t>(p + 4 + u), 1, 0 }, /* common */
+			pmat::type { u, 8, 2 }, /* GLOB */
+			pmat::type { static_cast<uint8_t>(1 + u + n + u), 1, 1 }, /* SCALAR */
+			pmat::type { 1, 2, 0 }, /* REF */
+			pmat::type { static_cast<uint8_t>(u + 1), 0, 0 }, /* ARRAY */
+			pmat::type { u, 1, 0 }, /* HASH */
+			pmat::type { u, 5, 1 }, /* STASH */
+			pmat::type { static_cast<uint8_t>(u + 1 + p), 5, 1 }, /* CODE */
+			pmat::type { 0, 3, 0 }, /* IO */
+			pmat::type { static_cast<uint8_t>(1 + u + u), 1, 0 }, /* LVALUE */
+			pmat::type { 0, 0, 0 }, /* REGEXP */
+			pmat::type { 0, 0, 0 }, /* FORMAT */
+			pmat::type { 0, 0, 0 }, /* INVLIST */
+		};
+		t.count = t.items.size();
+		return t;
+	}
+
+	template<class T>
+	auto operator()(const T &val) const ->
+	typename std::enable_if<boost::fusion::traits::is_sequence<T>::value>::type {
+		boost::fusion::for_each(val, [this](const auto &v) { (*this)(v); });
+	}
+
+private:
+	std::ostream &out_;
+	mutable size_t offset_;
+};
+
 }
 
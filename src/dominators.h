@@ -0,0 +1,176 @@
+#pragma once
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "sv_table.h"
+#include "ref_graph.h"
+
+namespace pmat {
+	/**
+	 * Immediate dominators and retained sizes for every SV reachable from the roots.
+	 *
+	 * The graph is rooted at a synthetic super-root with an edge to each root SV, and
+	 * only strong edges are followed - a weak reference never keeps anything alive.
+	 * Dominators come from the semi-NCA algorithm (Georgiadis): semidominators as in
+	 * Lengauer-Tarjan with simple path compression, then each idom is found by walking
+	 * up from the DFS parent. Everything is iterative and the working arrays are all
+	 * one entry per SV, so it copes with very deep reference chains and stays linear
+	 * in memory.
+	 *
+	 * The retained size of an SV is its own size plus that of everything it dominates,
+	 * i.e. what would be freed if it went away.
+	 */
+	class dominator_tree {
+	public:
+		/** idom() for an SV only dominated by the super-root */
+		static constexpr pmat::sv_id_t super_root = pmat::no_sv - 1;
+
+		dominator_tree(
+			const pmat::sv_table &svs,
+			const pmat::ref_graph &graph,
+			const std::vector<pmat::sv_id_t> &roots
+		) {
+			const size_t n = svs.size();
+			constexpr uint32_t none = ~uint32_t{0};
+
+			/* Preorder DFS over strong edges. Preorder 0 is the super-root. */
+			std::vector<uint32_t> pre(n, none);
+			std::vector<pmat::sv_id_t> vertex { super_root };
+			std::vector<uint32_t> parent { 0 };
+			{
+				std::vector<std::pair<pmat::sv_id_t, uint64_t>> stack;
+				auto visit = [&](pmat::sv_id_t id, uint32_t from) {
+					pre[id] = static_cast<uint32_t>(vertex.size());
+					vertex.push_back(id);
+					parent.push_back(from);
+					stack.emplace_back(id, 0);
+				};
+				for(auto r : roots) {
+					if(r == pmat::no_sv || pre[r] != none) continue;
+					visit(r, 0);
+					while(!stack.empty()) {
+						auto &top = stack.back();
+						const auto out = graph.out(top.first);
+						if(top.second == out.size()) {
+							stack.pop_back();
+							continue;
+						}
+						const auto &e = out[top.second++];
+						if(e.kind == pmat::edge_kind_t::strong && pre[e.to] == none)
+							visit(e.to, pre[top.first]);
+					}
+				}
+			}
+			const uint32_t count = static_cast<uint32_t>(vertex.size());
+			reachable_ = count - 1;
+
+			std::vector<bool> is_root(n, false);
+			for(auto r : roots)
+				if(r != pmat::no_sv) is_root[r] = true;
+
+			/* Semidominators, in reverse preorder */
+			std::vector<uint32_t> semi(count), label(count), ancestor(count, none);
+			for(uint32_t i = 0; i < count; ++i) semi[i] = label[i] = i;
+			std::vector<uint32_t> path;
+			auto eval = [&](uint32_t v) {
+				if(ancestor[v] == none) return v;
+				/* Compress the ancestor chain, the iterative version of the usual recursion */
+				path.clear();
+				for(uint32_t u = v; ancestor[ancestor[u]] != none; u = ancestor[u])
+					path.push_back(u);
+				for(auto it = path.rbegin(); it != path.rend(); ++it) {
+					const auto u = *it, a = ancestor[u];
+					if(semi[label[a]] < semi[label[u]]) label[u] = label[a];
+					ancestor[u] = ancestor[a];
+				}
+				return label[v];
+			};
+			for(uint32_t i = count - 1; i > 0; --i) {
+				const auto id = vertex[i];
+				if(is_root[id]) semi[i] = 0;
+				for(const auto &in : graph.in(id)) {
+					if(in.kind != pmat::edge_kind_t::strong || pre[in.from] == none) continue;
+					const auto u = eval(pre[in.from]);
+					if(semi[u] < semi[i]) semi[i] = semi[u];
+				}
+				ancestor[i] = parent[i];
+			}
+			std::vector<uint32_t>().swap(label);
+			std::vector<uint32_t>().swap(ancestor);
+
+			/* Immediate dominators, in preorder */
+			std::vector<uint32_t> idom(count, 0);
+			for(uint32_t i = 1; i < count; ++i) {
+				auto d = parent[i];
+				while(d > semi[i]) d = idom[d];
+				idom[i] = d;
+			}
+
+			/* Retained sizes, children before parents */
+			idom_.assign(n, pmat::no_sv);
+			retained_.assign(n, 0);
+			for(uint32_t i = count - 1; i > 0; --i) {
+				const auto id = vertex[i];
+				retained_[id] += svs.sv_size(id);
+				idom_[id] = idom[i] == 0 ? super_root : vertex[idom[i]];
+				if(idom[i] != 0) retained_[vertex[idom[i]]] += retained_[id];
+			}
+		}
+
+		/** The immediate dominator of an SV, super_root, or no_sv if it isn't reachable */
+		pmat::sv_id_t idom(pmat::sv_id_t id) const { return idom_[id]; }
+		/** Bytes freed if this SV went away, 0 if it isn't reachable */
+		uint64_t retained(pmat::sv_id_t id) const { return retained_[id]; }
+		bool reachable(pmat::sv_id_t id) const { return idom_[id] != pmat::no_sv; }
+		size_t reachable() const { return reachable_; }
+
+		/**
+		 * Retained bytes per class, given a class for each SV. An SV only counts if none of
+		 * its dominators has the same class, so nested instances (a tree of nodes, say)
+		 * aren't counted twice.
+		 */
+		std::vector<uint64_t> retained_by_class(const std::vector<uint32_t> &classes, size_t class_count) const {
+			const size_t n = idom_.size();
+			auto parent_of = [&](pmat::sv_id_t id) -> size_t { return idom_[id] == super_root ? n : idom_[id]; };
+
+			/* Children of each SV in the dominator tree, with the super-root at n */
+			std::vector<uint64_t> first(n + 2, 0);
+			for(pmat::sv_id_t id = 0; id < n; ++id)
+				if(reachable(id)) ++first[parent_of(id) + 1];
+			for(size_t i = 0; i <= n; ++i) first[i + 1] += first[i];
+			std::vector<pmat::sv_id_t> children(first[n + 1]);
+			{
+				std::vector<uint64_t> at(first.begin(), first.end() - 1);
+				for(pmat::sv_id_t id = 0; id < n; ++id)
+					if(reachable(id)) children[at[parent_of(id)]++] = id;
+			}
+
+			std::vector<uint32_t> active(class_count, 0);
+			std::vector<uint64_t> out(class_count, 0);
+			std::vector<std::pair<size_t, uint64_t>> stack { { n, first[n] } };
+			while(!stack.empty()) {
+				auto &top = stack.back();
+				if(top.second == first[top.first + 1]) {
+					if(top.first != n) --active[classes[top.first]];
+					stack.pop_back();
+					continue;
+				}
+				const auto id = children[top.second++];
+				if(!active[classes[id]]++) out[classes[id]] += retained_[id];
+				stack.emplace_back(id, first[id]);
+			}
+			return out;
+		}
+
+		size_t memory_used() const {
+			return idom_.capacity() * sizeof(pmat::sv_id_t) + retained_.capacity() * sizeof(uint64_t);
+		}
+
+	private:
+		std::vector<pmat::sv_id_t> idom_;
+		std::vector<uint64_t> retained_;
+		size_t reachable_;
+	};
+};
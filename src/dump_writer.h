@@ -0,0 +1,312 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "pmat_file.h"
+#include "reachability.h"
+
+namespace pmat {
+	/** What to leave out when writing a dump back out, see pmat::dump_writer */
+	struct dump_filter {
+		/** Only keep SVs reachable from these packages' stashes - everything if empty */
+		std::vector<std::string> packages;
+		/** Whether weak references count when working out what's reachable */
+		bool follow_weak = true;
+		/** Drop the string from scalars with more than this many bytes of it, 0 for no limit */
+		size_t max_pv = 0;
+		/** Leave out scalars that aren't blessed */
+		bool drop_unblessed_scalars = false;
+	};
+
+	/**
+	 * Writes a loaded dump back out as PMAT, in the layout it came in, leaving out what the
+	 * filter says to. The result is a format 0.1 dump that we, and anything else reading
+	 * PMAT, can load like the original.
+	 *
+	 * Pointers to SVs that were left out are written as null, and hash entries holding
+	 * them are dropped, so the smaller dump doesn't gain dangling pointers. Stripped
+	 * strings lose their STR flag but keep their length, and SV sizes are untouched, so
+	 * size reports on the cut-down dump still describe the original SVs. Magic goes out
+	 * straight after the SV it's attached to. Only what we keep
+	 * from a dump can go back into it: contexts and code body pad names and pad SVs are
+	 * not written, and neither is anything the type table had beyond what we know about.
+	 *
+	 * Needs every body, so the state should have been loaded with the reference graph.
+	 */
+	class dump_writer {
+	public:
+		dump_writer(const pmat_file &pf, const dump_filter &filter, size_t threads = 1):pf_(pf),filter_(filter),kept_{0} {
+			const auto &state = pf_.state();
+			const auto &svs = state.svs();
+			for(const auto &r : state.roots()) {
+				if(r.first == "undef") undef_ = r.second;
+				else if(r.first == "yes") yes_ = r.second;
+				else if(r.first == "no") no_ = r.second;
+			}
+
+			keep_.assign(svs.size(), true);
+			if(!filter_.packages.empty()) {
+				/* Compared by id, so only names the dump actually has can match */
+				std::unordered_set<pmat::string_id_t> packages;
+				for(const auto &p : filter_.packages) {
+					const auto name = svs.names().find(p);
+					if(name != pmat::no_string) packages.insert(name);
+				}
+				std::vector<pmat::sv_id_t> from;
+				for(pmat::sv_id_t id = 0; id < svs.size(); ++id) {
+					if(svs.type(id) != pmat::sv_type_t::SVtSTASH) continue;
+					state.ensure_body(id);
+					const auto name = svs.body<pmat::sv_stash>(id).name;
+					if(name != pmat::no_string && packages.count(name)) from.push_back(id);
+				}
+				if(from.empty()) WARN << "None of the packages to keep have a stash in the dump";
+				pmat::reach_set reached { state.graph(), from, filter_.follow_weak, threads };
+				for(pmat::sv_id_t id = 0; id < svs.size(); ++id)
+					keep_[id] = reached.reached(id);
+			}
+			if(filter_.drop_unblessed_scalars) {
+				for(pmat::sv_id_t id = 0; id < svs.size(); ++id)
+					if(svs.type(id) == pmat::sv_type_t::SVtSCALAR && svs.blessed(id) == 0) keep_[id] = false;
+			}
+			/* Whatever we keep needs the stash it's blessed into, if only for the name */
+			for(pmat::sv_id_t id = 0; id < svs.size(); ++id) {
+				if(!keep_[id] || !svs.blessed(id)) continue;
+				const auto stash = state.sv_at(svs.blessed(id));
+				if(stash != pmat::no_sv) keep_[stash] = true;
+			}
+			for(pmat::sv_id_t id = 0; id < svs.size(); ++id)
+				if(keep_[id] && !immortal(svs.address(id))) ++kept_;
+		}
+
+		/** How many heap SVs write() puts out */
+		size_t kept() const { return kept_; }
+
+		/** Writes the dump, returning its size in bytes */
+		size_t write(std::ostream &out) const {
+			size_t written = 0;
+			detail::with_layout(pf_.header_flags(), [&](auto layout) { written = this->write_as<decltype(layout)>(out); });
+			return written;
+		}
+
+	private:
+		bool immortal(pmat::ptr_t p) const { return p == undef_ || p == yes_ || p == no_; }
+
+		/** A pointer as it goes in the output: null if it was to an SV we're leaving out */
+		pmat::ptr_t ptr(pmat::ptr_t p) const {
+			if(p == 0 || immortal(p)) return p;
+			const auto id = pf_.state().sv_at(p);
+			/* Dangling in the original too, so leave it as it was */
+			if(id == pmat::no_sv) return p;
+			return keep_[id] ? p : 0;
+		}
+
+		template<class L>
+		size_t write_as(std::ostream &out) const {
+			const detail::basic_writer<L> w { out };
+			const auto &state = pf_.state();
+			const auto &svs = state.svs();
+
+			pmat::header hdr;
+			hdr.flags = pf_.header_flags();
+			hdr.major_ver = 0;
+			hdr.minor_ver = 1;
+			/* pmat_file keeps it the other way round, see pmat_file::perl_version_string() */
+			hdr.perl_ver = net::ntoh(pf_.perl_version());
+			hdr.types = detail::basic_writer<L>::types();
+			w(hdr);
+
+			pmat::roots roots;
+			roots.undef = undef_;
+			roots.yes = yes_;
+			roots.no = no_;
+			for(const auto &r : state.roots()) {
+				if(r.first == "undef" || r.first == "yes" || r.first == "no") continue;
+				roots.other_roots.items.push_back(pmat::root { r.first, ptr(r.second) });
+			}
+			w(roots);
+
+			pmat::stack stack;
+			for(auto p : state.stack())
+				if(ptr(p)) stack.elem.items.push_back(p);
+			w(stack);
+
+			std::vector<pmat::ptr_t> elems;
+			for(pmat::sv_id_t id = 0; id < svs.size(); ++id) {
+				if(!keep_[id] || immortal(svs.address(id))) continue;
+				state.ensure_body(id);
+				auto v = svs.header(id);
+				switch(v.type) {
+				case pmat::sv_type_t::SVtPADLIST:
+				case pmat::sv_type_t::SVtPADNAMES:
+				case pmat::sv_type_t::SVtPAD:
+					v.type = pmat::sv_type_t::SVtARRAY;
+					break;
+				default:
+					break;
+				}
+				v.blessed = ptr(v.blessed);
+				w.sv_header(v);
+				write_body(w, svs, id, v.type, elems);
+				for(const auto &mg : svs.magic(id)) {
+					w(pmat::sv_type_t::SVtMAGIC);
+					w.write_ptr(v.address);
+					w(mg.type);
+					w(mg.flags);
+					w.write_ptr(ptr(mg.obj));
+					/* Not necessarily an SV, so left as it was */
+					w.write_ptr(mg.ptr);
+				}
+			}
+			w(pmat::sv_type_t::SVtEND);
+			return w.offset();
+		}
+
+		/** The type-specific part of a record, in the order the reader takes it */
+		template<class L>
+		void write_body(const detail::basic_writer<L> &w, const pmat::sv_table &svs, pmat::sv_id_t id, pmat::sv_type_t type, std::vector<pmat::ptr_t> &elems) const {
+			switch(type) {
+			case pmat::sv_type_t::SVtSCALAR: {
+				const auto &scalar = svs.body<pmat::sv_scalar>(id);
+				const bool has_pv = scalar.flags & 0x08;
+				const bool strip = has_pv && filter_.max_pv && scalar.pv.size() > filter_.max_pv;
+				w(static_cast<uint8_t>(strip ? scalar.flags & ~0x18 : scalar.flags));
+				w(static_cast<pmat::uint_t>(scalar.iv));
+				w(scalar.nv);
+				w(scalar.pvlen);
+				w.write_ptr(ptr(scalar.ourstash));
+				if(has_pv && !strip) w(scalar.pv);
+				else w.undef_str();
+				break;
+			}
+			case pmat::sv_type_t::SVtREF: {
+				const auto &ref = svs.body<pmat::sv_ref>(id);
+				w(ref.flags);
+				w.write_ptr(ptr(ref.rv));
+				w.write_ptr(ptr(ref.ourstash));
+				break;
+			}
+			case pmat::sv_type_t::SVtGLOB: {
+				const auto &glob = svs.body<pmat::sv_glob>(id);
+				w(glob.line);
+				for(auto p : { glob.stash, glob.scalar, glob.array, glob.hash, glob.code, glob.egv, glob.io, glob.form })
+					w.write_ptr(ptr(p));
+				write_name(w, svs, glob.name);
+				write_name(w, svs, glob.file);
+				break;
+			}
+			case pmat::sv_type_t::SVtARRAY: {
+				const auto &array = svs.body<pmat::sv_array>(id);
+				/* Nulled rather than dropped, since pads are looked up by index */
+				elems.clear();
+				for(auto p : array.elements) elems.push_back(ptr(p));
+				w(static_cast<pmat::uint_t>(elems.size()));
+				w(array.flags);
+				w.write_ptrs(elems.data(), elems.size());
+				break;
+			}
+			case pmat::sv_type_t::SVtHASH: {
+				const auto &hash = svs.body<pmat::sv_hash>(id);
+				w(live_entries(hash));
+				w.write_ptr(ptr(hash.backrefs));
+				write_entries(w, svs, hash);
+				break;
+			}
+			case pmat::sv_type_t::SVtSTASH: {
+				const auto &stash = svs.body<pmat::sv_stash>(id);
+				w(live_entries(stash));
+				for(auto p : { stash.backrefs, stash.mro_linear_all, stash.mro_linear_current, stash.mro_nextmethod, stash.mro_isa })
+					w.write_ptr(ptr(p));
+				write_name(w, svs, stash.name);
+				write_entries(w, svs, stash);
+				break;
+			}
+			case pmat::sv_type_t::SVtCODE: {
+				const auto &code = svs.body<pmat::sv_code>(id);
+				w(code.line);
+				w(code.flags);
+				/* Into the op tree rather than at an SV */
+				w.write_ptr(code.op_root);
+				for(auto p : { code.stash, code.glob, code.outside, code.padlist, code.constval })
+					w.write_ptr(ptr(p));
+				write_name(w, svs, code.file);
+				if(code.constsv_) {
+					w(pmat::sv_code_type_t::SVCtCONSTSV);
+					w.write_ptr(ptr(code.constsv_));
+				}
+				if(code.constix_) {
+					w(pmat::sv_code_type_t::SVCtCONSTIX);
+					w(code.constix_);
+				}
+				if(code.gvsv_) {
+					w(pmat::sv_code_type_t::SVCtGVSV);
+					w.write_ptr(ptr(code.gvsv_));
+				}
+				if(code.gvix_) {
+					w(pmat::sv_code_type_t::SVCtGVIX);
+					w(code.gvix_);
+				}
+				if(code.padnames_) {
+					w(pmat::sv_code_type_t::SVCtPADNAMES);
+					w.write_ptr(ptr(code.padnames_));
+				}
+				for(size_t depth = 0; depth < code.pads_.size(); ++depth) {
+					if(!code.pads_[depth]) continue;
+					w(pmat::sv_code_type_t::SVCtPAD);
+					w(pmat::sv_code_pad { depth, ptr(code.pads_[depth]) });
+				}
+				w(pmat::sv_code_type_t::SVCtEND);
+				break;
+			}
+			case pmat::sv_type_t::SVtIO: {
+				const auto &io = svs.body<pmat::sv_io>(id);
+				for(auto p : { io.top, io.format, io.bottom })
+					w.write_ptr(ptr(p));
+				break;
+			}
+			case pmat::sv_type_t::SVtLVALUE: {
+				const auto &lv = svs.body<pmat::sv_lvalue>(id);
+				w(lv.type);
+				w(lv.offset);
+				w(lv.length);
+				w.write_ptr(ptr(lv.target));
+				break;
+			}
+			default:
+				break;
+			}
+		}
+
+		/** Hash entries we keep: those whose value is still there, or was never an SV we had */
+		pmat::uint_t live_entries(const pmat::sv_hash &hash) const {
+			pmat::uint_t n = 0;
+			for(auto p : hash.values)
+				if(ptr(p) || !p) ++n;
+			return n;
+		}
+		template<class L>
+		void write_entries(const detail::basic_writer<L> &w, const pmat::sv_table &svs, const pmat::sv_hash &hash) const {
+			for(size_t i = 0; i < hash.values.size(); ++i) {
+				const auto p = hash.values[i];
+				if(!ptr(p) && p) continue;
+				w(svs.keys().str(hash.keys[i]));
+				w.write_ptr(p);
+			}
+		}
+
+		template<class L>
+		static void write_name(const detail::basic_writer<L> &w, const pmat::sv_table &svs, pmat::string_id_t name) {
+			if(name == pmat::no_string) w.undef_str();
+			else w(svs.names().str(name));
+		}
+
+		const pmat_file &pf_;
+		dump_filter filter_;
+		/** By SV id, whether it goes in the output */
+		std::vector<bool> keep_;
+		size_t kept_;
+		pmat::ptr_t undef_ = 0, yes_ = 0, no_ = 0;
+	};
+};
@@ -0,0 +1,369 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <sys/stat.h>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "pmat_file.h"
+#include "Log.h"
+
+namespace pmat {
+	/** Column items holding pointers to other data, which have to be relocated in an index */
+	template<typename T> struct relocatable : std::false_type { };
+	template<> struct relocatable<pmat::str_t> : std::true_type { };
+	template<> struct relocatable<pmat::sv_scalar> : std::true_type { };
+	template<> struct relocatable<pmat::sv_array> : std::true_type { };
+	template<> struct relocatable<pmat::sv_hash> : std::true_type { };
+	template<> struct relocatable<pmat::sv_stash> : std::true_type { };
+	template<> struct relocatable<pmat::sv_code> : std::true_type { };
+
+	/** Calls f on each string and span in an item, see relocatable */
+	template<typename T, typename F> void for_each_pointer(T &, F &&) { }
+	template<typename F> void for_each_pointer(pmat::str_t &s, F &&f) { f(s); }
+	template<typename F> void for_each_pointer(pmat::sv_scalar &b, F &&f) { f(b.pv); }
+	template<typename F> void for_each_pointer(pmat::sv_array &b, F &&f) { f(b.elements); }
+	template<typename F> void for_each_pointer(pmat::sv_hash &b, F &&f) { f(b.keys); f(b.values); }
+	template<typename F> void for_each_pointer(pmat::sv_stash &b, F &&f) { f(b.keys); f(b.values); }
+	template<typename F> void for_each_pointer(pmat::sv_code &b, F &&f) { f(b.pads_); }
+
+	/**
+	 * A pre-parsed copy of a loaded dump, kept next to it as dump.pmat.idx, so that
+	 * asking another question about the same dump doesn't mean decoding it all again.
+	 *
+	 * The file is the state's columns (see state_t::columns()) laid out one after another,
+	 * each 64-byte aligned, with a table of sections at the end. Loading maps it privately
+	 * and points the columns straight at it. Strings, element arrays and hash keys are
+	 * stored just before the column referring to them, and the pointers to them are saved
+	 * as file offsets and rebased on load - those pages end up copied on write, the rest
+	 * of the mapping is only read when it's used.
+	 *
+	 * The index records the size, mtime and inode of the dump it came from, and is
+	 * ignored if any of them no longer match.
+	 */
+	class index_file {
+	public:
+		static std::string path_for(const std::string &dump) { return dump + ".idx"; }
+
+		/** The state for a dump from its index, or nullptr (with the reason logged) if there's no usable one */
+		static std::unique_ptr<pmat_file> load(const std::string &dump) {
+			const auto path = path_for(dump);
+			source_id source;
+			if(!identify(dump, source)) return nullptr;
+			auto mapping = std::make_shared<boost::iostreams::mapped_file>();
+			try {
+				boost::iostreams::mapped_file_params params { path };
+				params.flags = boost::iostreams::mapped_file::priv;
+				mapping->open(params);
+			} catch(const std::exception &e) {
+				DEBUG << "No index at " << path << ": " << e.what();
+				return nullptr;
+			}
+			if(!mapping->is_open() || mapping->size() < sizeof(header)) {
+				INFO << "Ignoring " << path << ", it's too short";
+				return nullptr;
+			}
+
+			char *base = mapping->data();
+			const size_t len = mapping->size();
+			header h;
+			std::memcpy(&h, base, sizeof(h));
+			if(std::memcmp(h.magic, magic, sizeof(h.magic)) != 0 || h.version != format_version) {
+				INFO << "Ignoring " << path << ", it isn't an index this version can read";
+				return nullptr;
+			}
+			if(!(h.source == source)) {
+				INFO << "Ignoring " << path << ", " << dump << " has changed since it was written";
+				return nullptr;
+			}
+			if(h.sections_at > len || (len - h.sections_at) / sizeof(section) < h.sections) {
+				INFO << "Ignoring " << path << ", the section table is truncated";
+				return nullptr;
+			}
+
+			std::unique_ptr<pmat_file> pf { new pmat_file };
+			pf->perl_version_ = h.perl_version;
+			pf->pmat_version_ = h.pmat_version;
+			pf->header_flags_.data = h.flags;
+			auto &state = pf->pm_;
+			state.keep_backing(mapping);
+			reader r { base, len, reinterpret_cast<const section *>(base + h.sections_at), h.sections };
+			bool columns_ok = false;
+			pf->stats_.time("index", [&] {
+				state.columns(r);
+				columns_ok = r.ok();
+				if(columns_ok) read_roots(r, state);
+			});
+			if(!columns_ok) {
+				INFO << "Ignoring " << path << ", it doesn't match the layout this build expects";
+				return nullptr;
+			}
+			if(!r.ok()) {
+				INFO << "Ignoring " << path << ", the roots are damaged";
+				return nullptr;
+			}
+			pf->stats_.set_bytes(len);
+			pf->stats_.time("finish", [&] { state.restored(); });
+			pf->stats_.count_svs(state);
+			pf->stats_.measure(state);
+			DEBUG << "Loaded " << dump << " from " << path << " (" << len << " bytes)";
+			return pf;
+		}
+
+		/** Writes the index for a dump that has just been loaded, returns false (with the reason logged) on failure */
+		static bool save(const std::string &dump, pmat_file &pf) {
+			const auto path = path_for(dump), temp = path + ".tmp";
+			header h;
+			std::memset(&h, 0, sizeof(h));
+			if(!identify(dump, h.source)) return false;
+			std::memcpy(h.magic, magic, sizeof(h.magic));
+			h.version = format_version;
+			h.perl_version = pf.perl_version_;
+			h.pmat_version = pf.pmat_version_;
+			h.flags = pf.header_flags_.data;
+
+			{
+				writer w { temp };
+				w.put(&h, sizeof(h));
+				pf.pm_.columns(w);
+				write_roots(w, pf.pm_);
+				w.align(64);
+				h.sections_at = w.at();
+				h.sections = w.sections().size();
+				w.put(w.sections().data(), w.sections().size() * sizeof(section));
+				w.rewind();
+				w.put(&h, sizeof(h));
+				if(!w.close()) {
+					ERROR << "Could not write " << temp;
+					std::remove(temp.c_str());
+					return false;
+				}
+			}
+			if(std::rename(temp.c_str(), path.c_str()) != 0) {
+				ERROR << "Could not rename " << temp << " to " << path;
+				std::remove(temp.c_str());
+				return false;
+			}
+			DEBUG << "Wrote index " << path;
+			return true;
+		}
+
+	private:
+		static constexpr uint32_t format_version = 3;
+		static constexpr const char *magic = "PMATIDX";
+
+		/** What we know about the dump an index was made from */
+		struct source_id {
+			uint64_t size;
+			int64_t mtime_ns;
+			uint64_t inode;
+			bool operator==(const source_id &o) const { return size == o.size && mtime_ns == o.mtime_ns && inode == o.inode; }
+		};
+
+		struct header {
+			char magic[8];
+			uint32_t version;
+			uint32_t perl_version;
+			uint16_t pmat_version;
+			uint8_t flags;
+			uint8_t reserved[5];
+			source_id source;
+			uint64_t sections_at;
+			uint64_t sections;
+		};
+
+		/** A column or single value in the file */
+		struct section {
+			uint64_t offset;
+			uint64_t count;
+			uint64_t item_size;
+		};
+
+		static bool identify(const std::string &dump, source_id &id) {
+			struct stat st;
+			if(::stat(dump.c_str(), &st) != 0) {
+				ERROR << "Could not stat " << dump;
+				return false;
+			}
+			id.size = st.st_size;
+			id.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+			id.inode = st.st_ino;
+			return true;
+		}
+
+		/** Appends each column as a section, the pointed-to data going just before it */
+		class writer {
+		public:
+			explicit writer(const std::string &path):out_{path, std::ios::binary | std::ios::trunc},at_{0} { }
+
+			template<typename T>
+			void operator()(T &value) {
+				static_assert(std::is_arithmetic<T>::value, "only plain values are stored outside columns");
+				align(alignof(T));
+				sections_.push_back(section { at_, 1, sizeof(T) });
+				put(&value, sizeof(T));
+			}
+
+			template<typename T>
+			void operator()(pmat::column<T> &c) {
+				static_assert(std::is_trivially_copyable<T>::value, "columns are stored as they are in memory");
+				if(relocatable<T>::value) {
+					std::vector<T> items(c.begin(), c.end());
+					for(auto &item : items)
+						for_each_pointer(item, [this](auto &field) { field = store(field); });
+					add(items.data(), items.size());
+				} else {
+					add(c.data(), c.size());
+				}
+			}
+
+			template<typename T>
+			void add(const T *items, size_t n) {
+				align(64);
+				sections_.push_back(section { at_, n, sizeof(T) });
+				put(items, n * sizeof(T));
+			}
+
+			void put(const void *data, size_t len) {
+				out_.write(static_cast<const char *>(data), len);
+				at_ += len;
+			}
+			void align(size_t to) {
+				static const char zeros[64] { };
+				put(zeros, (to - at_ % to) % to);
+			}
+			void rewind() { out_.seekp(0); at_ = 0; }
+			bool close() { out_.close(); return !out_.fail(); }
+
+			uint64_t at() const { return at_; }
+			const std::vector<section> &sections() const { return sections_; }
+
+		private:
+			pmat::str_t store(pmat::str_t s) {
+				if(s.empty()) return { };
+				const auto offset = at_;
+				put(s.data(), s.size());
+				return pmat::str_t { reinterpret_cast<const char *>(offset), s.size() };
+			}
+			template<typename U>
+			pmat::span<U> store(pmat::span<U> s) {
+				if(s.empty()) return { };
+				align(alignof(U));
+				const auto offset = at_;
+				put(s.data(), s.size() * sizeof(U));
+				return pmat::span<U> { reinterpret_cast<U *>(offset), s.size() };
+			}
+
+			std::ofstream out_;
+			uint64_t at_;
+			std::vector<section> sections_;
+		};
+
+		/** Points columns at their sections, in the same order they were written */
+		class reader {
+		public:
+			reader(char *base, size_t len, const section *sections, size_t count):base_{base},len_{len},sections_{sections},count_{count},next_{0},ok_{true} { }
+
+			template<typename T>
+			void operator()(T &value) {
+				const auto *s = next(sizeof(T));
+				if(!s || s->count != 1) {
+					ok_ = false;
+					return;
+				}
+				std::memcpy(&value, base_ + s->offset, sizeof(T));
+			}
+
+			template<typename T>
+			void operator()(pmat::column<T> &c) {
+				T *items = get<T>();
+				if(!items) return;
+				const size_t n = sections_[next_ - 1].count;
+				if(relocatable<T>::value) {
+					for(size_t i = 0; i < n && ok_; ++i)
+						for_each_pointer(items[i], [this](auto &field) { field = rebase(field); });
+				}
+				c.borrow(items, n);
+			}
+
+			/** The items in the next section, or nullptr if it isn't a T column */
+			template<typename T>
+			T *get() {
+				const auto *s = next(sizeof(T));
+				if(!s || s->offset % alignof(T)) {
+					ok_ = false;
+					return nullptr;
+				}
+				return reinterpret_cast<T *>(base_ + s->offset);
+			}
+			size_t count() const { return next_ ? sections_[next_ - 1].count : 0; }
+			bool ok() const { return ok_; }
+
+		private:
+			const section *next(size_t item_size) {
+				if(!ok_ || next_ == count_) return nullptr;
+				const auto *s = &sections_[next_++];
+				if(s->item_size != item_size || !fits(s->offset, s->count * item_size)) return nullptr;
+				return s;
+			}
+			bool fits(uint64_t offset, uint64_t len) const { return offset <= len_ && len <= len_ - offset; }
+
+			pmat::str_t rebase(pmat::str_t s) {
+				if(s.empty()) return { };
+				const auto offset = reinterpret_cast<uintptr_t>(s.data());
+				if(!fits(offset, s.size())) { ok_ = false; return { }; }
+				return pmat::str_t { base_ + offset, s.size() };
+			}
+			template<typename U>
+			pmat::span<U> rebase(pmat::span<U> s) {
+				if(s.empty()) return { };
+				const auto offset = reinterpret_cast<uintptr_t>(s.data());
+				if(!fits(offset, s.size() * sizeof(U)) || offset % alignof(U)) { ok_ = false; return { }; }
+				return pmat::span<U> { reinterpret_cast<U *>(base_ + offset), s.size() };
+			}
+
+			char *base_;
+			size_t len_;
+			const section *sections_;
+			size_t count_;
+			size_t next_;
+			bool ok_;
+		};
+
+		/** Roots as one column of names, NUL-separated, and one of addresses; then the stack */
+		static void write_roots(writer &w, const pmat::state_t &state) {
+			std::string names;
+			std::vector<pmat::ptr_t> ptrs;
+			for(const auto &r : state.roots()) {
+				names += r.first;
+				names.push_back('\0');
+				ptrs.push_back(r.second);
+			}
+			w.add(names.data(), names.size());
+			w.add(ptrs.data(), ptrs.size());
+			w.add(state.stack().data(), state.stack().size());
+		}
+		static void read_roots(reader &r, pmat::state_t &state) {
+			const char *names = r.get<char>();
+			const size_t len = r.count();
+			const pmat::ptr_t *ptrs = r.get<pmat::ptr_t>();
+			const size_t count = r.count();
+			const pmat::ptr_t *stack = r.get<pmat::ptr_t>();
+			if(!r.ok()) return;
+			size_t at = 0;
+			for(size_t i = 0; i < count && at < len; ++i) {
+				const size_t end = std::find(names + at, names + len, '\0') - names;
+				state.add_root(std::string(names + at, end - at), ptrs[i]);
+				at = end + 1;
+			}
+			for(size_t i = 0; i < r.count(); ++i)
+				state.add_stack(stack[i]);
+		}
+	};
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace pmat {
+	/** How many workers to use when the caller didn't ask for anything specific */
+	inline size_t default_threads() {
+		auto n = std::thread::hardware_concurrency();
+		return n ? n : 1;
+	}
+
+	/**
+	 * Runs fn(begin, end) over [0, n) in chunks of at most grain items, using a pool of
+	 * up to threads workers (the calling thread is one of them).
+	 *
+	 * Chunks are claimed from a shared counter, so a slow chunk doesn't hold up the rest
+	 * of the pool. The first exception thrown by fn is rethrown once all workers are done.
+	 */
+	template<typename F>
+	void parallel_for(size_t threads, size_t n, size_t grain, F fn) {
+		if(grain == 0) grain = 1;
+		const size_t chunks = (n + grain - 1) / grain;
+		if(threads > chunks) threads = chunks;
+		if(threads <= 1) {
+			for(size_t begin = 0; begin < n; begin += grain)
+				fn(begin, std::min(n, begin + grain));
+			return;
+		}
+
+		std::atomic<size_t> next { 0 };
+		std::exception_ptr failed;
+		std::mutex failed_mutex;
+		auto worker = [&]() {
+			try {
+				for(size_t c = next++; c < chunks; c = next++)
+					fn(c * grain, std::min(n, (c + 1) * grain));
+			} catch(...) {
+				std::lock_guard<std::mutex> guard { failed_mutex };
+				if(!failed) failed = std::current_exception();
+				next = chunks;
+			}
+		};
+
+		std::vector<std::thread> pool;
+		for(size_t i = 1; i < threads; ++i)
+			pool.emplace_back(worker);
+		worker();
+		for(auto &t : pool)
+			t.join();
+		if(failed)
+			std::rethrow_exception(failed);
+	}
+};
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <fstream>
 #include <boost/asio/buffer.hpp>
+#include <boost/filesystem/operations.hpp>
 #include <boost/iostreams/device/mapped_file.hpp>
 #include <boost/log/core.hpp>
 #include <boost/log/trivial.hpp>
@@ -8,75 +9,175 @@
 #include <boost/program_options/options_description.hpp>
 #include <boost/program_options/variables_map.hpp>
 #include <boost/program_options/parsers.hpp>
+#include <boost/program_options/positional_options.hpp>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
-#include "detail.h"
+#include "pmat_file.h"
+#include "index_file.h"
+#include "dump_writer.h"
+#include "delta.h"
+#include "trend.h"
+#include "parallel.h"
 #include "Log.h"
 
 using namespace std;
 
-class pmat_file {
-public:
-	pmat_file(
-		const char *data,
-		size_t len
-	) {
-		pmat::state_t pm;
-		pmat::header fr;
-		asio::const_buffer remainder;
-		std::tie(fr, remainder) = detail::read<pmat::header>(asio::buffer(data, len), pm);
-		DEBUG << "PMAT state now has " << pm.types.size() << " types - " << (void *)(&pm);
-		DEBUG << "Magic (\"PMAT\"): " << fr.magic;
-		DEBUG << "Flags:";
-		DEBUG << " * Big-endian:  " << (fr.flags.big_endian ? "yes" : "no");
-		DEBUG << " * Int64:       " << (fr.flags.integer_64 ? "yes" : "no");
-		DEBUG << " * Ptr64:       " << (fr.flags.pointer_64 ? "yes" : "no");
-		DEBUG << " * Long double: " << (fr.flags.float_64 ? "yes" : "no");
-		DEBUG << " * Threads:     " << (fr.flags.threads ? "yes" : "no");
-		header_flags_ = fr.flags;
-
-		perl_version_ = net::ntoh(fr.perl_ver);
-		pmat_version_ = (static_cast<uint16_t>(fr.major_ver) << 8) | static_cast<uint16_t>(fr.minor_ver);
-		DEBUG << "PMAT format " << pmat_version_string() << " generated on Perl " << perl_version_string();
-
-		DEBUG << "Roots:";
-		pmat::roots roots;
-		std::tie(roots, remainder) = detail::read<pmat::roots>(remainder, pm);
-		pm.add_sv(std::make_shared<pmat::sv_undef>(roots.undef));
-		DEBUG << "Undef: " << pm.sv_at(roots.undef)->address;
-		pm.add_sv(std::make_shared<pmat::sv_yes>(roots.yes));
-		DEBUG << "Yes:   " << pm.sv_at(roots.yes)->address;
-		pm.add_sv(std::make_shared<pmat::sv_no>(roots.no));
-		DEBUG << "No:   " << pm.sv_at(roots.no)->address;
-		DEBUG << "Stack:";
-		pmat::stack stack;
-		std::tie(stack, remainder) = detail::read<pmat::stack>(remainder, pm);
-		DEBUG << "Heap:";
-		pmat::heap heap;
-		std::tie(heap, remainder) = detail::read<pmat::heap>(remainder, pm);
-		DEBUG << "Context:";
-		pmat::context ctx;
-		// std::tie(ctx, remainder) = detail::read<pmat::context>(remainder, pm);
-		DEBUG << "End of sections";
-
-		pm.finish();
-	}
-
-	std::string perl_version_string() const {
-		int rev = (perl_version_) & 0xFF;
-		int ver = (uint16_t) ((perl_version_ >>  8) & 0xFFFF);
-		int sub = (uint16_t) ((perl_version_ >> 24) & 0xFFFF);
-		return to_string(rev) + "." + to_string(ver) + "." + to_string(sub);
-	}
-
-	std::string pmat_version_string() const {
-		return to_string(pmat_version_ >> 8) + "." + to_string(pmat_version_ & 0xFF);
-	}
-
-private:
-	uint32_t perl_version_;
-	uint16_t pmat_version_;
-	pmat::flags_t header_flags_;
-};
+/** Maps an entire dump, or returns nullptr after logging why we couldn't */
+static std::shared_ptr<boost::iostreams::mapped_file_source>
+map_file(const std::string &filename) {
+	auto file = std::make_shared<boost::iostreams::mapped_file_source>();
+	try {
+		file->open(filename);
+	} catch(const std::exception &e) {
+		ERROR << "Could not mmap() " << filename << ": " << e.what();
+		return nullptr;
+	}
+	if(!file->is_open()) {
+		ERROR << "Could not mmap() " << filename;
+		return nullptr;
+	}
+	return file;
+}
+
+/** Reads an SV address as given on the command line - hex with 0x, or decimal */
+static bool
+parse_address(const std::string &text, pmat::ptr_t &addr) {
+	try {
+		size_t used = 0;
+		addr = std::stoull(text, &used, 0);
+		if(used == text.size()) return true;
+	} catch(const std::exception &) {
+	}
+	ERROR << "Invalid address " << text;
+	return false;
+}
+
+/**
+ * Loads two dumps side by side, each with half the threads, and reports what changed
+ * between them. Neither needs a reference graph, which keeps the pair well under
+ * twice the memory of a normal load.
+ */
+static int
+diff(const std::string &from_name, const std::string &to_name, size_t threads) {
+	auto from_file = map_file(from_name), to_file = map_file(to_name);
+	if(!from_file || !to_file) return -1;
+	const size_t half = std::max<size_t>(1, threads / 2);
+
+	std::unique_ptr<pmat_file> from, to;
+	std::exception_ptr failed;
+	std::thread loader { [&]() {
+		try {
+			from.reset(new pmat_file { from_file->data(), from_file->size(), half, from_file, false });
+		} catch(...) {
+			failed = std::current_exception();
+		}
+	} };
+	try {
+		to.reset(new pmat_file { to_file->data(), to_file->size(), std::max<size_t>(1, threads - half), to_file, false });
+	} catch(...) {
+		/* The loader has to be joined before it goes out of scope, whatever happened here */
+		loader.join();
+		failed = std::current_exception();
+	}
+	if(loader.joinable()) loader.join();
+	if(failed) {
+		try {
+			std::rethrow_exception(failed);
+		} catch(const std::exception &e) {
+			ERROR << "Could not load dumps to compare: " << e.what();
+		} catch(...) {
+			ERROR << "Could not load dumps to compare";
+		}
+		return -1;
+	}
+
+	if(!pmat::state_delta::compatible(*from, *to)) return -1;
+	cout << "Changes from " << from_name << " to " << to_name << ":" << endl;
+	pmat::state_delta { from->state(), to->state() }.report(cout);
+	return 0;
+}
+
+/**
+ * Looks for growth across a time-ordered series of dumps. Dumps are loaded on a pool of
+ * threads and boiled down to summaries, which are folded into the trend in order. Loaders
+ * only get as far ahead of the fold as there are threads, so only a handful of summaries
+ * are ever held at once.
+ */
+static int
+trend(const std::vector<std::string> &files, size_t threads, size_t top) {
+	const size_t n = files.size();
+	const size_t workers = std::max<size_t>(1, std::min(threads, n));
+	std::vector<std::unique_ptr<pmat::snapshot_summary>> ready(n);
+	std::vector<std::string> build(n);
+	std::mutex mutex;
+	std::condition_variable cv;
+	size_t next = 0, folded = 0;
+	bool failed = false;
+
+	auto worker = [&]() {
+		for(;;) {
+			size_t i;
+			{
+				std::unique_lock<std::mutex> lock { mutex };
+				cv.wait(lock, [&]() { return failed || next >= n || next < folded + workers; });
+				if(failed || next >= n) return;
+				i = next++;
+			}
+			std::unique_ptr<pmat::snapshot_summary> summary;
+			std::string meta;
+			try {
+				if(auto file = map_file(files[i])) {
+					pmat_file pf { file->data(), file->size(), 1, file, false };
+					summary.reset(new pmat::snapshot_summary { pf.state() });
+					meta = pf.perl_version_string() + "/" + std::to_string(pf.header_flags().data);
+					DEBUG << "Summary for " << files[i] << " has " << summary->address.size() << " SVs in " << summary->memory_used() << " bytes";
+				}
+			} catch(const std::exception &e) {
+				ERROR << "Could not load " << files[i] << ": " << e.what();
+			}
+			{
+				std::lock_guard<std::mutex> guard { mutex };
+				if(!summary) failed = true;
+				ready[i] = std::move(summary);
+				build[i] = meta;
+			}
+			cv.notify_all();
+		}
+	};
+	std::vector<std::thread> pool;
+	for(size_t i = 0; i < workers; ++i)
+		pool.emplace_back(worker);
+
+	pmat::trend t;
+	for(size_t i = 0; i < n; ++i) {
+		std::unique_ptr<pmat::snapshot_summary> summary;
+		{
+			std::unique_lock<std::mutex> lock { mutex };
+			cv.wait(lock, [&]() { return failed || ready[i]; });
+			if(!failed && build[i] != build[0]) {
+				ERROR << files[i] << " is from a different perl build to " << files[0];
+				failed = true;
+			}
+			if(failed) break;
+			summary = std::move(ready[i]);
+		}
+		t.add(*summary);
+		summary.reset();
+		{
+			std::lock_guard<std::mutex> guard { mutex };
+			++folded;
+		}
+		cv.notify_all();
+	}
+	cv.notify_all();
+	for(auto &th : pool)
+		th.join();
+	if(failed) return -1;
+	t.report(cout, top);
+	return 0;
+}
 
 int
 main(int argc, char **argv) {
@@ -85,19 +186,44 @@ main(int argc, char **argv) {
 	po::options_description desc("Allowed options");
 	desc.add_options()
 		("help", u8"show program options")
-		("trace", po::value<bool>(), u8"excessive debug tracing output")
+		("trace", po::value<bool>(), u8"excessive debug tracing output (not in release builds, which compile it out)")
+		("threads", po::value<size_t>(), u8"number of threads to decode the heap with (default: all cores)")
+		("copy-strings", u8"copy SV strings out of the dump instead of referring to the mapped file")
+		("index", u8"load from the dump's .idx index if it's up to date, otherwise parse and write one")
+		("referrers", po::value<std::string>(), u8"list everything pointing at the SV with this address")
+		("unreachable", u8"list SVs that can't be reached from any root")
+		("ignore-weak", u8"don't follow weak references when working out what is reachable")
+		("magic", u8"list magic by type, with the memory each type's objects keep alive")
+		("top-retainers", po::value<size_t>(), u8"list the SVs and classes keeping the most memory alive")
+		("path", po::value<std::string>(), u8"show the shortest chains of references from a root to the SV with this address")
+		("paths", po::value<size_t>()->default_value(1), u8"how many distinct paths --path should show")
+		("top", po::value<size_t>()->default_value(20), u8"how many growing SVs trend should list")
+		("stats", u8"finish with load timings, throughput and peak RSS")
+		("stats-format", po::value<std::string>()->default_value("text"), u8"how --stats reports: text or json")
+		("write", po::value<std::string>(), u8"write the dump back out to this file, less anything the options below leave out")
+		("keep-package", po::value<std::vector<std::string>>(), u8"with --write, only keep SVs reachable from this package's stash (may be repeated)")
+		("max-pv", po::value<size_t>(), u8"with --write, drop the string from scalars with more than this many bytes of it")
+		("drop-unblessed-scalars", u8"with --write, leave out scalars that aren't blessed")
+	;
+
+	po::options_description hidden;
+	hidden.add_options()
+		("input", po::value<std::vector<std::string>>(), u8"dump file (- for stdin, may be gzip or bzip2 compressed), diff followed by two dump files, or trend followed by a series of them")
 	;
+	po::options_description all;
+	all.add(desc).add(hidden);
+	po::positional_options_description positional;
+	positional.add("input", -1);
 
 	po::variables_map vm;
 	po::store(
-		po::parse_command_line(
-			argc, argv, desc
-		),
-		 // .positional(p)
-		 // .run(),
+		po::command_line_parser(argc, argv)
+			.options(all)
+			.positional(positional)
+			.run(),
 		vm
 	);
-	po::notify(vm);    
+	po::notify(vm);
 
 	if(vm.count("help")) {
 		cout << desc << "\n";
@@ -115,31 +241,117 @@ main(int argc, char **argv) {
 
 	DEBUG << "Starting parser";
 
-	std::string filename { "sample.pmat" };
-	if(argc > 1) {
-		DEBUG << " argc = " << (int)argc;
-		for(int i = 0; i < argc; ++i) {
-			auto s = std::string { argv[i] };
-			DEBUG << i << " - " << s;
-			filename = s;
+	auto inputs = vm.count("input") ? vm["input"].as<std::vector<std::string>>() : std::vector<std::string> { };
+	size_t threads = vm.count("threads") ? vm["threads"].as<size_t>() : pmat::default_threads();
+
+	if(!inputs.empty() && inputs.front() == "diff") {
+		if(inputs.size() != 3) {
+			ERROR << "Usage: diff old.pmat new.pmat";
+			return -1;
 		}
+		return diff(inputs[1], inputs[2], threads);
 	}
 
-	// Work out how much we need to map
-	auto bytes = ([](const std::string &filename) {
-		ifstream in { filename, ios::binary | ios::ate };
-		return in.tellg();
-	})(filename);
+	if(!inputs.empty() && inputs.front() == "trend") {
+		if(inputs.size() < 3) {
+			ERROR << "Usage: trend first.pmat second.pmat [...]";
+			return -1;
+		}
+		return trend(std::vector<std::string>(inputs.begin() + 1, inputs.end()), threads, vm["top"].as<size_t>());
+	}
 
-	// Map entire file
-	boost::iostreams::mapped_file_source file;
-	file.open(filename, bytes);
-	if(!file.is_open()) {
-		ERROR << "Could not mmap() the file";
-		exit(-1);
+	const auto stats = vm.count("stats") ? vm["stats-format"].as<std::string>() : std::string { };
+	if(!stats.empty() && stats != "text" && stats != "json") {
+		ERROR << "--stats-format takes text or json, not " << stats;
+		return -1;
 	}
 
-	pmat_file pf { file.data(), bytes };
+	std::string filename = inputs.empty() ? std::string { "sample.pmat" } : inputs.back();
+	std::unique_ptr<pmat_file> loaded;
+	/* Anything we can't map - stdin, a pipe, a compressed dump - is parsed as it streams in */
+	const bool streamed = filename == "-" || !boost::filesystem::is_regular_file(filename) || pmat::stream_input::compressed(filename);
+	if(streamed) {
+		if(vm.count("index")) INFO << "No index for a streamed dump, ignoring --index";
+		try {
+			pmat::stream_input in { filename };
+			const bool sizes_only = !vm.count("unreachable") && !vm.count("top-retainers") && !vm.count("path") && !vm.count("referrers") && !vm.count("write") && !vm.count("magic");
+			loaded.reset(new pmat_file { in, threads, !sizes_only });
+		} catch(const std::exception &e) {
+			ERROR << "Could not read " << filename << ": " << e.what();
+			return -1;
+		}
+	}
+	if(!loaded && vm.count("index")) loaded = pmat::index_file::load(filename);
+	if(!loaded) {
+		auto file = map_file(filename);
+		if(!file) exit(-1);
+		const auto bytes = file->size();
+
+		std::shared_ptr<const void> backing;
+		if(!vm.count("copy-strings")) backing = file;
+		/* Sizes alone only need the common fields, anything else wants every body and the graph */
+		const bool sizes_only = !vm.count("unreachable") && !vm.count("top-retainers") && !vm.count("path") && !vm.count("referrers") && !vm.count("index") && !vm.count("write") && !vm.count("magic");
+		try {
+			loaded.reset(new pmat_file { file->data(), static_cast<size_t>(bytes), threads, backing, !sizes_only, sizes_only });
+			if(vm.count("index")) pmat::index_file::save(filename, *loaded);
+		} catch(const std::exception &e) {
+			ERROR << "Could not read " << filename << ": " << e.what();
+			return -1;
+		}
+	}
+	auto &pf = *loaded;
+	pf.state().dump_sizes();
+	if(vm.count("unreachable")) {
+		pf.state().dump_unreachable(!vm.count("ignore-weak"), threads);
+	}
+	if(vm.count("magic")) {
+		pf.state().dump_magic(threads);
+	}
+	if(vm.count("top-retainers")) {
+		pf.state().dump_top_retainers(vm["top-retainers"].as<size_t>());
+	}
+	if(vm.count("path")) {
+		pmat::ptr_t addr;
+		if(!parse_address(vm["path"].as<std::string>(), addr)) return -1;
+		pf.state().dump_paths(addr, vm["paths"].as<size_t>(), !vm.count("ignore-weak"));
+	}
+	if(vm.count("referrers")) {
+		const auto &st = pf.state();
+		pmat::ptr_t addr;
+		if(!parse_address(vm["referrers"].as<std::string>(), addr)) return -1;
+		const auto id = st.sv_at(addr);
+		if(id == pmat::no_sv) {
+			ERROR << "No SV at " << pmat::to_string(addr);
+			return -1;
+		}
+		cout << st.sv_blessed_type(id) << " at " << pmat::to_string(addr) << " is referred to by:" << endl;
+		for(const auto &r : st.referrers(id)) {
+			cout << "  " << st.sv_blessed_type(r.sv) << " at " << pmat::to_string(st.svs().address(r.sv))
+				<< " - " << r.slot << (r.kind == pmat::edge_kind_t::weak ? " (weak)" : "") << endl;
+		}
+	}
+	if(vm.count("write")) {
+		pmat::dump_filter filter;
+		if(vm.count("keep-package")) filter.packages = vm["keep-package"].as<std::vector<std::string>>();
+		filter.follow_weak = !vm.count("ignore-weak");
+		if(vm.count("max-pv")) filter.max_pv = vm["max-pv"].as<size_t>();
+		filter.drop_unblessed_scalars = vm.count("drop-unblessed-scalars") > 0;
+		const auto out_name = vm["write"].as<std::string>();
+		std::ofstream out { out_name, std::ios::binary };
+		if(!out) {
+			ERROR << "Could not open " << out_name;
+			return -1;
+		}
+		const pmat::dump_writer writer { pf, filter, threads };
+		const auto bytes = writer.write(out);
+		if(!out.flush()) {
+			ERROR << "Failed writing " << out_name;
+			return -1;
+		}
+		INFO << "Wrote " << writer.kept() << " of " << pf.state().sv_count() << " SVs to " << out_name << " (" << bytes << " bytes)";
+	}
+	if(stats == "json") pf.stats().report_json(cout);
+	else if(!stats.empty()) pf.stats().report(cout);
 	DEBUG << "Done";
 	return 0;
 }
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "ref_graph.h"
+
+namespace pmat {
+	/** One hop on the way to a root: sv holds a pointer to the previous SV in the given slot */
+	struct path_step {
+		pmat::sv_id_t sv;
+		uint32_t index;
+		pmat::edge_slot_t slot;
+		pmat::edge_kind_t kind;
+	};
+
+	/**
+	 * Up to n shortest chains of references from a root to target, each given as the
+	 * referrers walking outwards from target so the last step is the root. A target that
+	 * is itself a root gets a single empty path.
+	 *
+	 * This is a BFS backwards over the inref index, stopping as soon as enough roots have
+	 * been found, so it only looks at the part of the heap between the target and its
+	 * nearest roots. To get more than one path each SV may be visited up to n times, every
+	 * visit remembering the visit it came from; walks that loop back on themselves are
+	 * dropped, so the paths returned are simple and all different.
+	 */
+	inline std::vector<std::vector<pmat::path_step>> shortest_paths(
+		const pmat::ref_graph &graph,
+		const std::vector<bool> &is_root,
+		pmat::sv_id_t target,
+		size_t n,
+		bool follow_weak
+	) {
+		constexpr uint32_t none = ~uint32_t{0};
+		struct visit {
+			pmat::path_step step;
+			uint32_t prev;
+		};
+		std::vector<visit> visits { visit { pmat::path_step { target, 0, pmat::edge_slot_t::blessed, pmat::edge_kind_t::strong }, none } };
+		std::vector<uint16_t> seen(graph.sv_count(), 0);
+		seen[target] = 1;
+		auto on_path = [&visits](uint32_t at, pmat::sv_id_t id) {
+			for(; at != none; at = visits[at].prev)
+				if(visits[at].step.sv == id) return true;
+			return false;
+		};
+
+		std::vector<std::vector<pmat::path_step>> out;
+		for(uint32_t head = 0; head < visits.size() && out.size() < n; ++head) {
+			const auto id = visits[head].step.sv;
+			if(is_root[id]) {
+				std::vector<pmat::path_step> path;
+				for(auto at = head; visits[at].prev != none; at = visits[at].prev)
+					path.push_back(visits[at].step);
+				std::reverse(path.begin(), path.end());
+				out.push_back(std::move(path));
+				continue;
+			}
+			for(const auto &in : graph.in(id)) {
+				if(!follow_weak && in.kind == pmat::edge_kind_t::weak) continue;
+				if(seen[in.from] >= n || on_path(head, in.from)) continue;
+				++seen[in.from];
+				visits.push_back(visit { pmat::path_step { in.from, in.index, in.slot, in.kind }, head });
+			}
+		}
+		return out;
+	}
+};
@@ -1,20 +1,37 @@
 #include <string>
 #include <unordered_map>
 #include "pmat.h"
+#include "ref_graph.h"
 
 class Lookup {
 public:
 	Lookup();
 
-	std::string root_desc(const std::string &name) const { return root_.at(name); }
+	/** Description for a root, or just its name if it's one we don't know about */
+	std::string root_desc(const std::string &name) const {
+		auto it = root_.find(name);
+		return it == root_.cend() ? name : it->second;
+	}
+
+	/** Name for a magic type, or the type character itself if it's one we don't know about */
+	std::string magic_desc(uint8_t type) const {
+		auto it = magic_.find(type);
+		if(it != magic_.cend()) return it->second;
+		if(type > 0x20 && type < 0x7f) return std::string(1, static_cast<char>(type));
+		return (boost::format("\\x%02x") % static_cast<int>(type)).str();
+	}
 
 private:
 	std::unordered_map<std::string, std::string> root_;
+	std::unordered_map<uint8_t, std::string> magic_;
 };
 
 Lookup::Lookup(
-):root_{ }
+):root_{ },magic_{ }
 {
+	root_["undef"] = u8"the \"undef\" immortal";
+	root_["yes"] = u8"the \"yes\" immortal";
+	root_["no"] = u8"the \"no\" immortal";
 	root_["main_cv"] = u8"the main code";
 	root_["defstash"] = u8"the default stash";
 	root_["mainstack"] = u8"the main stack AV";
@@ -59,6 +76,61 @@ Lookup::Lookup(
 	root_["custom_ops"] = u8"the custom ops HV";
 	root_["custom_op_names"] = u8"the custom op names HV";
 	root_["custom_op_descs"] = u8"the custom op descriptions HV";
+
+	/* The PERL_MAGIC_* names from perl's mg_vtable.h */
+	magic_['\0'] = u8"sv";
+	magic_['#'] = u8"arylen";
+	magic_['%'] = u8"rhash";
+	magic_['*'] = u8"debugvar";
+	magic_['.'] = u8"pos";
+	magic_[':'] = u8"symtab";
+	magic_['<'] = u8"backref";
+	magic_['@'] = u8"arylen_p";
+	magic_['B'] = u8"bm";
+	magic_['c'] = u8"overload_table";
+	magic_['D'] = u8"regdata";
+	magic_['d'] = u8"regdatum";
+	magic_['E'] = u8"env";
+	magic_['e'] = u8"envelem";
+	magic_['f'] = u8"fm";
+	magic_['g'] = u8"regex_global";
+	magic_['H'] = u8"hints";
+	magic_['h'] = u8"hintselem";
+	magic_['I'] = u8"isa";
+	magic_['i'] = u8"isaelem";
+	magic_['k'] = u8"nkeys";
+	magic_['L'] = u8"dbfile";
+	magic_['l'] = u8"dbline";
+	magic_['N'] = u8"shared";
+	magic_['n'] = u8"shared_scalar";
+	magic_['o'] = u8"collxfrm";
+	magic_['P'] = u8"tied";
+	magic_['p'] = u8"tiedelem";
+	magic_['q'] = u8"tiedscalar";
+	magic_['r'] = u8"qr";
+	magic_['S'] = u8"sig";
+	magic_['s'] = u8"sigelem";
+	magic_['t'] = u8"taint";
+	magic_['U'] = u8"uvar";
+	magic_['u'] = u8"uvar_elem";
+	magic_['V'] = u8"vstring";
+	magic_['v'] = u8"vec";
+	magic_['w'] = u8"utf8";
+	magic_['x'] = u8"substr";
+	magic_['Y'] = u8"nonelem";
+	magic_['y'] = u8"defelem";
+	magic_[']'] = u8"checkcall";
+	magic_['~'] = u8"ext";
+}
+
+std::string pmat::root_description(const std::string &name) {
+	static const Lookup lookup;
+	return lookup.root_desc(name);
+}
+
+std::string pmat::magic_type_name(uint8_t type) {
+	static const Lookup lookup;
+	return lookup.magic_desc(type);
 }
 
 std::string pmat::to_string(
@@ -78,3 +150,72 @@ std::string pmat::to_string(
 }
 
 std::string pmat::to_string(const pmat::ctx &ctx) { return "ctx " + ctx.file + ": " + std::to_string(ctx.line); }
+
+const char *pmat::to_string(const pmat::edge_slot_t slot) {
+	switch(slot) {
+	case edge_slot_t::blessed: return u8"blessed";
+	case edge_slot_t::ourstash: return u8"our stash";
+	case edge_slot_t::rv: return u8"RV";
+	case edge_slot_t::glob_stash: return u8"stash";
+	case edge_slot_t::glob_scalar: return u8"scalar";
+	case edge_slot_t::glob_array: return u8"array";
+	case edge_slot_t::glob_hash: return u8"hash";
+	case edge_slot_t::glob_code: return u8"code";
+	case edge_slot_t::glob_egv: return u8"egv";
+	case edge_slot_t::glob_io: return u8"io";
+	case edge_slot_t::glob_form: return u8"format";
+	case edge_slot_t::element: return u8"element";
+	case edge_slot_t::value: return u8"value";
+	case edge_slot_t::backrefs: return u8"backrefs";
+	case edge_slot_t::mro_linear_all: return u8"mro linear all HV";
+	case edge_slot_t::mro_linear_current: return u8"mro linear current";
+	case edge_slot_t::mro_nextmethod: return u8"mro next::method";
+	case edge_slot_t::mro_isa: return u8"mro ISA cache";
+	case edge_slot_t::cv_stash: return u8"stash";
+	case edge_slot_t::cv_glob: return u8"glob";
+	case edge_slot_t::cv_outside: return u8"scope";
+	case edge_slot_t::cv_padlist: return u8"padlist";
+	case edge_slot_t::cv_constval: return u8"constant value";
+	case edge_slot_t::cv_constsv: return u8"constant";
+	case edge_slot_t::cv_gvsv: return u8"GVSV";
+	case edge_slot_t::cv_padnames: return u8"padnames";
+	case edge_slot_t::cv_pad: return u8"pad";
+	case edge_slot_t::io_top: return u8"top";
+	case edge_slot_t::io_format: return u8"format";
+	case edge_slot_t::io_bottom: return u8"bottom";
+	case edge_slot_t::lv_target: return u8"target";
+	case edge_slot_t::mg_obj: return u8"magic object";
+	default: return u8"unknown";
+	}
+}
+
+std::string pmat::describe(const pmat::edge_slot_t slot, const uint32_t index, const pmat::string_table &keys) {
+	switch(slot) {
+	case edge_slot_t::blessed: return u8"the stash it is blessed into";
+	case edge_slot_t::rv: return u8"the referent";
+	case edge_slot_t::element: return u8"element [" + std::to_string(index) + "]";
+	case edge_slot_t::value: return u8"value {" + keys.str(index).to_string() + "}";
+	case edge_slot_t::cv_pad: return u8"the CV's pad at depth " + std::to_string(index);
+	case edge_slot_t::mg_obj: return u8"the object of its " + magic_type_name(index) + " magic";
+	case edge_slot_t::glob_stash:
+	case edge_slot_t::glob_scalar:
+	case edge_slot_t::glob_array:
+	case edge_slot_t::glob_hash:
+	case edge_slot_t::glob_code:
+	case edge_slot_t::glob_egv:
+	case edge_slot_t::glob_io:
+	case edge_slot_t::glob_form: return std::string { u8"the glob's " } + to_string(slot);
+	case edge_slot_t::cv_stash:
+	case edge_slot_t::cv_glob:
+	case edge_slot_t::cv_outside:
+	case edge_slot_t::cv_padlist:
+	case edge_slot_t::cv_constval:
+	case edge_slot_t::cv_constsv:
+	case edge_slot_t::cv_gvsv:
+	case edge_slot_t::cv_padnames: return std::string { u8"the CV's " } + to_string(slot);
+	case edge_slot_t::io_top:
+	case edge_slot_t::io_format:
+	case edge_slot_t::io_bottom: return std::string { u8"the IO's " } + to_string(slot);
+	default: return std::string { u8"the " } + to_string(slot);
+	}
+}
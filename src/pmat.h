@@ -2,7 +2,11 @@
 
 #include <vector>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <type_traits>
 #include <boost/fusion/include/define_struct.hpp>
+#include <boost/utility/string_view.hpp>
 #include <boost/io/ios_state.hpp>
 #include <boost/format.hpp>
 #include <iostream>
@@ -20,9 +24,94 @@ namespace pmat {
 	using uint_t = std::uint64_t;
 	/* Pointer also varies - we just assume 32/64 bit */
 	using ptr_t = std::uint64_t;
-	/* A hash provides string => value lookup, stick with pointers for now */
-	using hash_elem_t = std::map<std::string, pmat::ptr_t>;
+	/* Strings from the dump - either views into the mapped file or copies in the state's arena */
+	using str_t = boost::string_view;
+	/* Hash keys and names are interned, see pmat::string_table */
+	using string_id_t = uint32_t;
+	static constexpr string_id_t no_string = ~string_id_t{0};
 
+	/**
+	 * Bump-pointer storage for everything hanging off the SVs - array elements, pad lists,
+	 * copied strings - freed in one go when the arena goes away. Nothing stored here gets
+	 * its destructor run.
+	 *
+	 * Memory is handed out as whole blocks, each user bumping through its own block, so
+	 * the lock is only taken once per block. See pmat::arena_cursor.
+	 */
+	class arena {
+	public:
+		static constexpr size_t block_size = 1024 * 1024;
+
+		/** Hands out a block of at least len bytes, returning the start and setting end */
+		char *block(size_t len, char *&end) {
+			std::lock_guard<std::mutex> guard { mutex_ };
+			len = len > block_size ? len : block_size;
+			blocks_.emplace_back(new char[len]);
+			bytes_ += len;
+			end = blocks_.back().get() + len;
+			return blocks_.back().get();
+		}
+
+		size_t bytes() const { return bytes_; }
+		size_t blocks() const { return blocks_.size(); }
+
+	private:
+		std::mutex mutex_;
+		std::vector<std::unique_ptr<char[]>> blocks_;
+		size_t bytes_ = 0;
+	};
+
+	/** One user's position in an arena block. Not thread-safe, use one per thread. */
+	class arena_cursor {
+	public:
+		arena_cursor():next_{nullptr},end_{nullptr} { }
+
+		/** Space for n objects of type T, uninitialised */
+		template<typename T>
+		T *allocate(pmat::arena &from, size_t n) {
+			static_assert(std::is_trivially_destructible<T>::value, "arena storage is never destroyed");
+			if(n == 0) return nullptr;
+			const size_t len = n * sizeof(T);
+			size_t pad = padding(alignof(T));
+			if(static_cast<size_t>(end_ - next_) < pad + len) {
+				next_ = from.block(len + alignof(T), end_);
+				pad = padding(alignof(T));
+			}
+			T *out = reinterpret_cast<T *>(next_ + pad);
+			next_ += pad + len;
+			return out;
+		}
+
+		/** Drops the current block, for when a copy of the cursor would otherwise share it */
+		void reset() { next_ = end_ = nullptr; }
+
+	private:
+		size_t padding(size_t align) const {
+			return (align - reinterpret_cast<uintptr_t>(next_) % align) % align;
+		}
+
+		char *next_;
+		char *end_;
+	};
+
+	/** A run of items stored elsewhere, usually in the state's arena */
+	template<typename T>
+	class span {
+	public:
+		span():data_{nullptr},size_{0} { }
+		span(T *data, size_t size):data_{data},size_{size} { }
+
+		T *begin() const { return data_; }
+		T *end() const { return data_ + size_; }
+		T *data() const { return data_; }
+		size_t size() const { return size_; }
+		bool empty() const { return size_ == 0; }
+		T &operator[](size_t i) const { return data_[i]; }
+
+	private:
+		T *data_;
+		size_t size_;
+	};
 
 	template<typename U, typename T>
 	class vec : public std::vector<T> {
@@ -43,7 +132,7 @@ namespace pmat {
 		BitField<1, 1> integer_64;
 		/** Pointers are 64-bit */
 		BitField<2, 1> pointer_64;
-		/** Floats (NV) are 64-bit */
+		/** NVs are long doubles rather than 64-bit doubles */
 		BitField<3, 1> float_64;
 		/** ithreads enabled */
 		BitField<4, 1> threads;
@@ -177,6 +266,10 @@ BOOST_FUSION_DEFINE_STRUCT(
 )
 
 namespace pmat {
+	/**
+	 * Fields common to every SV. The type-specific parts are kept separately, see the
+	 * body classes below and pmat::sv_table.
+	 */
 	class sv {
 	public:
 		pmat::sv_type_t type;
@@ -186,51 +279,41 @@ namespace pmat {
 		pmat::ptr_t blessed;
 
 		sv():type{},address{},refcnt{0},size{0},blessed{} { }
+		sv(pmat::sv_type_t t, pmat::ptr_t addr):type{t},address{addr},refcnt{0},size{0},blessed{} { }
 		sv(const sv &v):type{v.type},address{v.address},refcnt{v.refcnt},size{v.size},blessed{v.blessed} { }
+		sv &operator=(const sv &v) = default;
 	};
 	std::string to_string( const pmat::ptr_t &ptr);
 	std::string to_string( const pmat::sv &sv);
+	/** What a named root is, e.g. "defstash" => "the default stash" */
+	std::string root_description(const std::string &name);
 
-	class sv_invlist:public sv {
-	public:
-		sv_invlist() { }
-		sv_invlist(const sv &v):sv{v} { }
-	};
-	class sv_scalar:public sv {
+	/* Type-specific SV bodies. REGEXP, FORMAT and INVLIST have nothing beyond the common fields. */
+	class sv_scalar {
 	public:
 		uint8_t flags;
 		uint64_t iv;
 		double nv;
 		pmat::uint_t pvlen;
 		pmat::ptr_t ourstash;
-		std::string pv;
+		pmat::str_t pv;
 
-		sv_scalar() { }
-		sv_scalar(const sv &v):sv{v} { }
-	};
-	class sv_undef:public sv_scalar {
-	public:
-		sv_undef(pmat::ptr_t ptr) { address = ptr; type = pmat::sv_type_t::SVtSCALAR; iv = 0; nv = 0.0f; pvlen = 0; }
-		sv_undef(const sv_scalar &v):sv_scalar{v} { }
-	};
-	class sv_yes:public sv_scalar {
-	public:
-		sv_yes(pmat::ptr_t ptr) { address = ptr; type = pmat::sv_type_t::SVtSCALAR; iv = 1; nv = 1.0f; pvlen = 3; pv = "yes"; }
-		sv_yes(const sv_scalar &v):sv_scalar{v} { }
-	};
-	class sv_no:public sv_scalar {
-	public:
-		sv_no(pmat::ptr_t ptr) { address = ptr; type = pmat::sv_type_t::SVtSCALAR; iv = 0; nv = 0.0f; pvlen = 2; pv = "no"; }
-		sv_no(const sv_scalar &v):sv_scalar{v} { }
+		sv_scalar():flags{0},iv{0},nv{0.0},pvlen{0},ourstash{0} { }
+
+		/* The immortals, which we don't get a heap entry for */
+		static sv_scalar undef() { return sv_scalar { }; }
+		static sv_scalar yes() { sv_scalar v; v.iv = 1; v.nv = 1.0; v.pvlen = 3; v.pv = "yes"; return v; }
+		static sv_scalar no() { sv_scalar v; v.pvlen = 2; v.pv = "no"; return v; }
 	};
 
-	class sv_hash:public sv {
+	class sv_hash {
 	public:
 		pmat::uint_t count;
 		pmat::ptr_t backrefs;
-		pmat::hash_elem_t elements;
-		sv_hash() { }
-		sv_hash(const sv &v):sv{v} { }
+		/* count entries each, in dump order: the key for each element and the SV it holds */
+		pmat::span<pmat::string_id_t> keys;
+		pmat::span<pmat::ptr_t> values;
+		sv_hash():count{0},backrefs{0} { }
 	};
 	class sv_stash:public sv_hash {
 	public:
@@ -238,21 +321,19 @@ namespace pmat {
 		pmat::ptr_t mro_linear_current;
 		pmat::ptr_t mro_nextmethod;
 		pmat::ptr_t mro_isa;
-		std::string name;
-		sv_stash() { }
-		sv_stash(const sv &v):sv_hash{v} { }
+		pmat::string_id_t name;
+		sv_stash():mro_linear_all{0},mro_linear_current{0},mro_nextmethod{0},mro_isa{0},name{no_string} { }
 	};
 
-	class sv_ref:public sv {
+	class sv_ref {
 	public:
 		uint8_t flags;
 		pmat::ptr_t rv;
 		pmat::ptr_t ourstash;
-		sv_ref() { }
-		sv_ref(const sv &v):sv{v} { }
+		sv_ref():flags{0},rv{0},ourstash{0} { }
 	};
 
-	class sv_glob:public sv {
+	class sv_glob {
 	public:
 		pmat::uint_t line;
 		pmat::ptr_t stash;
@@ -263,22 +344,22 @@ namespace pmat {
 		pmat::ptr_t egv;
 		pmat::ptr_t io;
 		pmat::ptr_t form;
-		std::string name;
-		std::string file;
-		sv_glob() { }
-		sv_glob(const sv &v):sv{v} { }
+		/* Interned, see pmat::sv_table::names() */
+		pmat::string_id_t name;
+		pmat::string_id_t file;
+		sv_glob():line{0},stash{0},scalar{0},array{0},hash{0},code{0},egv{0},io{0},form{0},name{no_string},file{no_string} { }
 	};
-	class sv_array:public sv {
+
+	/** Also the body for the synthetic PADLIST, PADNAMES and PAD types */
+	class sv_array {
 	public:
 		pmat::uint_t count;
 		uint8_t flags;
-		std::vector<pmat::ptr_t> elements;
-		sv_array() { }
-		sv_array(const sv &v):sv{v} { }
-		sv_array(const sv_array &v):sv{v},count{v.count},flags{v.flags},elements{v.elements} { }
+		pmat::span<pmat::ptr_t> elements;
+		sv_array():count{0},flags{0} { }
 	};
 
-	class sv_io:public sv {
+	class sv_io {
 	public:
         uint_t ifileno_;
         uint_t ofileno_;
@@ -286,30 +367,16 @@ namespace pmat {
 		pmat::ptr_t top;
 		pmat::ptr_t format;
 		pmat::ptr_t bottom;
-		sv_io() { }
-		sv_io(const sv &v):sv{v} { }
+		sv_io():ifileno_{0},ofileno_{0},top{0},format{0},bottom{0} { }
 	};
 
-	class sv_lvalue:public sv {
+	class sv_lvalue {
 	public:
 		uint8_t type;
 		pmat::uint_t offset;
 		pmat::uint_t length;
 		pmat::ptr_t target;
-		sv_lvalue() { }
-		sv_lvalue(const sv &v):sv{v} { }
-	};
-
-	class sv_regexp:public sv {
-	public:
-		sv_regexp() { }
-		sv_regexp(const sv &v):sv{v} { }
-	};
-
-	class sv_format:public sv {
-	public:
-		sv_format() { }
-		sv_format(const sv &v):sv{v} { }
+		sv_lvalue():type{0},offset{0},length{0},target{0} { }
 	};
 
 	class ctx {
@@ -378,6 +445,12 @@ BOOST_FUSION_DEFINE_STRUCT(
 	(pmat::uint_t, depth)
 	(pmat::ptr_t, pad)
 )
+BOOST_FUSION_DEFINE_STRUCT(
+	(pmat), sv_code_padsv,
+	(pmat::uint_t, depth)
+	(pmat::uint_t, padix)
+	(pmat::ptr_t, sv)
+)
 BOOST_FUSION_DEFINE_STRUCT(
 	(pmat), sv_code_padname,
 	(pmat::uint_t, padix)
@@ -386,7 +459,7 @@ BOOST_FUSION_DEFINE_STRUCT(
 )
 
 namespace pmat {
-	class sv_code:public sv {
+	class sv_code {
 	public:
 		pmat::uint_t line;
 		uint8_t flags;
@@ -397,42 +470,36 @@ namespace pmat {
 		pmat::ptr_t outside;
 		pmat::ptr_t padlist;
 		pmat::ptr_t constval;
-		std::string file;
-		std::string name;
+		/* Interned, see pmat::sv_table::names() */
+		pmat::string_id_t file;
+		pmat::string_id_t name;
 
 		pmat::ptr_t constsv_;
 		pmat::uint_t constix_;
 		pmat::ptr_t gvsv_;
 		pmat::uint_t gvix_;
 		pmat::ptr_t padnames_;
-		std::vector<pmat::ptr_t> pads_;
-
-		std::vector<std::weak_ptr<pmat::sv>> pad_svs_;
+		/* Indexed by depth */
+		pmat::span<pmat::ptr_t> pads_;
 
-		sv_code() { }
-		sv_code(const sv &v):sv{v} { }
-	};
-	class sv_padlist:public sv_array {
-	public:
-		void set_cv(std::shared_ptr<pmat::sv_code> cv) { }
-		sv_padlist() { }
-		sv_padlist(const sv &v) = delete;
-		sv_padlist(const sv_array &v):sv_array{v} { type = sv_type_t::SVtPADLIST; }
-	};
-	class sv_padnames:public sv_array {
-	public:
-		void set_cv(std::shared_ptr<pmat::sv_code> cv) { }
-		sv_padnames() { }
-		sv_padnames(const sv &v) = delete;
-		sv_padnames(const sv_array &v):sv_array{v} { type = sv_type_t::SVtPADNAMES;  }
+		sv_code():line{0},flags{0},op_root{0},depth{0},stash{0},glob{0},outside{0},padlist{0},constval{0},file{no_string},name{no_string},
+			constsv_{0},constix_{0},gvsv_{0},gvix_{0},padnames_{0} { }
 	};
-	class sv_pad:public sv_array {
+
+	/** A magic record, kept with the SV it's attached to - see sv_table::magic() */
+	class sv_magic {
 	public:
-		void set_cv(std::shared_ptr<pmat::sv_code> cv) { }
-		sv_pad() { }
-		sv_pad(const sv &v) = delete;
-		sv_pad(const sv_array &v):sv_array{v} { type = sv_type_t::SVtPAD;  }
+		pmat::ptr_t obj;
+		pmat::ptr_t ptr;
+		/* The perl magic type, e.g. 'P' for a tied hash */
+		uint8_t type;
+		uint8_t flags;
+		sv_magic():obj{0},ptr{0},type{0},flags{0} { }
+		/** Whether the SV holds a reference on obj (MGf_REFCOUNTED) */
+		bool refcounted() const { return flags & 0x01; }
 	};
+	/** Perl's name for a magic type, e.g. "tied" for 'P', or the character itself if we don't know it */
+	std::string magic_type_name(uint8_t type);
 };
 
 BOOST_FUSION_ADAPT_STRUCT(
@@ -451,14 +518,15 @@ BOOST_FUSION_ADAPT_STRUCT(
 	(double, nv)
 	(pmat::uint_t, pvlen)
 	(pmat::ptr_t, ourstash)
-	(std::string, pv)
+	(pmat::str_t, pv)
 )
 
 BOOST_FUSION_ADAPT_STRUCT(
 	pmat::sv_hash,
 	(pmat::uint_t, count)
 	(pmat::ptr_t, backrefs)
-	(pmat::hash_elem_t, elements)
+	(pmat::span<pmat::string_id_t>, keys)
+	(pmat::span<pmat::ptr_t>, values)
 )
 
 BOOST_FUSION_ADAPT_STRUCT(
@@ -469,8 +537,9 @@ BOOST_FUSION_ADAPT_STRUCT(
 	(pmat::ptr_t, mro_linear_current)
 	(pmat::ptr_t, mro_nextmethod)
 	(pmat::ptr_t, mro_isa)
-	(std::string, name)
-	(pmat::hash_elem_t, elements)
+	(pmat::string_id_t, name)
+	(pmat::span<pmat::string_id_t>, keys)
+	(pmat::span<pmat::ptr_t>, values)
 )
 
 BOOST_FUSION_ADAPT_STRUCT(
@@ -491,15 +560,15 @@ BOOST_FUSION_ADAPT_STRUCT(
 	(pmat::ptr_t, egv)
 	(pmat::ptr_t, io)
 	(pmat::ptr_t, form)
-	(std::string, name)
-	(std::string, file)
+	(pmat::string_id_t, name)
+	(pmat::string_id_t, file)
 )
 
 BOOST_FUSION_ADAPT_STRUCT(
 	pmat::sv_array,
 	(pmat::uint_t, count)
 	(uint8_t, flags)
-	(std::vector<pmat::ptr_t>, elements)
+	(pmat::span<pmat::ptr_t>, elements)
 )
 
 BOOST_FUSION_ADAPT_STRUCT(
@@ -529,7 +598,7 @@ BOOST_FUSION_ADAPT_STRUCT(
 	(pmat::ptr_t, outside)
 	(pmat::ptr_t, padlist)
 	(pmat::ptr_t, constval)
-	(std::string, file)
+	(pmat::string_id_t, file)
 )
 
 BOOST_FUSION_ADAPT_STRUCT(
@@ -586,319 +655,3 @@ BOOST_FUSION_DEFINE_STRUCT(
 	(pmat::typevec8_t, types)
 	(pmat::typevec8_t, contexts)
 )
-
-namespace pmat {
-	class state_t {
-	public:
-		std::vector<pmat::type> types;
-		std::vector<pmat::context> contexts;
-
-		explicit state_t():file_offset_{0} { }
-		~state_t() {
-			dump_sizes();
-	   	}
-
-		size_t add_file_offset(const size_t v) { file_offset_ += v; }
-		size_t file_offset() const { DEBUG << "File offset = " << file_offset_; return file_offset_; }
-
-		/** Provides something like the pmat-sizes output */
-		void dump_sizes() {
-			/* First, combine blessed+regular SVs */
-			struct Thing {
-				size_t count, size;
-			};
-			auto types = std::map<std::string, Thing> { };
-			for(auto &it : sv_count_by_blessed_type_) {
-				types[it.first].count += it.second;
-			}
-			for(auto &it : sv_count_by_type_) {
-				types[sv_type_by_id(it.first)].count += it.second;
-			}
-			for(auto &it : sv_size_by_blessed_type_) {
-				types[it.first].size += it.second;
-			}
-			for(auto &it : sv_size_by_type_) {
-				types[sv_type_by_id(it.first)].size += it.second;
-			}
-
-			using thing_type_t = std::pair<std::string, Thing>;
-			auto myvec = std::vector<thing_type_t> { };
-			for(auto it : types) {
-				myvec.push_back(it);
-			}
-			size_t count = 0, total = 0;
-			for(auto &it : myvec) {
-				count += it.second.count;
-				total += it.second.size;
-			}
-
-			/* Sort by size */
-			std::sort(
-				myvec.begin(),
-				myvec.end(),
-				[] (const std::pair<std::string, Thing> &left, const std::pair<std::string, Thing> &right) -> bool {
-					return left.second.size > right.second.size;
-				}
-			);
-			myvec.emplace_back(
-				std::pair<std::string, Thing> {
-					"Total",
-					Thing {
-						count,
-						total
-					}
-				}
-			);
-
-			/* Now find the column widths */
-			size_t width[3] { 0, 0, 0 };
-			auto nmax = [](const size_t x, const size_t y) -> size_t { return x > y ? x : y; };
-			for(const auto &it : myvec) {
-				DEBUG << "Type " << it.first << " length is " << std::to_string(it.first.size());
-				width[0] = nmax(width[0], it.first.size());
-				width[1] = nmax(width[1], std::to_string(it.second.count).size());
-				width[2] = nmax(width[2], std::to_string(it.second.size).size());
-			}
-			DEBUG << "width 0 " << width[0];
-			DEBUG << "width 1 " << width[1];
-			DEBUG << "width 2 " << width[2];
-			{
-				boost::io::ios_all_saver ias { std::cout };
-				std::cout << std::setw(width[0]) << std::setiosflags(std::ios::left) << std::setfill(' ') << "Type";
-				std::cout << std::setw(0) << " | ";
-				std::cout << std::setw(width[1]) << std::setiosflags(std::ios::left) << std::setfill(' ') << "SVs";
-				std::cout << std::setw(0) << " | ";
-				std::cout << std::setw(width[2]) << std::setiosflags(std::ios::left) << std::setfill(' ') << "Bytes";
-				std::cout << std::endl;
-			}
-
-			for(auto &it : myvec) {
-				{
-					boost::io::ios_all_saver ias { std::cout };
-					std::cout << std::setw(width[0]) << std::setiosflags(std::ios::left) << std::setfill(' ') << it.first;
-				}
-				{
-					boost::io::ios_all_saver ias { std::cout };
-					std::cout << std::setw(0) << " | ";
-					std::cout << std::setw(width[1]) << std::setfill(' ') << it.second.count;
-					std::cout << std::setw(0) << " | ";
-					std::cout << std::setw(width[2]) << std::setfill(' ') << it.second.size;
-					std::cout << std::endl;
-				}
-			}
-			DEBUG << "Expecting " << (int)sv_by_addr_.size() << " SVs, had " << count;
-		}
-
-		std::shared_ptr<pmat::sv> sv_by_addr(const pmat::ptr_t &addr) const { return sv_by_addr_.at(addr); }
-	
-		void dump_sv(const pmat::sv &sv) {
-			DEBUG << pmat::to_string(sv.address) << ", type = " << (int) sv.type << " (" << sv_type_by_id(sv.type) << ")";
-			switch(sv.type) {
-			case pmat::sv_type_t::SVtSCALAR:
-				{
-					DEBUG << "Scalar";
-				}
-				break;
-			case pmat::sv_type_t::SVtSTASH:
-				{
-					auto v = reinterpret_cast<const pmat::sv_stash *>(&sv);
-					DEBUG << "Stash " << v->name;
-				}
-				break;
-			default:
-				DEBUG << "Unknown SV";
-			}
-		}
-
-		/** Add an SV to our lists */
-		void add_sv(std::shared_ptr<pmat::sv> sv) {
-			DEBUG << "Adding SV " << pmat::to_string(*sv);
-			assert(sv->type != sv_type_t::SVtEND);
-			assert(sv->type != sv_type_t::SVtUNKNOWN);
-			if(sv_by_addr_.cend() != sv_by_addr_.find(sv->address)) {
-				auto existing = sv_by_addr_[sv->address];
-				ERROR << "Already have address " << pmat::to_string(sv->address) << " occupied by " << sv_type_by_id(existing->type);
-				dump_sv(*sv);
-				dump_sv(*existing);
-				// assert(sv_by_addr_.cend() == sv_by_addr_.find(sv->address));
-				return;
-			}
-			sv_by_addr_[sv->address] = sv;
-			if(sv->blessed == 0) {
-				++sv_count_by_type_[sv->type];
-				sv_size_by_type_[sv->type] += sv->size;
-			} else {
-				update_blessed(*sv);
-			}
-			DEBUG << "SV stats for [" << sv_type_by_id(sv->type) << "] on " << (void *)this << ": count " << sv_count_by_type_[sv->type] << " size " << sv_size_by_type_[sv->type];
-
-			/* Was anything waiting for us to provide information for a blessed slot? */
-			auto it = sv_blessed_pending_.find(sv->address);
-			if(sv_blessed_pending_.cend() != it) {
-				DEBUG << "Found " << it->second.size() << " items relying on this SV for blessed pointer";
-				/* If something is using us as a blessed pointer, we must be a stash */
-				assert(sv->type == sv_type_t::SVtSTASH);
-				auto st = std::static_pointer_cast<pmat::sv_stash>(sv);
-				DEBUG << "Type " << sv_type_by_id(st->type) << ", name is " << st->name;
-				for(auto ptr : it->second) {
-					auto v = sv_by_addr(ptr);
-					assert(v->blessed == sv->address);
-					DEBUG << pmat::to_string(v->address) << " from " << pmat::to_string(ptr) << " being updated - blessed was " << pmat::to_string(v->blessed) << " and we are " << pmat::to_string(sv->address);
-					update_blessed(*v);
-				}
-				sv_blessed_pending_.erase(it);
-			}
-
-		}
-
-		bool have_sv_at(pmat::ptr_t &ptr) const {
-			return sv_by_addr_.cend() != sv_by_addr_.find(ptr);
-	   	}
-
-		std::shared_ptr<pmat::sv> sv_at(const pmat::ptr_t ptr) {
-			return sv_by_addr_.at(ptr);
-	   	}
-
-		void update_blessed(pmat::sv &sv) {
-			if(have_sv_at(sv.blessed)) {
-				auto bt = sv_blessed_type(sv);
-				DEBUG << "Entry from " << bt;
-				++sv_count_by_blessed_type_[bt];
-				sv_size_by_blessed_type_[bt] += sv.size;
-			} else {
-				DEBUG << "Could not find pointer for blessed stash " << (void *)sv.blessed << ", deferring " << (void*)sv.address;
-				auto &t = sv_blessed_pending_[sv.blessed];
-				t.push_back(sv.address);
-				DEBUG << "Pending for " << (void *)sv.blessed << " is now " << t.size();
-			}
-		}
-
-		void finish() {
-			if(!sv_blessed_pending_.empty()) {
-				ERROR << "Still had SVs that didn't resolve blessed pointer";
-				sv_blessed_pending_.clear();
-			}
-
-			/* Apply fixup to every SV */
-			for(const auto &it : sv_by_addr_) {
-				auto sv = it.second;
-				if(sv->type == pmat::sv_type_t::SVtCODE) {
-					auto cv = std::static_pointer_cast<pmat::sv_code>(sv);
-					DEBUG << "Have CODE SV at " << (void *)cv->address << " - " << cv->file << ":" << (int)cv->line;
-					if(cv->padlist == 0) {
-						INFO << "No PADLIST, skipping";
-						continue;
-					}
-
-					if(!have_sv_at(cv->padlist)) {
-						ERROR << "Padlist points to CV that does not exist - " << (void *)cv->padlist;
-						continue;
-					} else {
-						DEBUG << "Upgrading padlist at address [" << (void *)cv->padlist << "]";
-						auto old = std::static_pointer_cast<pmat::sv_array>(sv_at(cv->padlist));
-						assert(old->type == sv_type_t::SVtARRAY);
-						auto padlist = std::make_shared<pmat::sv_padlist>(*old);
-						padlist->set_cv(cv);
-						replace_sv(old, padlist);
-					}
-					if(cv->padnames_ == 0) {
-                        DEBUG << "No padnames for this CV, skipping";
-                        continue;
-                    }
-
-					assert(cv->padnames_ != 0);
-					if(!have_sv_at(cv->padnames_)) {
-						ERROR << "No SV for padnames at " << (void *)cv->padnames_;
-					} else {
-						DEBUG << "Upgrading padnames at address [" << (void *)cv->padnames_ << "]";
-						auto old = std::static_pointer_cast<pmat::sv_array>(sv_at(cv->padnames_));
-						// assert(old->type == sv_type_t::SVtARRAY);
-						if(old->type == sv_type_t::SVtARRAY) {
-                            auto padnames = std::make_shared<pmat::sv_padnames>(*old);
-                            assert(old->count == padnames->count);
-                            assert(old->elements.size() == padnames->elements.size());
-                            assert(old->elements.size() == padnames->count);
-                            padnames->set_cv(cv);
-                            replace_sv(old, padnames);
-
-                            DEBUG << "Total of " << cv->pads_.size() << " items to convert to pads";
-                            int idx = 0;
-                            for(auto &ptr : cv->pads_) {
-                                DEBUG << "Pad depth " << idx << " at " << (void *)ptr;
-                                if(idx > 0 && ptr != 0) {
-                                    auto old_sv = sv_at(ptr);
-                                    DEBUG << "Item " << idx << " in the pad is " << sv_type_by_id(old_sv->type) << " with addr " << (void *)old_sv->address;
-                                    auto old = std::static_pointer_cast<pmat::sv_array>(old_sv);
-                                    assert(old->type == sv_type_t::SVtARRAY);
-                                    auto pad = std::make_shared<pmat::sv_pad>(*old);
-                                    pad->set_cv(cv);
-                                    replace_sv(old, pad);
-                                    cv->pad_svs_.emplace_back(pad);
-                                }
-                                ++idx;
-                            }
-                        } else {
-                            ERROR << "padnames at address [" << (void *)cv->padnames_ << "] should be an array, but aren't";
-                        }
-					}
-				}
-			}
-		}
-
-		void replace_sv(std::shared_ptr<pmat::sv> was, std::shared_ptr<pmat::sv> now) {
-			assert(was->address == now->address);
-			--sv_count_by_type_[was->type];
-			sv_size_by_type_[was->type] -= was->size;
-
-			++sv_count_by_type_[now->type];
-			sv_size_by_type_[now->type] += now->size;
-
-			sv_by_addr_[was->address] = now;
-		}
-	
-		std::string sv_blessed_type(const pmat::sv &sv) const {
-			auto base = sv_type_by_id(sv.type);
-			if(sv.blessed == 0) return base;
-			DEBUG << "We have " << (void *)sv.blessed << " as a blessed pointer";
-			auto bs = std::static_pointer_cast<pmat::sv_stash>(sv_by_addr(sv.blessed));
-			if(bs->type != sv_type_t::SVtSTASH) {
-				ERROR << "We have something that has been blessed into something that isn't a stash: " << sv_type_by_id(bs->type);
-				return base;
-			}
-			return base + "(" + bs->name + ")";
-		}
-
-		std::string sv_type_by_id(const sv_type_t &id) const {
-			switch(id) {
-			case sv_type_t::SVtEND: return u8"end of list";
-			case sv_type_t::SVtGLOB: return u8"GLOB";
-			case sv_type_t::SVtSCALAR: return u8"SCALAR";
-			case sv_type_t::SVtREF: return u8"REF";
-			case sv_type_t::SVtARRAY: return u8"ARRAY";
-			case sv_type_t::SVtHASH: return u8"HASH";
-			case sv_type_t::SVtSTASH: return u8"STASH";
-			case sv_type_t::SVtCODE: return u8"CODE";
-			case sv_type_t::SVtIO: return u8"IO";
-			case sv_type_t::SVtLVALUE: return u8"LVALUE";
-			case sv_type_t::SVtREGEXP: return u8"REGEXP";
-			case sv_type_t::SVtFORMAT: return u8"FORMAT";
-			case sv_type_t::SVtINVLIST: return u8"INVLIST";
-			case sv_type_t::SVtPADNAMES: return u8"PADNAMES";
-			case sv_type_t::SVtPADLIST: return u8"PADLIST";
-			case sv_type_t::SVtPAD: return u8"PAD";
-			case sv_type_t::SVtMAGIC: return u8"MAGIC";
-			case sv_type_t::SVtUNKNOWN: return u8"UNKNOWN";
-			default: return "unknown sv type";
-			}
-		}
-	private:
-		std::map<pmat::ptr_t, std::shared_ptr<pmat::sv>> sv_by_addr_;
-		std::map<pmat::sv_type_t, size_t> sv_count_by_type_;
-		std::map<std::string, size_t> sv_count_by_blessed_type_;
-		std::map<pmat::sv_type_t, size_t> sv_size_by_type_;
-		std::map<std::string, size_t> sv_size_by_blessed_type_;
-		std::map<pmat::ptr_t, std::vector<pmat::ptr_t>> sv_blessed_pending_;
-		size_t file_offset_;
-	};
-};
-
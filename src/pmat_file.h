@@ -0,0 +1,262 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <boost/asio/buffer.hpp>
+
+#include "detail.h"
+#include "stream_input.h"
+#include "stats.h"
+#include "Log.h"
+
+namespace pmat { class index_file; };
+
+/**
+ * Loads a complete .pmat dump from memory into a pmat::state_t.
+ *
+ * If backing is provided, it's taken to own data: the state holds on to it and SV
+ * strings point straight into it rather than being copied. The reference graph is
+ * only built when with_graph is set, see pmat::state_t::finish.
+ *
+ * With lazy set (and backing provided, since we'll be going back to the data), SV
+ * bodies are left in the dump and only decoded when something asks for them, see
+ * pmat::state_t::defer_bodies. That's most of the parsing and allocation skipped for
+ * runs that only look at types and sizes.
+ *
+ * A dump can also be brought back from its index instead, see pmat::index_file, or
+ * read from a pipe or compressed file as it arrives, see pmat::stream_input.
+ */
+class pmat_file {
+public:
+	pmat_file(
+		const char *data,
+		size_t len,
+		size_t threads = 1,
+		std::shared_ptr<const void> backing = nullptr,
+		bool with_graph = true,
+		bool lazy = false
+	) {
+		auto &pm = pm_;
+		lazy = lazy && backing;
+		if(backing) pm.keep_backing(std::move(backing));
+		pmat::header fr;
+		asio::const_buffer remainder;
+		stats_.time("header", [&] {
+			std::tie(fr, remainder) = detail::read<pmat::header>(asio::buffer(data, len), pm);
+			apply(fr);
+		});
+		/* Everything after the header is read with the dump's own widths and byte order */
+		detail::with_layout(fr.flags, [&](auto layout) {
+			using L = decltype(layout);
+			if(lazy) defer_bodies<L>(asio::buffer(data, len));
+			stats_.time("roots", [&] {
+				DEBUG << "Roots:";
+				pmat::roots roots;
+				std::tie(roots, remainder) = detail::read<pmat::roots, L>(remainder, pm);
+				apply(roots);
+			});
+			stats_.time("stack", [&] {
+				DEBUG << "Stack:";
+				pmat::stack stack;
+				std::tie(stack, remainder) = detail::read<pmat::stack, L>(remainder, pm);
+				apply(stack);
+			});
+			stats_.time("heap", [&] {
+				DEBUG << "Heap:";
+				pmat::heap heap;
+				std::tie(heap, remainder) = detail::read<pmat::heap, L>(remainder, pm, threads);
+			});
+			/* Not decoded yet, so this should come out as nothing */
+			stats_.time("context", [&] {
+				DEBUG << "Context:";
+				pmat::context ctx;
+				// std::tie(ctx, remainder) = detail::read<pmat::context>(remainder, pm);
+			});
+			DEBUG << "End of sections";
+		});
+
+		stats_.set_bytes(len);
+		stats_.time("finish", [&] { pm.finish(threads, with_graph); });
+		stats_.count_svs(pm);
+		stats_.measure(pm);
+	}
+
+	/**
+	 * Loads a dump as it arrives from a stream, see pmat::stream_input. Strings are always
+	 * copied, since the data they came in is reused.
+	 *
+	 * The heap is taken a window at a time: we find the SV records that have arrived in
+	 * full, decode those (on the worker threads, as for a mapped dump), then drop them and
+	 * wait for more.
+	 */
+	pmat_file(
+		pmat::stream_input &in,
+		size_t threads = 1,
+		bool with_graph = true
+	) {
+		auto &pm = pm_;
+		pmat::stream_window window { in };
+		pmat::header fr;
+		stats_.time("header", [&] {
+			window.more();
+			/* The header adds to the type and context tables as it goes, so start those afresh each try */
+			fr = read_section<pmat::header, detail::native_layout>(window, [&pm] {
+				pm.types.clear();
+				pm.contexts.clear();
+			});
+			apply(fr);
+		});
+		detail::with_layout(fr.flags, [&](auto layout) { this->stream_sections<decltype(layout)>(window, threads); });
+		stats_.set_bytes(window.total());
+		stats_.time("finish", [&] { pm.finish(threads, with_graph); });
+		stats_.count_svs(pm);
+		stats_.measure(pm);
+	}
+
+	pmat::state_t &state() { return pm_; }
+	const pmat::state_t &state() const { return pm_; }
+
+	uint32_t perl_version() const { return perl_version_; }
+	uint16_t pmat_version() const { return pmat_version_; }
+	pmat::flags_t header_flags() const { return header_flags_; }
+	/** Timings and counts from the load, see --stats */
+	const pmat::load_stats &stats() const { return stats_; }
+
+	std::string perl_version_string() const {
+		int rev = (perl_version_) & 0xFF;
+		int ver = (uint16_t) ((perl_version_ >>  8) & 0xFFFF);
+		int sub = (uint16_t) ((perl_version_ >> 24) & 0xFFFF);
+		return std::to_string(rev) + "." + std::to_string(ver) + "." + std::to_string(sub);
+	}
+
+	std::string pmat_version_string() const {
+		return std::to_string(pmat_version_ >> 8) + "." + std::to_string(pmat_version_ & 0xFF);
+	}
+
+private:
+	/** Everything after the header for a streamed dump, see the stream constructor */
+	template<class L>
+	void stream_sections(pmat::stream_window &window, size_t threads) {
+		stats_.time("roots", [&] {
+			DEBUG << "Roots:";
+			apply(read_section<pmat::roots, L>(window));
+		});
+		stats_.time("stack", [&] {
+			DEBUG << "Stack:";
+			apply(read_section<pmat::stack, L>(window));
+		});
+		stats_.time("heap", [&] { stream_heap<L>(window, threads); });
+		/* As for a mapped dump, the context section isn't decoded yet */
+		stats_.time("context", [] { });
+		DEBUG << "End of sections";
+	}
+
+	template<class L>
+	void stream_heap(pmat::stream_window &window, size_t threads) {
+		auto &pm = pm_;
+		DEBUG << "Heap:";
+		for(;;) {
+			auto r = detail::basic_reader<L>::over(window.data(), pm, threads);
+			std::vector<size_t> starts;
+			bool finished = false;
+			const size_t complete = r.scan_records(starts, finished);
+			TRACE << "Decoding " << starts.size() << " SVs from " << complete << " bytes of stream";
+			r.decode_records(starts);
+			window.consume(complete);
+			if(finished) break;
+			if(!window.more(threads * pmat::stream_input::chunk_size)) {
+				ERROR << "Stream ended part way through the heap";
+				throw detail::bad_message();
+			}
+		}
+	}
+
+	/** Reads a section from the front of window, pulling in more of the stream until it's all there */
+	template<typename T, class L>
+	T read_section(pmat::stream_window &window, std::function<void()> reset = [] { }) {
+		for(;;) {
+			reset();
+			auto r = detail::basic_reader<L>::over(window.data(), pm_);
+			T v;
+			try {
+				r(v);
+				window.consume(r.offset_);
+				return v;
+			} catch(const detail::bs::system_error &e) {
+				if(!detail::is_short_read(e)) throw;
+			}
+			if(!window.more()) {
+				ERROR << "Stream ended part way through the sections before the heap";
+				throw detail::bad_message();
+			}
+		}
+	}
+
+	void apply(const pmat::header &fr) {
+		DEBUG << "PMAT state now has " << pm_.types.size() << " types - " << (void *)(&pm_);
+		DEBUG << "Magic (\"PMAT\"): " << fr.magic;
+		DEBUG << "Flags:";
+		DEBUG << " * Big-endian:  " << (fr.flags.big_endian ? "yes" : "no");
+		DEBUG << " * Int64:       " << (fr.flags.integer_64 ? "yes" : "no");
+		DEBUG << " * Ptr64:       " << (fr.flags.pointer_64 ? "yes" : "no");
+		DEBUG << " * Long double: " << (fr.flags.float_64 ? "yes" : "no");
+		DEBUG << " * Threads:     " << (fr.flags.threads ? "yes" : "no");
+		header_flags_ = fr.flags;
+
+		perl_version_ = net::ntoh(fr.perl_ver);
+		pmat_version_ = (static_cast<uint16_t>(fr.major_ver) << 8) | static_cast<uint16_t>(fr.minor_ver);
+		DEBUG << "PMAT format " << pmat_version_string() << " generated on Perl " << perl_version_string();
+	}
+
+	void apply(const pmat::roots &roots) {
+		auto &pm = pm_;
+		pm.add_sv(pmat::sv { pmat::sv_type_t::SVtSCALAR, roots.undef }, pmat::sv_scalar::undef());
+		DEBUG << "Undef: " << pmat::to_string(roots.undef);
+		pm.add_sv(pmat::sv { pmat::sv_type_t::SVtSCALAR, roots.yes }, pmat::sv_scalar::yes());
+		DEBUG << "Yes:   " << pmat::to_string(roots.yes);
+		pm.add_sv(pmat::sv { pmat::sv_type_t::SVtSCALAR, roots.no }, pmat::sv_scalar::no());
+		DEBUG << "No:   " << pmat::to_string(roots.no);
+		pm.add_root("undef", roots.undef);
+		pm.add_root("yes", roots.yes);
+		pm.add_root("no", roots.no);
+		for(const auto &root : roots.other_roots.items) {
+			DEBUG << "Root " << root.rootname << ": " << pmat::to_string(root.ptr);
+			pm.add_root(root.rootname, root.ptr);
+		}
+	}
+
+	void apply(const pmat::stack &stack) {
+		DEBUG << "Stack has " << stack.elem.items.size() << " entries";
+		for(auto ptr : stack.elem.items)
+			pm_.add_stack(ptr);
+	}
+
+	/** Has the state decode bodies from data on demand, with a reader of their own */
+	template<class L>
+	void defer_bodies(asio::const_buffer data) {
+		auto &pm = pm_;
+		auto r = std::make_shared<detail::basic_reader<L>>(detail::basic_reader<L>::over(data, pm));
+		pm.defer_bodies([&pm, r](pmat::sv_id_t id) {
+			auto &svs = pm.svs();
+			auto v = svs.header(id);
+			/* The synthetic types were plain arrays in the dump */
+			if(v.type == pmat::sv_type_t::SVtPADLIST || v.type == pmat::sv_type_t::SVtPADNAMES || v.type == pmat::sv_type_t::SVtPAD)
+				v.type = pmat::sv_type_t::SVtARRAY;
+			r->seek(svs.body_offset(id));
+			r->decode_body(v, svs.keys(), svs.names(), [&svs, id](auto &&... body) { attach(svs, id, std::forward<decltype(body)>(body)...); });
+		});
+	}
+	static void attach(pmat::sv_table &, pmat::sv_id_t) { }
+	template<typename T>
+	static void attach(pmat::sv_table &svs, pmat::sv_id_t id, T &&body) { svs.set_body(id, std::forward<T>(body)); }
+
+	friend class pmat::index_file;
+	/** For pmat::index_file, which fills everything in */
+	pmat_file() { }
+
+	pmat::state_t pm_;
+	pmat::load_stats stats_;
+	uint32_t perl_version_;
+	uint16_t pmat_version_;
+	pmat::flags_t header_flags_;
+};
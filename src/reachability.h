@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "ref_graph.h"
+#include "parallel.h"
+
+namespace pmat {
+	/**
+	 * The SVs that can be reached by following references from a set of roots, one bit
+	 * per SV.
+	 *
+	 * This is a level-synchronous BFS. Each level's frontier is split into small chunks
+	 * that idle workers claim from a shared counter (see pmat::parallel_for), so a few
+	 * SVs with huge fan-out don't leave the rest of the pool waiting. SVs are claimed
+	 * with an atomic fetch_or on the visited bitmap, so each is expanded exactly once.
+	 */
+	class reach_set {
+	public:
+		reach_set(
+			const pmat::ref_graph &graph,
+			const std::vector<pmat::sv_id_t> &roots,
+			bool follow_weak,
+			size_t threads
+		):count_{0}
+		{
+			const size_t words = (graph.sv_count() + 63) / 64;
+			std::unique_ptr<std::atomic<uint64_t>[]> seen { new std::atomic<uint64_t>[words] };
+			for(size_t i = 0; i < words; ++i) seen[i] = 0;
+			auto claim = [&seen](pmat::sv_id_t id) {
+				const uint64_t bit = uint64_t{1} << (id % 64);
+				auto &word = seen[id / 64];
+				if(word.load(std::memory_order_relaxed) & bit) return false;
+				return !(word.fetch_or(bit, std::memory_order_relaxed) & bit);
+			};
+
+			std::vector<pmat::sv_id_t> frontier;
+			for(auto id : roots)
+				if(id != pmat::no_sv && claim(id)) frontier.push_back(id);
+			while(!frontier.empty()) {
+				count_ += frontier.size();
+				std::vector<std::vector<pmat::sv_id_t>> next((frontier.size() + grain - 1) / grain);
+				pmat::parallel_for(threads, frontier.size(), grain, [&](size_t begin, size_t end) {
+					auto &out = next[begin / grain];
+					for(size_t i = begin; i < end; ++i) {
+						for(const auto &e : graph.out(frontier[i])) {
+							if(!follow_weak && e.kind == pmat::edge_kind_t::weak) continue;
+							if(claim(e.to)) out.push_back(e.to);
+						}
+					}
+				});
+				frontier.clear();
+				for(const auto &n : next)
+					frontier.insert(frontier.end(), n.begin(), n.end());
+			}
+
+			bits_.resize(words);
+			for(size_t i = 0; i < words; ++i) bits_[i] = seen[i].load(std::memory_order_relaxed);
+		}
+
+		bool reached(pmat::sv_id_t id) const { return (bits_[id / 64] >> (id % 64)) & 1; }
+		/** How many SVs were reached */
+		size_t count() const { return count_; }
+
+	private:
+		/** Frontier SVs per work item */
+		static constexpr size_t grain = 1024;
+
+		std::vector<uint64_t> bits_;
+		size_t count_;
+	};
+};
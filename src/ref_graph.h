@@ -0,0 +1,326 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "pmat.h"
+#include "column.h"
+#include "sv_table.h"
+#include "parallel.h"
+
+namespace pmat {
+	/** Which field of the referring SV an edge comes from */
+	enum class edge_slot_t : std::uint8_t {
+		blessed,
+		ourstash,
+		rv,
+		glob_stash,
+		glob_scalar,
+		glob_array,
+		glob_hash,
+		glob_code,
+		glob_egv,
+		glob_io,
+		glob_form,
+		element,	// index is the array position
+		value,		// index is the key id
+		backrefs,
+		mro_linear_all,
+		mro_linear_current,
+		mro_nextmethod,
+		mro_isa,
+		cv_stash,
+		cv_glob,
+		cv_outside,
+		cv_padlist,
+		cv_constval,
+		cv_constsv,
+		cv_gvsv,
+		cv_padnames,
+		cv_pad,		// index is the depth
+		io_top,
+		io_format,
+		io_bottom,
+		lv_target,
+		mg_obj		// index is the magic type
+	};
+
+	/** Strong edges hold a refcount on their target, weak ones don't */
+	enum class edge_kind_t : std::uint8_t {
+		strong,
+		weak
+	};
+
+	/** Short name for a slot, as used in reports */
+	const char *to_string(edge_slot_t slot);
+	/** Where a pointer sits in its SV, e.g. "element [3]", "value {foo}", "the glob's scalar" */
+	std::string describe(edge_slot_t slot, uint32_t index, const pmat::string_table &keys);
+
+	/**
+	 * Every SV-to-SV pointer in the dump, in compressed sparse row form: the outgoing edges
+	 * for an SV are the run starting at its offset, with targets as SV ids. Pointers to
+	 * addresses that aren't in the table (the 5.20 padlists, anything the dumper skipped)
+	 * are counted but not stored.
+	 *
+	 * The same edges are also kept transposed, so the referrers of an SV are a run of
+	 * their own - see in().
+	 */
+	class ref_graph {
+	public:
+		struct edge {
+			pmat::sv_id_t to;
+			uint32_t index;
+			pmat::edge_slot_t slot;
+			pmat::edge_kind_t kind;
+		};
+		/** An edge seen from its target: the SV pointing at us, and where the pointer is */
+		struct inref {
+			pmat::sv_id_t from;
+			uint32_t index;
+			pmat::edge_slot_t slot;
+			pmat::edge_kind_t kind;
+		};
+
+		/**
+		 * Calls fn(slot, kind, index, address) for each non-null pointer field of an SV, and
+		 * the object of its refcounted magic. This is the one place that knows which fields
+		 * are references.
+		 */
+		template<typename F>
+		static void for_each_ref(const pmat::sv_table &svs, pmat::sv_id_t id, F &&fn) {
+			const auto strong = edge_kind_t::strong, weak = edge_kind_t::weak;
+			auto ref = [&fn](edge_slot_t slot, edge_kind_t kind, uint32_t index, pmat::ptr_t addr) {
+				if(addr) fn(slot, kind, index, addr);
+			};
+			ref(edge_slot_t::blessed, strong, 0, svs.blessed(id));
+			for(const auto &mg : svs.magic(id))
+				if(owns_magic_obj(svs, mg)) ref(edge_slot_t::mg_obj, strong, mg.type, mg.obj);
+			switch(svs.type(id)) {
+			case sv_type_t::SVtSCALAR: {
+				const auto &b = svs.body<pmat::sv_scalar>(id);
+				ref(edge_slot_t::ourstash, strong, 0, b.ourstash);
+				break;
+			}
+			case sv_type_t::SVtREF: {
+				const auto &b = svs.body<pmat::sv_ref>(id);
+				ref(edge_slot_t::rv, b.flags & 1 ? weak : strong, 0, b.rv);
+				ref(edge_slot_t::ourstash, strong, 0, b.ourstash);
+				break;
+			}
+			case sv_type_t::SVtGLOB: {
+				/* GvSTASH and GvEGV are backreferences, not counted */
+				const auto &b = svs.body<pmat::sv_glob>(id);
+				ref(edge_slot_t::glob_stash, weak, 0, b.stash);
+				ref(edge_slot_t::glob_scalar, strong, 0, b.scalar);
+				ref(edge_slot_t::glob_array, strong, 0, b.array);
+				ref(edge_slot_t::glob_hash, strong, 0, b.hash);
+				ref(edge_slot_t::glob_code, strong, 0, b.code);
+				ref(edge_slot_t::glob_egv, weak, 0, b.egv);
+				ref(edge_slot_t::glob_io, strong, 0, b.io);
+				ref(edge_slot_t::glob_form, strong, 0, b.form);
+				break;
+			}
+			case sv_type_t::SVtARRAY:
+			case sv_type_t::SVtPADLIST:
+			case sv_type_t::SVtPADNAMES:
+			case sv_type_t::SVtPAD: {
+				/* An AV that isn't REAL (backrefs, @_) doesn't own its elements */
+				const auto &b = svs.body<pmat::sv_array>(id);
+				const auto kind = b.flags & 1 ? weak : strong;
+				for(uint32_t i = 0; i < b.elements.size(); ++i)
+					ref(edge_slot_t::element, kind, i, b.elements[i]);
+				break;
+			}
+			case sv_type_t::SVtHASH: {
+				const auto &b = svs.body<pmat::sv_hash>(id);
+				ref(edge_slot_t::backrefs, strong, 0, b.backrefs);
+				for(size_t i = 0; i < b.values.size(); ++i)
+					ref(edge_slot_t::value, strong, b.keys[i], b.values[i]);
+				break;
+			}
+			case sv_type_t::SVtSTASH: {
+				const auto &b = svs.body<pmat::sv_stash>(id);
+				ref(edge_slot_t::backrefs, strong, 0, b.backrefs);
+				ref(edge_slot_t::mro_linear_all, strong, 0, b.mro_linear_all);
+				ref(edge_slot_t::mro_linear_current, strong, 0, b.mro_linear_current);
+				ref(edge_slot_t::mro_nextmethod, strong, 0, b.mro_nextmethod);
+				ref(edge_slot_t::mro_isa, strong, 0, b.mro_isa);
+				for(size_t i = 0; i < b.values.size(); ++i)
+					ref(edge_slot_t::value, strong, b.keys[i], b.values[i]);
+				break;
+			}
+			case sv_type_t::SVtCODE: {
+				/* CvSTASH is a backreference, CvGV and CvOUTSIDE depend on the flags */
+				const auto &b = svs.body<pmat::sv_code>(id);
+				ref(edge_slot_t::cv_stash, weak, 0, b.stash);
+				ref(edge_slot_t::cv_glob, b.flags & 0x10 ? strong : weak, 0, b.glob);
+				ref(edge_slot_t::cv_outside, b.flags & 0x08 ? weak : strong, 0, b.outside);
+				ref(edge_slot_t::cv_padlist, strong, 0, b.padlist);
+				ref(edge_slot_t::cv_constval, strong, 0, b.constval);
+				ref(edge_slot_t::cv_constsv, strong, 0, b.constsv_);
+				ref(edge_slot_t::cv_gvsv, strong, 0, b.gvsv_);
+				ref(edge_slot_t::cv_padnames, strong, 0, b.padnames_);
+				for(uint32_t i = 0; i < b.pads_.size(); ++i)
+					ref(edge_slot_t::cv_pad, strong, i, b.pads_[i]);
+				break;
+			}
+			case sv_type_t::SVtIO: {
+				const auto &b = svs.body<pmat::sv_io>(id);
+				ref(edge_slot_t::io_top, strong, 0, b.top);
+				ref(edge_slot_t::io_format, strong, 0, b.format);
+				ref(edge_slot_t::io_bottom, strong, 0, b.bottom);
+				break;
+			}
+			case sv_type_t::SVtLVALUE: {
+				const auto &b = svs.body<pmat::sv_lvalue>(id);
+				ref(edge_slot_t::lv_target, strong, 0, b.target);
+				break;
+			}
+			default:
+				break;
+			}
+		}
+
+		/**
+		 * Whether an SV's magic owns its object: refcounted ones do, and so does a backref
+		 * AV, which perl frees along with the magic. With only one weak referrer, backref
+		 * magic points straight at it instead, and doesn't own it.
+		 */
+		static bool owns_magic_obj(const pmat::sv_table &svs, const pmat::sv_magic &mg) {
+			if(mg.refcounted()) return true;
+			if(mg.type != '<' || !mg.obj) return false;
+			const auto obj = svs.find(mg.obj);
+			return obj != pmat::no_sv && svs.type(obj) == sv_type_t::SVtARRAY;
+		}
+
+		/**
+		 * Builds the graph from a sealed table. Two passes over the SVs, both split across
+		 * the thread pool: count the edges that resolve, prefix sum into the offsets, then
+		 * resolve again and fill each SV's run. Resolving twice costs a second binary search
+		 * per pointer, but avoids holding a second copy of the edges.
+		 */
+		void build(const pmat::sv_table &svs, size_t threads) {
+			assert(svs.sealed());
+			const size_t n = svs.size();
+			offsets_.assign(n + 1, 0);
+			std::vector<size_t> dangling(n ? (n + grain - 1) / grain : 0, 0);
+
+			pmat::parallel_for(threads, n, grain, [&](size_t begin, size_t end) {
+				size_t missing = 0;
+				for(size_t id = begin; id < end; ++id) {
+					uint64_t count = 0;
+					for_each_ref(svs, id, [&](edge_slot_t, edge_kind_t, uint32_t, pmat::ptr_t addr) {
+						if(svs.find(addr) == pmat::no_sv) ++missing;
+						else ++count;
+					});
+					offsets_[id + 1] = count;
+				}
+				dangling[begin / grain] = missing;
+			});
+			for(size_t id = 0; id < n; ++id)
+				offsets_[id + 1] += offsets_[id];
+			dangling_ = 0;
+			for(auto d : dangling) dangling_ += d;
+
+			edges_.resize(offsets_[n]);
+			pmat::parallel_for(threads, n, grain, [&](size_t begin, size_t end) {
+				for(size_t id = begin; id < end; ++id) {
+					auto out = offsets_[id];
+					for_each_ref(svs, id, [&](edge_slot_t slot, edge_kind_t kind, uint32_t index, pmat::ptr_t addr) {
+						const auto to = svs.find(addr);
+						if(to != pmat::no_sv) edges_[out++] = edge { to, index, slot, kind };
+					});
+				}
+			});
+
+			build_inrefs(threads);
+		}
+
+		/** Outgoing edges of an SV */
+		pmat::span<const edge> out(pmat::sv_id_t id) const {
+			return pmat::span<const edge> { edges_.data() + offsets_[id], static_cast<size_t>(offsets_[id + 1] - offsets_[id]) };
+		}
+
+		/** Incoming edges of an SV, ordered by referrer */
+		pmat::span<const inref> in(pmat::sv_id_t id) const {
+			return pmat::span<const inref> { inrefs_.data() + in_offsets_[id], static_cast<size_t>(in_offsets_[id + 1] - in_offsets_[id]) };
+		}
+
+		size_t sv_count() const { return offsets_.empty() ? 0 : offsets_.size() - 1; }
+		size_t edge_count() const { return edges_.size(); }
+		/** Pointers that didn't lead to an SV in the table */
+		size_t dangling() const { return dangling_; }
+		size_t count(edge_kind_t kind) const {
+			size_t n = 0;
+			for(const auto &e : edges_) if(e.kind == kind) ++n;
+			return n;
+		}
+		size_t memory_used() const {
+			return offsets_.capacity() * sizeof(uint64_t) + edges_.capacity() * sizeof(edge)
+				+ in_offsets_.capacity() * sizeof(uint64_t) + inrefs_.capacity() * sizeof(inref);
+		}
+
+		/** Calls f on each part of the graph, as for sv_table::columns() */
+		template<typename F>
+		void columns(F &&f) {
+			f(dangling_);
+			f(offsets_);
+			f(edges_);
+			f(in_offsets_);
+			f(inrefs_);
+		}
+
+	private:
+		/** SVs per work item when building */
+		static constexpr size_t grain = 16384;
+
+		/**
+		 * The transpose, from the forward edges: count the edges into each SV, prefix sum,
+		 * then scatter. Workers claim slots in a target's run with an atomic cursor, so the
+		 * runs are sorted afterwards to keep the output independent of scheduling.
+		 */
+		void build_inrefs(size_t threads) {
+			const size_t n = sv_count();
+			std::unique_ptr<std::atomic<uint64_t>[]> cursor { new std::atomic<uint64_t>[n + 1] };
+			for(size_t i = 0; i <= n; ++i) cursor[i] = 0;
+
+			pmat::parallel_for(threads, edges_.size(), grain, [&](size_t begin, size_t end) {
+				for(size_t e = begin; e < end; ++e)
+					cursor[edges_[e].to + 1].fetch_add(1, std::memory_order_relaxed);
+			});
+			in_offsets_.assign(n + 1, 0);
+			for(size_t id = 0; id < n; ++id) {
+				in_offsets_[id + 1] = in_offsets_[id] + cursor[id + 1].load(std::memory_order_relaxed);
+				cursor[id] = in_offsets_[id];
+			}
+
+			inrefs_.resize(edges_.size());
+			pmat::parallel_for(threads, n, grain, [&](size_t begin, size_t end) {
+				for(size_t id = begin; id < end; ++id) {
+					for(const auto &e : out(id)) {
+						const auto at = cursor[e.to].fetch_add(1, std::memory_order_relaxed);
+						inrefs_[at] = inref { static_cast<pmat::sv_id_t>(id), e.index, e.slot, e.kind };
+					}
+				}
+			});
+			pmat::parallel_for(threads, n, grain, [&](size_t begin, size_t end) {
+				for(size_t id = begin; id < end; ++id) {
+					std::sort(inrefs_.begin() + in_offsets_[id], inrefs_.begin() + in_offsets_[id + 1], [](const inref &a, const inref &b) {
+						if(a.from != b.from) return a.from < b.from;
+						if(a.slot != b.slot) return a.slot < b.slot;
+						return a.index < b.index;
+					});
+				}
+			});
+		}
+
+		pmat::column<uint64_t> offsets_;
+		pmat::column<edge> edges_;
+		pmat::column<uint64_t> in_offsets_;
+		pmat::column<inref> inrefs_;
+		size_t dangling_ = 0;
+	};
+};
@@ -0,0 +1,727 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/io/ios_state.hpp>
+
+#include "pmat.h"
+#include "sv_table.h"
+#include "ref_graph.h"
+#include "reachability.h"
+#include "dominators.h"
+#include "paths.h"
+#include "parallel.h"
+#include "Log.h"
+
+namespace pmat {
+	class state_t {
+	public:
+		std::vector<pmat::type> types;
+		std::vector<pmat::context> contexts;
+
+		explicit state_t():file_offset_{0} { }
+
+		size_t add_file_offset(const size_t v) { return file_offset_ += v; }
+
+		size_t file_offset() const { DEBUG << "File offset = " << file_offset_; return file_offset_; }
+
+		/**
+		 * Lets SV strings point straight into the dump data instead of being copied,
+		 * we hold on to the backing storage for as long as we're around.
+		 */
+		void keep_backing(std::shared_ptr<const void> backing) { backing_ = std::move(backing); }
+		bool zero_copy() const { return static_cast<bool>(backing_); }
+		/**
+		 * Leaves SV bodies in the dump until something needs them: the heap pass only
+		 * records the common fields and where each body starts, and decoder is called to
+		 * fill in a body the first time ensure_body() asks for it. Reports that only look
+		 * at the common fields (dump_sizes) never decode most of them.
+		 */
+		void defer_bodies(std::function<void(pmat::sv_id_t)> decoder) { decoder_ = std::move(decoder); }
+		bool deferred() const { return static_cast<bool>(decoder_); }
+
+		/**
+		 * Decodes an SV's body if it's still waiting in the dump. Not thread-safe, and
+		 * references to other bodies of the same type may move.
+		 */
+		void ensure_body(const pmat::sv_id_t id) const {
+			if(decoder_ && svs_.pending(id)) decoder_(id);
+		}
+
+		/** Where everything hanging off the SVs is stored, see pmat::arena */
+		pmat::arena &arena() { return arena_; }
+		const pmat::arena &arena() const { return arena_; }
+
+		/** Provides something like the pmat-sizes output */
+		void dump_sizes() {
+			/* First, combine blessed+regular SVs */
+			auto types = std::map<std::string, size_row> { };
+			auto add = [&types](const std::string &name, const size_row &totals) {
+				auto &row = types[name];
+				row.count += totals.count;
+				row.size += totals.size;
+			};
+			for(size_t slot = 0; slot < totals_.stashes.size(); ++slot) {
+				const auto stash = totals_.stashes[slot];
+				ensure_body(stash);
+				const auto package = svs_.body<pmat::sv_stash>(stash).name;
+				for(size_t t = 0; t < blessed_type_slots; ++t) {
+					const auto &totals = totals_.row(slot, static_cast<sv_type_t>(t));
+					if(totals.count) add(blessed_type_name(static_cast<sv_type_t>(t), package), totals);
+				}
+			}
+			for(size_t t = 0; t < totals_.types.size(); ++t) {
+				if(totals_.types[t].count) add(sv_type_by_id(static_cast<sv_type_t>(t)), totals_.types[t]);
+			}
+			const auto count = print_size_table(types);
+			DEBUG << "Expecting " << (int)svs_.size() << " SVs, had " << count;
+		}
+
+		/**
+		 * Lists the SVs that can't be reached from any root, the stack or the immortals,
+		 * in the same form as dump_sizes(). With follow_weak false, SVs that are only
+		 * held by weak references count as unreachable too.
+		 */
+		void dump_unreachable(bool follow_weak, size_t threads) {
+			pmat::reach_set reached { graph_, root_svs(), follow_weak, threads };
+			DEBUG << "Reached " << reached.count() << " of " << svs_.size() << " SVs from " << roots_.size() << " roots and " << stack_.size() << " stack entries";
+			auto types = std::map<std::string, size_row> { };
+			for(pmat::sv_id_t id = 0; id < svs_.size(); ++id) {
+				if(reached.reached(id)) continue;
+				auto &row = types[sv_blessed_type(id)];
+				++row.count;
+				row.size += svs_.sv_size(id);
+			}
+			std::cout << "Unreachable SVs" << (follow_weak ? "" : " (ignoring weak references)") << ":" << std::endl;
+			print_size_table(types);
+		}
+
+		/**
+		 * Lists the magic in the dump by type: how many records there are, how many own their
+		 * object (see ref_graph::owns_magic_obj()), and the SVs and bytes those objects keep
+		 * alive through strong references. Memory reachable through more than one type of
+		 * magic counts towards each.
+		 */
+		void dump_magic(size_t threads) {
+			struct magic_row {
+				size_t records = 0, owned = 0;
+				std::vector<pmat::sv_id_t> objects;
+				size_row reached;
+			};
+			std::map<uint8_t, magic_row> types;
+			for(pmat::sv_id_t id = 0; id < svs_.size(); ++id) {
+				for(const auto &mg : svs_.magic(id)) {
+					auto &row = types[mg.type];
+					++row.records;
+					if(!pmat::ref_graph::owns_magic_obj(svs_, mg)) continue;
+					++row.owned;
+					const auto obj = sv_at(mg.obj);
+					if(obj != pmat::no_sv) row.objects.push_back(obj);
+				}
+			}
+			for(auto &it : types) {
+				auto &row = it.second;
+				pmat::reach_set reached { graph_, row.objects, false, threads };
+				for(pmat::sv_id_t id = 0; id < svs_.size(); ++id) {
+					if(!reached.reached(id)) continue;
+					++row.reached.count;
+					row.reached.size += svs_.sv_size(id);
+				}
+			}
+			std::vector<uint8_t> order;
+			for(const auto &it : types) order.push_back(it.first);
+			std::stable_sort(order.begin(), order.end(), [&types](uint8_t a, uint8_t b) { return types[a].reached.size > types[b].reached.size; });
+
+			boost::io::ios_all_saver ias { std::cout };
+			std::cout << "Magic (" << svs_.magic_count() << " records):" << std::endl;
+			std::cout << std::setiosflags(std::ios::left) << std::setw(16) << "Type" << " | " << std::setw(8) << "Records" << " | " << std::setw(8) << "Owned"
+				<< " | " << std::setw(12) << "SVs reached" << " | " << "Bytes reached" << std::endl;
+			for(auto type : order) {
+				const auto &row = types[type];
+				std::cout << std::setiosflags(std::ios::left) << std::setw(16) << pmat::magic_type_name(type) << " | " << std::setw(8) << row.records << " | " << std::setw(8) << row.owned
+					<< " | " << std::setw(12) << row.reached.count << " | " << row.reached.size << std::endl;
+			}
+		}
+
+		/**
+		 * Lists the n SVs keeping the most memory alive, then the retained size for each
+		 * class (blessed package, or SV type for unblessed SVs) - see pmat::dominator_tree.
+		 */
+		void dump_top_retainers(size_t n) {
+			pmat::dominator_tree dom { svs_, graph_, root_svs() };
+			DEBUG << "Dominator tree covers " << dom.reachable() << " of " << svs_.size() << " SVs in " << dom.memory_used() << " bytes";
+
+			std::vector<pmat::sv_id_t> ids;
+			ids.reserve(dom.reachable());
+			for(pmat::sv_id_t id = 0; id < svs_.size(); ++id)
+				if(dom.reachable(id)) ids.push_back(id);
+			auto by_retained = [&dom](pmat::sv_id_t a, pmat::sv_id_t b) { return dom.retained(a) > dom.retained(b); };
+			const auto top = std::min(n, ids.size());
+			std::partial_sort(ids.begin(), ids.begin() + top, ids.end(), by_retained);
+			{
+				boost::io::ios_all_saver ias { std::cout };
+				std::cout << "Top " << top << " retainers:" << std::endl;
+				std::cout << std::setiosflags(std::ios::left) << std::setw(24) << "Type" << " | " << std::setw(18) << "Address" << " | " << std::setw(10) << "Bytes" << " | " << "Retained" << std::endl;
+				for(size_t i = 0; i < top; ++i) {
+					const auto id = ids[i];
+					std::cout << std::setiosflags(std::ios::left) << std::setw(24) << sv_blessed_type(id) << " | " << std::setw(18) << pmat::to_string(svs_.address(id))
+						<< " | " << std::setw(10) << svs_.sv_size(id) << " | " << dom.retained(id) << std::endl;
+				}
+			}
+
+			/* Classes as (type, stash) pairs, named from their first SV */
+			std::map<std::pair<pmat::sv_type_t, pmat::ptr_t>, uint32_t> class_ids;
+			std::vector<uint32_t> classes(svs_.size(), 0);
+			std::vector<std::string> names;
+			for(pmat::sv_id_t id = 0; id < svs_.size(); ++id) {
+				auto it = class_ids.emplace(std::make_pair(svs_.type(id), svs_.blessed(id)), static_cast<uint32_t>(names.size()));
+				if(it.second) names.push_back(sv_blessed_type(id));
+				classes[id] = it.first->second;
+			}
+			const auto retained = dom.retained_by_class(classes, names.size());
+			std::vector<size_row> shallow(names.size(), size_row { 0, 0 });
+			for(auto id : ids) {
+				++shallow[classes[id]].count;
+				shallow[classes[id]].size += svs_.sv_size(id);
+			}
+			std::vector<uint32_t> order(names.size());
+			std::iota(order.begin(), order.end(), 0);
+			std::sort(order.begin(), order.end(), [&retained](uint32_t a, uint32_t b) { return retained[a] > retained[b]; });
+			{
+				boost::io::ios_all_saver ias { std::cout };
+				std::cout << "Retained by class:" << std::endl;
+				std::cout << std::setiosflags(std::ios::left) << std::setw(24) << "Type" << " | " << std::setw(10) << "SVs" << " | " << std::setw(10) << "Bytes" << " | " << "Retained" << std::endl;
+				for(size_t i = 0; i < std::min(n, order.size()); ++i) {
+					const auto c = order[i];
+					std::cout << std::setiosflags(std::ios::left) << std::setw(24) << names[c] << " | " << std::setw(10) << shallow[c].count
+						<< " | " << std::setw(10) << shallow[c].size << " | " << retained[c] << std::endl;
+				}
+			}
+		}
+
+		/**
+		 * Prints up to n of the shortest reference chains from a root to the SV at addr,
+		 * see pmat::shortest_paths.
+		 */
+		void dump_paths(const pmat::ptr_t addr, size_t n, bool follow_weak) const {
+			const auto target = sv_at(addr);
+			if(target == pmat::no_sv) {
+				ERROR << "No SV at " << pmat::to_string(addr);
+				return;
+			}
+			std::map<pmat::sv_id_t, std::vector<std::string>> names;
+			for(const auto &r : roots_) {
+				auto id = sv_at(r.second);
+				if(id != pmat::no_sv) names[id].push_back(pmat::root_description(r.first));
+			}
+			for(size_t i = 0; i < stack_.size(); ++i) {
+				auto id = sv_at(stack_[i]);
+				if(id != pmat::no_sv) names[id].push_back(u8"stack element [" + std::to_string(i) + "]");
+			}
+			std::vector<bool> is_root(svs_.size(), false);
+			for(const auto &it : names) is_root[it.first] = true;
+
+			auto describe_sv = [this](pmat::sv_id_t id) { return sv_blessed_type(id) + " at " + pmat::to_string(svs_.address(id)); };
+			const auto paths = pmat::shortest_paths(graph_, is_root, target, std::min<size_t>(n, 0xFFFF), follow_weak);
+			std::cout << describe_sv(target) << (paths.empty() ? " can't be reached from any root" : "") << std::endl;
+			for(size_t i = 0; i < paths.size(); ++i) {
+				const auto &path = paths[i];
+				std::cout << "Path " << (i + 1) << " (" << path.size() << " steps):" << std::endl;
+				for(const auto &step : path)
+					std::cout << "  <- " << slot_description(step.sv, step.slot, step.index) << " of " << describe_sv(step.sv)
+						<< (step.kind == pmat::edge_kind_t::weak ? " (weak)" : "") << std::endl;
+				const auto root = path.empty() ? target : path.back().sv;
+				for(const auto &name : names[root])
+					std::cout << "  which is " << name << std::endl;
+			}
+		}
+
+		/** A named root from the dump, e.g. "defstash", including the immortals */
+		void add_root(const std::string &name, const pmat::ptr_t ptr) { roots_.emplace_back(name, ptr); }
+		/** An SV on the perl value stack when the dump was taken */
+		void add_stack(const pmat::ptr_t ptr) { stack_.push_back(ptr); }
+		const std::vector<std::pair<std::string, pmat::ptr_t>> &roots() const { return roots_; }
+		const std::vector<pmat::ptr_t> &stack() const { return stack_; }
+
+		/** The SVs everything else hangs off: the roots, then the stack */
+		std::vector<pmat::sv_id_t> root_svs() const {
+			std::vector<pmat::sv_id_t> out;
+			out.reserve(roots_.size() + stack_.size());
+			for(const auto &r : roots_) {
+				auto id = sv_at(r.second);
+				if(id != pmat::no_sv) out.push_back(id);
+			}
+			for(auto ptr : stack_) {
+				auto id = sv_at(ptr);
+				if(id != pmat::no_sv) out.push_back(id);
+			}
+			return out;
+		}
+
+		size_t sv_count() const { return svs_.size(); }
+		pmat::sv_table &svs() { return svs_; }
+		const pmat::sv_table &svs() const { return svs_; }
+
+		void dump_sv(const pmat::sv_id_t id) const {
+			DEBUG << pmat::to_string(svs_.address(id)) << ", type = " << (int) svs_.type(id) << " (" << sv_type_by_id(svs_.type(id)) << ")";
+			switch(svs_.type(id)) {
+			case pmat::sv_type_t::SVtSCALAR:
+				{
+					DEBUG << "Scalar";
+				}
+				break;
+			case pmat::sv_type_t::SVtSTASH:
+				{
+					DEBUG << "Stash " << svs_.names().str(svs_.body<pmat::sv_stash>(id).name);
+				}
+				break;
+			default:
+				DEBUG << "Unknown SV";
+			}
+		}
+
+		/** Add an SV to our lists */
+		void add_sv(const pmat::sv &sv) {
+			DEBUG << "Adding SV " << pmat::to_string(sv);
+			assert(sv.type != sv_type_t::SVtEND);
+			assert(sv.type != sv_type_t::SVtUNKNOWN);
+			svs_.add(sv);
+		}
+		template<typename T>
+		void add_sv(const pmat::sv &sv, T &&body) {
+			DEBUG << "Adding SV " << pmat::to_string(sv);
+			assert(sv.type != sv_type_t::SVtEND);
+			assert(sv.type != sv_type_t::SVtUNKNOWN);
+			svs_.add(sv, std::forward<T>(body));
+		}
+
+		/** Only meaningful once finish() has sorted the SVs */
+		bool have_sv_at(const pmat::ptr_t ptr) const {
+			return svs_.find(ptr) != pmat::no_sv;
+	   	}
+
+		pmat::sv_id_t sv_at(const pmat::ptr_t ptr) const {
+			return svs_.find(ptr);
+	   	}
+
+		/** References between SVs, available once finish() has run */
+		const pmat::ref_graph &graph() const { return graph_; }
+
+		/** Something pointing at an SV, see referrers() */
+		struct referrer {
+			pmat::sv_id_t sv;
+			pmat::edge_kind_t kind;
+			std::string slot;
+		};
+
+		/**
+		 * Where a pointer sits in the SV holding it, see pmat::describe. Pad entries are
+		 * named after their lexical when the CV's padnames are in the dump.
+		 */
+		std::string slot_description(const pmat::sv_id_t from, const pmat::edge_slot_t slot, const uint32_t index) const {
+			if(slot == pmat::edge_slot_t::element) {
+				auto name = pad_name(from, index);
+				if(!name.empty()) return u8"the lexical " + name;
+			}
+			return pmat::describe(slot, index, svs_.keys());
+		}
+
+		/** The name of entry index in a pad, or empty if from isn't a pad or it has no name */
+		std::string pad_name(const pmat::sv_id_t pad, const uint32_t index) const {
+			for(const auto &in : graph_.in(pad)) {
+				if(in.slot != pmat::edge_slot_t::cv_pad) continue;
+				const auto &cv = svs_.body<pmat::sv_code>(in.from);
+				const auto names = sv_at(cv.padnames_);
+				if(names == pmat::no_sv) return { };
+				const auto type = svs_.type(names);
+				if(type != pmat::sv_type_t::SVtARRAY && type != pmat::sv_type_t::SVtPADNAMES) return { };
+				const auto &elements = svs_.body<pmat::sv_array>(names).elements;
+				if(index >= elements.size()) return { };
+				const auto name = sv_at(elements[index]);
+				if(name == pmat::no_sv || svs_.type(name) != pmat::sv_type_t::SVtSCALAR) return { };
+				return svs_.body<pmat::sv_scalar>(name).pv.to_string();
+			}
+			return { };
+		}
+
+		/** Every SV holding a pointer to the given one, along with where the pointer is */
+		std::vector<referrer> referrers(const pmat::sv_id_t id) const {
+			std::vector<referrer> out;
+			const auto in = graph_.in(id);
+			out.reserve(in.size());
+			for(const auto &r : in)
+				out.push_back(referrer { r.from, r.kind, slot_description(r.from, r.slot, r.index) });
+			return out;
+		}
+
+		/**
+		 * Called once all SVs have been read: sorts the SV table, applies the synthetic
+		 * types, does the per-type and per-class accounting, then builds the reference
+		 * graph - all but the sort on the given number of threads. Callers that only look
+		 * at the SVs themselves (diffs, summaries) can skip the graph, which saves a good
+		 * part of the memory for a load.
+		 */
+		void finish(size_t threads = 1, bool with_graph = true) {
+			svs_.seal();
+			DEBUG << "SV table holds " << svs_.size() << " SVs in " << svs_.memory_used() << " bytes, arena has " << arena_.blocks() << " blocks with " << arena_.bytes() << " bytes";
+			DEBUG << "Hashes hold " << svs_.hash_elements() << " elements (" << sizeof(pmat::string_id_t) + sizeof(pmat::ptr_t) << " bytes each) with " << svs_.keys().size() << " distinct keys, key index is " << svs_.keys().memory_used() << " bytes";
+
+			/*
+			 * Upgrade the arrays each CV uses as its padlist, padnames and pads to the synthetic
+			 * types. Working out which SVs those are is a lookup or three per CV, and there can be
+			 * hundreds of thousands of CVs, so that runs in chunks on the pool. Nothing is retyped
+			 * until every chunk is done, then the upgrades are applied in SV order - a byte per
+			 * SV in the type column, so cheap enough to do on one thread, and it gives the same
+			 * result as a single pass would where CVs share padnames.
+			 */
+			if(deferred()) {
+				/* The body decoder isn't safe to run from more than one thread */
+				for(pmat::sv_id_t id = 0; id < svs_.size(); ++id)
+					if(svs_.type(id) == pmat::sv_type_t::SVtCODE) ensure_body(id);
+			}
+			std::vector<code_fixups> fixups((svs_.size() + fixup_grain - 1) / fixup_grain);
+			pmat::parallel_for(threads, svs_.size(), fixup_grain, [this, &fixups](size_t begin, size_t end) {
+				find_code_fixups(begin, end, fixups[begin / fixup_grain]);
+			});
+			for(const auto &chunk : fixups)
+				apply_code_fixups(chunk);
+			fixups.clear();
+
+			tally(threads);
+			if(!with_graph) return;
+			if(deferred()) {
+				for(pmat::sv_id_t id = 0; id < svs_.size(); ++id)
+					ensure_body(id);
+			}
+			graph_.build(svs_, threads);
+			DEBUG << "Reference graph has " << graph_.edge_count() << " edges (" << graph_.count(pmat::edge_kind_t::weak) << " weak) for " << graph_.sv_count() << " SVs in " << graph_.memory_used() << " bytes, " << graph_.dangling() << " pointers to unknown addresses";
+		}
+
+		/** Everything finish() builds, for pmat::index_file - see sv_table::columns() */
+		template<typename F>
+		void columns(F &&f) {
+			svs_.columns(f);
+			graph_.columns(f);
+		}
+
+		/** Takes the place of finish() once columns() has been filled in from an index */
+		void restored() {
+			svs_.keys().reindex();
+			svs_.names().reindex();
+			tally();
+			DEBUG << "Restored " << svs_.size() << " SVs and " << graph_.edge_count() << " edges";
+		}
+
+		std::string sv_blessed_type(const pmat::sv_id_t id) const {
+			auto base = sv_type_by_id(svs_.type(id));
+			const auto blessed = svs_.blessed(id);
+			if(blessed == 0) return base;
+			DEBUG << "We have " << (void *)blessed << " as a blessed pointer";
+			auto bs = sv_at(blessed);
+			if(bs == pmat::no_sv) {
+				ERROR << "Could not find blessed stash " << (void *)blessed << " for " << (void *)svs_.address(id);
+				return base;
+			}
+			ensure_body(bs);
+			if(svs_.type(bs) != sv_type_t::SVtSTASH) {
+				ERROR << "We have something that has been blessed into something that isn't a stash: " << sv_type_by_id(svs_.type(bs));
+				return base;
+			}
+			return blessed_type_name(svs_.type(id), svs_.body<pmat::sv_stash>(bs).name);
+		}
+
+		/** How sv_blessed_type() names an SV of the given type blessed into the named package */
+		std::string blessed_type_name(const sv_type_t type, const pmat::string_id_t package) const {
+			return sv_type_by_id(type) + "(" + svs_.names().str(package).to_string() + ")";
+		}
+
+		std::string sv_type_by_id(const sv_type_t &id) const {
+			switch(id) {
+			case sv_type_t::SVtEND: return u8"end of list";
+			case sv_type_t::SVtGLOB: return u8"GLOB";
+			case sv_type_t::SVtSCALAR: return u8"SCALAR";
+			case sv_type_t::SVtREF: return u8"REF";
+			case sv_type_t::SVtARRAY: return u8"ARRAY";
+			case sv_type_t::SVtHASH: return u8"HASH";
+			case sv_type_t::SVtSTASH: return u8"STASH";
+			case sv_type_t::SVtCODE: return u8"CODE";
+			case sv_type_t::SVtIO: return u8"IO";
+			case sv_type_t::SVtLVALUE: return u8"LVALUE";
+			case sv_type_t::SVtREGEXP: return u8"REGEXP";
+			case sv_type_t::SVtFORMAT: return u8"FORMAT";
+			case sv_type_t::SVtINVLIST: return u8"INVLIST";
+			case sv_type_t::SVtPADNAMES: return u8"PADNAMES";
+			case sv_type_t::SVtPADLIST: return u8"PADLIST";
+			case sv_type_t::SVtPAD: return u8"PAD";
+			case sv_type_t::SVtMAGIC: return u8"MAGIC";
+			case sv_type_t::SVtUNKNOWN: return u8"UNKNOWN";
+			default: return "unknown sv type";
+			}
+		}
+	private:
+		/** The arrays one CV uses, found by find_code_fixups() */
+		struct code_fixup {
+			pmat::sv_id_t padlist = pmat::no_sv;
+			pmat::sv_id_t padnames = pmat::no_sv;
+			/* Range in code_fixups::pads */
+			size_t pads_begin = 0, pads_end = 0;
+		};
+		/** Upgrades for the CVs in one chunk of the SV table, in SV order */
+		struct code_fixups {
+			std::vector<code_fixup> code;
+			std::vector<pmat::sv_id_t> pads;
+		};
+		static constexpr size_t fixup_grain = 1 << 16;
+
+		/** Looks up the padlist, padnames and pads for each CV in [begin, end), only reading the table */
+		void find_code_fixups(size_t begin, size_t end, code_fixups &out) const {
+			for(pmat::sv_id_t id = begin; id < end; ++id) {
+				if(svs_.type(id) != pmat::sv_type_t::SVtCODE) continue;
+				const auto &cv = svs_.body<pmat::sv_code>(id);
+				DEBUG << "Have CODE SV at " << (void *)svs_.address(id) << " - " << svs_.names().str(cv.file) << ":" << (int)cv.line;
+				if(cv.padlist == 0) {
+					INFO << "No PADLIST, skipping";
+					continue;
+				}
+
+				code_fixup fix;
+				fix.padlist = sv_at(cv.padlist);
+				if(fix.padlist == pmat::no_sv) {
+					ERROR << "Padlist points to CV that does not exist - " << (void *)cv.padlist;
+					continue;
+				}
+				fix.pads_begin = fix.pads_end = out.pads.size();
+				if(cv.padnames_ == 0) {
+					DEBUG << "No padnames for this CV, skipping";
+					out.code.push_back(fix);
+					continue;
+				}
+
+				fix.padnames = sv_at(cv.padnames_);
+				if(fix.padnames == pmat::no_sv) {
+					ERROR << "No SV for padnames at " << (void *)cv.padnames_;
+					out.code.push_back(fix);
+					continue;
+				}
+				DEBUG << "Total of " << cv.pads_.size() << " items to convert to pads";
+				for(size_t idx = 1; idx < cv.pads_.size(); ++idx) {
+					const auto ptr = cv.pads_[idx];
+					if(ptr == 0) continue;
+					const auto pad = sv_at(ptr);
+					if(pad == pmat::no_sv) {
+						ERROR << "No SV for pad at " << (void *)ptr;
+						continue;
+					}
+					DEBUG << "Item " << idx << " in the pad is " << sv_type_by_id(svs_.type(pad)) << " with addr " << (void *)ptr;
+					out.pads.push_back(pad);
+				}
+				fix.pads_end = out.pads.size();
+				out.code.push_back(fix);
+			}
+		}
+
+		/** Retypes what find_code_fixups() found */
+		void apply_code_fixups(const code_fixups &chunk) {
+			for(const auto &fix : chunk.code) {
+				DEBUG << "Upgrading padlist at address [" << (void *)svs_.address(fix.padlist) << "]";
+				assert(svs_.type(fix.padlist) == sv_type_t::SVtARRAY);
+				svs_.retype(fix.padlist, sv_type_t::SVtPADLIST);
+				if(fix.padnames == pmat::no_sv) continue;
+				/* Already upgraded through another CV sharing them, or never an array */
+				if(svs_.type(fix.padnames) != sv_type_t::SVtARRAY) {
+					ERROR << "padnames at address [" << (void *)svs_.address(fix.padnames) << "] should be an array, but aren't";
+					continue;
+				}
+				DEBUG << "Upgrading padnames at address [" << (void *)svs_.address(fix.padnames) << "]";
+				svs_.retype(fix.padnames, sv_type_t::SVtPADNAMES);
+				for(size_t i = fix.pads_begin; i < fix.pads_end; ++i) {
+					assert(svs_.type(chunk.pads[i]) == sv_type_t::SVtARRAY);
+					svs_.retype(chunk.pads[i], sv_type_t::SVtPAD);
+				}
+			}
+		}
+
+		struct size_row {
+			size_t count = 0, size = 0;
+		};
+		/* Every real and synthetic type, which is all a blessed SV can be */
+		static constexpr size_t blessed_type_slots = static_cast<size_t>(sv_type_t::SVtPAD) + 1;
+
+		/** Counters for tally(): unblessed SVs by type, blessed ones by (stash, type) */
+		struct size_totals {
+			std::array<size_row, 256> types;
+			/* The stashes SVs are blessed into, and blessed_type_slots rows for each */
+			std::vector<pmat::sv_id_t> stashes;
+			std::vector<size_row> blessed;
+			std::unordered_map<pmat::sv_id_t, size_t> slots;
+
+			/** Where a stash's rows start, adding them if this is the first we've seen of it */
+			size_t slot(pmat::sv_id_t stash) {
+				const auto it = slots.emplace(stash, stashes.size());
+				if(it.second) {
+					stashes.push_back(stash);
+					blessed.resize(blessed.size() + blessed_type_slots);
+				}
+				return it.first->second;
+			}
+			size_row &row(size_t slot, pmat::sv_type_t type) { return blessed[slot * blessed_type_slots + static_cast<size_t>(type)]; }
+			const size_row &row(size_t slot, pmat::sv_type_t type) const { return blessed[slot * blessed_type_slots + static_cast<size_t>(type)]; }
+
+			void merge(const size_totals &other) {
+				for(size_t t = 0; t < types.size(); ++t) {
+					types[t].count += other.types[t].count;
+					types[t].size += other.types[t].size;
+				}
+				for(size_t s = 0; s < other.stashes.size(); ++s) {
+					const auto into = slot(other.stashes[s]);
+					for(size_t t = 0; t < blessed_type_slots; ++t) {
+						auto &r = row(into, static_cast<pmat::sv_type_t>(t));
+						const auto &o = other.row(s, static_cast<pmat::sv_type_t>(t));
+						r.count += o.count;
+						r.size += o.size;
+					}
+				}
+			}
+		};
+
+		/**
+		 * Per-type and per-class accounting, once types are final and every stash can be found.
+		 * Chunks of the type, size and blessed columns are counted into flat counters on the
+		 * pool, which are merged once they're all done. Package names are only looked at when
+		 * dump_sizes() prints them.
+		 */
+		void tally(size_t threads = 1) {
+			static constexpr size_t grain = 1 << 18;
+			std::vector<size_totals> partial((svs_.size() + grain - 1) / grain);
+			pmat::parallel_for(threads, svs_.size(), grain, [this, &partial](size_t begin, size_t end) {
+				count_sizes(begin, end, partial[begin / grain]);
+			});
+			totals_ = size_totals { };
+			for(const auto &p : partial)
+				totals_.merge(p);
+			DEBUG << "Tallied " << svs_.size() << " SVs, " << totals_.stashes.size() << " classes with blessed SVs";
+		}
+
+		void count_sizes(size_t begin, size_t end, size_totals &totals) const {
+			/* Objects of a class tend to come together, so remember the last stash we looked up */
+			pmat::ptr_t last_blessed = 0;
+			pmat::sv_id_t stash = pmat::no_sv;
+			size_t slot = 0;
+			for(pmat::sv_id_t id = begin; id < end; ++id) {
+				const auto type = svs_.type(id);
+				const auto blessed = svs_.blessed(id);
+				if(blessed != 0 && blessed != last_blessed) {
+					last_blessed = blessed;
+					stash = sv_at(blessed);
+					if(stash != pmat::no_sv && svs_.type(stash) == sv_type_t::SVtSTASH)
+						slot = totals.slot(stash);
+				}
+				auto *row = &totals.types[static_cast<size_t>(type)];
+				if(blessed != 0) {
+					if(stash == pmat::no_sv) {
+						ERROR << "Could not find blessed stash " << (void *)blessed << " for " << (void *)svs_.address(id);
+						continue;
+					}
+					if(svs_.type(stash) != sv_type_t::SVtSTASH) {
+						ERROR << "We have something that has been blessed into something that isn't a stash: " << sv_type_by_id(svs_.type(stash));
+					} else if(static_cast<size_t>(type) < blessed_type_slots) {
+						row = &totals.row(slot, type);
+					}
+				}
+				++row->count;
+				row->size += svs_.sv_size(id);
+			}
+		}
+
+		/** Prints rows as a Type | SVs | Bytes table, largest first with a total, returns the SV count */
+		static size_t print_size_table(const std::map<std::string, size_row> &types) {
+			using thing_type_t = std::pair<std::string, size_row>;
+			auto myvec = std::vector<thing_type_t> { };
+			for(auto it : types) {
+				myvec.push_back(it);
+			}
+			size_t count = 0, total = 0;
+			for(auto &it : myvec) {
+				count += it.second.count;
+				total += it.second.size;
+			}
+
+			/* Sort by size */
+			std::sort(
+				myvec.begin(),
+				myvec.end(),
+				[] (const thing_type_t &left, const thing_type_t &right) -> bool {
+					return left.second.size > right.second.size;
+				}
+			);
+			myvec.emplace_back(
+				thing_type_t {
+					"Total",
+					size_row {
+						count,
+						total
+					}
+				}
+			);
+
+			/* Now find the column widths */
+			size_t width[3] { 0, 0, 0 };
+			auto nmax = [](const size_t x, const size_t y) -> size_t { return x > y ? x : y; };
+			for(const auto &it : myvec) {
+				DEBUG << "Type " << it.first << " length is " << std::to_string(it.first.size());
+				width[0] = nmax(width[0], it.first.size());
+				width[1] = nmax(width[1], std::to_string(it.second.count).size());
+				width[2] = nmax(width[2], std::to_string(it.second.size).size());
+			}
+			DEBUG << "width 0 " << width[0];
+			DEBUG << "width 1 " << width[1];
+			DEBUG << "width 2 " << width[2];
+			{
+				boost::io::ios_all_saver ias { std::cout };
+				std::cout << std::setw(width[0]) << std::setiosflags(std::ios::left) << std::setfill(' ') << "Type";
+				std::cout << std::setw(0) << " | ";
+				std::cout << std::setw(width[1]) << std::setiosflags(std::ios::left) << std::setfill(' ') << "SVs";
+				std::cout << std::setw(0) << " | ";
+				std::cout << std::setw(width[2]) << std::setiosflags(std::ios::left) << std::setfill(' ') << "Bytes";
+				std::cout << std::endl;
+			}
+
+			for(auto &it : myvec) {
+				{
+					boost::io::ios_all_saver ias { std::cout };
+					std::cout << std::setw(width[0]) << std::setiosflags(std::ios::left) << std::setfill(' ') << it.first;
+				}
+				{
+					boost::io::ios_all_saver ias { std::cout };
+					std::cout << std::setw(0) << " | ";
+					std::cout << std::setw(width[1]) << std::setfill(' ') << it.second.count;
+					std::cout << std::setw(0) << " | ";
+					std::cout << std::setw(width[2]) << std::setfill(' ') << it.second.size;
+					std::cout << std::endl;
+				}
+			}
+			return count;
+		}
+
+		std::shared_ptr<const void> backing_;
+		std::function<void(pmat::sv_id_t)> decoder_;
+		pmat::arena arena_;
+		pmat::sv_table svs_;
+		pmat::ref_graph graph_;
+		std::vector<std::pair<std::string, pmat::ptr_t>> roots_;
+		std::vector<pmat::ptr_t> stack_;
+		size_totals totals_;
+		size_t file_offset_;
+	};
+};
+
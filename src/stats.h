@@ -0,0 +1,152 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <ctime>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <boost/io/ios_state.hpp>
+
+#include "state.h"
+
+namespace pmat {
+	/**
+	 * Where the time went loading a dump, for --stats: wall and CPU time per phase,
+	 * throughput overall and per SV type, and what the loaded structures take in memory.
+	 *
+	 * It's cheap enough to leave on. Phases are timed with two clock reads at each end,
+	 * and the per-type counts come from one pass over the type column once the load is
+	 * finished, rather than counters bumped per SV on the decode path.
+	 */
+	class load_stats {
+	public:
+		struct phase {
+			std::string name;
+			double wall, cpu;
+		};
+
+		load_stats():bytes_{0},svs_{0},pending_{0},sv_table_bytes_{0},key_index_bytes_{0},arena_bytes_{0},graph_bytes_{0} { counts_.fill(0); }
+
+		/** Runs f, recording it as the named phase. CPU time is for the whole process, so it covers worker threads too */
+		template<typename F>
+		void time(const char *name, F &&f) {
+			const auto wall = std::chrono::steady_clock::now();
+			const auto cpu = std::clock();
+			f();
+			const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - wall;
+			phases_.push_back(phase { name, elapsed.count(), static_cast<double>(std::clock() - cpu) / CLOCKS_PER_SEC });
+		}
+
+		/** Takes the SV counts once finish() has dropped duplicates and applied the synthetic types, so they match the sizes report */
+		void count_svs(const pmat::state_t &state) {
+			const auto &svs = state.svs();
+			svs_ = svs.size();
+			pending_ = 0;
+			for(pmat::sv_id_t id = 0; id < svs.size(); ++id) {
+				++counts_[static_cast<uint8_t>(svs.type(id))];
+				if(svs.pending(id)) ++pending_;
+			}
+			names_.fill(std::string { });
+			for(size_t t = 0; t < counts_.size(); ++t)
+				if(counts_[t]) names_[t] = state.sv_type_by_id(static_cast<pmat::sv_type_t>(t));
+		}
+
+		/** Notes how much memory the loaded state's structures take, see pmat::state_t::finish */
+		void measure(const pmat::state_t &state) {
+			sv_table_bytes_ = state.svs().memory_used();
+			key_index_bytes_ = state.svs().keys().memory_used();
+			arena_bytes_ = state.arena().bytes();
+			graph_bytes_ = state.graph().memory_used();
+		}
+
+		void set_bytes(size_t bytes) { bytes_ = bytes; }
+
+		const std::vector<phase> &phases() const { return phases_; }
+
+		/** Largest resident set we've had so far, in bytes */
+		static size_t peak_rss() {
+			struct rusage usage;
+			if(::getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+			return static_cast<size_t>(usage.ru_maxrss) * 1024;
+		}
+
+		void report(std::ostream &out) const {
+			boost::io::ios_all_saver ias { out };
+			out << "Load statistics:" << std::endl;
+			out << std::setiosflags(std::ios::left) << std::setw(10) << "Phase" << " | " << std::setw(10) << "Wall (s)" << " | " << "CPU (s)" << std::endl;
+			out << std::fixed << std::setprecision(4);
+			for(const auto &p : phases_)
+				out << std::setw(10) << p.name << " | " << std::setw(10) << p.wall << " | " << p.cpu << std::endl;
+			out << std::setw(10) << "Total" << " | " << std::setw(10) << total_wall() << " | " << total_cpu() << std::endl;
+			out << std::setprecision(1);
+			out << "Bytes: " << bytes_ << " (" << per_second(bytes_, total_wall()) / 1e6 << " MB/s)" << std::endl;
+			out << "SVs:   " << svs_ << " (" << per_second(svs_, heap_wall()) << " SVs/s in the heap phase)" << std::endl;
+			out << std::setw(10) << "Type" << " | " << std::setw(10) << "SVs" << " | " << "SVs/s" << std::endl;
+			for(size_t t = 0; t < counts_.size(); ++t) {
+				if(!counts_[t]) continue;
+				out << std::setw(10) << names_[t] << " | " << std::setw(10) << counts_[t] << " | " << per_second(counts_[t], heap_wall()) << std::endl;
+			}
+			out << "Bodies left in the dump: " << pending_ << std::endl;
+			out << "SV table: " << sv_table_bytes_ / 1024 << " KB (key index " << key_index_bytes_ / 1024 << " KB of that)" << std::endl;
+			out << "Arena: " << arena_bytes_ / 1024 << " KB" << std::endl;
+			out << "Reference graph: " << graph_bytes_ / 1024 << " KB" << std::endl;
+			out << "Peak RSS: " << peak_rss() / 1024 << " KB" << std::endl;
+		}
+
+		/** The same as report(), as a single JSON object */
+		void report_json(std::ostream &out) const {
+			boost::io::ios_all_saver ias { out };
+			out << std::fixed << std::setprecision(6);
+			out << "{\"phases\":[";
+			for(size_t i = 0; i < phases_.size(); ++i) {
+				const auto &p = phases_[i];
+				out << (i ? "," : "") << "{\"name\":\"" << p.name << "\",\"wall_seconds\":" << p.wall << ",\"cpu_seconds\":" << p.cpu << "}";
+			}
+			out << "],\"wall_seconds\":" << total_wall() << ",\"cpu_seconds\":" << total_cpu();
+			out << ",\"bytes\":" << bytes_ << ",\"bytes_per_second\":" << per_second(bytes_, total_wall());
+			out << ",\"svs\":" << svs_ << ",\"svs_per_second\":" << per_second(svs_, heap_wall());
+			out << ",\"types\":{";
+			bool first = true;
+			for(size_t t = 0; t < counts_.size(); ++t) {
+				if(!counts_[t]) continue;
+				out << (first ? "" : ",") << "\"" << names_[t] << "\":{\"svs\":" << counts_[t] << ",\"svs_per_second\":" << per_second(counts_[t], heap_wall()) << "}";
+				first = false;
+			}
+			out << "},\"pending_bodies\":" << pending_;
+			out << ",\"sv_table_bytes\":" << sv_table_bytes_ << ",\"key_index_bytes\":" << key_index_bytes_;
+			out << ",\"arena_bytes\":" << arena_bytes_ << ",\"graph_bytes\":" << graph_bytes_;
+			out << ",\"peak_rss_bytes\":" << peak_rss() << "}" << std::endl;
+		}
+
+	private:
+		static double per_second(size_t n, double seconds) { return seconds > 0 ? n / seconds : 0; }
+		double total_wall() const {
+			double t = 0;
+			for(const auto &p : phases_) t += p.wall;
+			return t;
+		}
+		double total_cpu() const {
+			double t = 0;
+			for(const auto &p : phases_) t += p.cpu;
+			return t;
+		}
+		double heap_wall() const {
+			for(const auto &p : phases_)
+				if(p.name == "heap") return p.wall;
+			return 0;
+		}
+
+		std::vector<phase> phases_;
+		size_t bytes_;
+		size_t svs_;
+		/** SVs whose bodies were left to decode on demand, see pmat::state_t::defer_bodies */
+		size_t pending_;
+		/** Footprints from measure(), the key index being part of the SV table */
+		size_t sv_table_bytes_, key_index_bytes_, arena_bytes_, graph_bytes_;
+		std::array<size_t, 256> counts_;
+		std::array<std::string, 256> names_;
+	};
+};
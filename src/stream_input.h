@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio/buffer.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/bzip2.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+
+#include "Log.h"
+
+namespace pmat {
+	/**
+	 * A dump arriving as a stream - stdin, a pipe, or a gzip/bzip2 compressed file - rather
+	 * than something we can map.
+	 *
+	 * Reading and decompressing happen on a thread of their own, which hands over the data
+	 * in fixed-size chunks through a short queue. That keeps the decompressor busy while
+	 * the heap is being decoded, and bounds how far ahead of the parser it can get.
+	 */
+	class stream_input {
+	public:
+		static constexpr size_t chunk_size = 1024 * 1024;
+		static constexpr size_t queue_depth = 8;
+
+		/** Reads path, or stdin for "-", decompressing if it starts with a gzip or bzip2 magic */
+		explicit stream_input(const std::string &path):source_{&std::cin},done_{false},stop_{false} {
+			if(path != "-") {
+				file_.open(path, std::ios::binary);
+				if(!file_) throw std::runtime_error("Could not open " + path);
+				source_ = &file_;
+			}
+			const auto magic = source_->peek();
+			if(magic == 0x1f) {
+				compression_ = "gzip";
+				in_.push(boost::iostreams::gzip_decompressor());
+			} else if(magic == 'B') {
+				compression_ = "bzip2";
+				in_.push(boost::iostreams::bzip2_decompressor());
+			}
+			in_.push(*source_);
+			/* Have decompression errors thrown rather than quietly ending the stream */
+			in_.exceptions(std::ios::badbit);
+			DEBUG << "Streaming " << path << (compression_.empty() ? "" : " through " + compression_);
+			producer_ = std::thread([this] { produce(); });
+		}
+		~stream_input() {
+			{
+				std::lock_guard<std::mutex> lock { mutex_ };
+				stop_ = true;
+			}
+			cv_.notify_all();
+			producer_.join();
+		}
+		stream_input(const stream_input &) = delete;
+		stream_input &operator=(const stream_input &) = delete;
+
+		/** True if path looks like a gzip or bzip2 file, which needs to go through here */
+		static bool compressed(const std::string &path) {
+			std::ifstream f { path, std::ios::binary };
+			const auto magic = f.peek();
+			return magic == 0x1f || magic == 'B';
+		}
+
+		/** The decompressor in use, if any */
+		const std::string &compression() const { return compression_; }
+
+		/** Waits for the next chunk and appends it to out; false once the input is used up */
+		bool read(std::vector<char> &out) {
+			std::unique_lock<std::mutex> lock { mutex_ };
+			cv_.wait(lock, [this] { return !queue_.empty() || done_; });
+			if(queue_.empty()) {
+				if(failed_) std::rethrow_exception(failed_);
+				return false;
+			}
+			auto chunk = std::move(queue_.front());
+			queue_.pop_front();
+			lock.unlock();
+			cv_.notify_all();
+			out.insert(out.end(), chunk.begin(), chunk.end());
+			return true;
+		}
+
+	private:
+		void produce() {
+			try {
+				for(;;) {
+					std::vector<char> chunk(chunk_size);
+					in_.read(chunk.data(), chunk.size());
+					const auto got = static_cast<size_t>(in_.gcount());
+					if(!got) break;
+					chunk.resize(got);
+					std::unique_lock<std::mutex> lock { mutex_ };
+					cv_.wait(lock, [this] { return queue_.size() < queue_depth || stop_; });
+					if(stop_) break;
+					queue_.push_back(std::move(chunk));
+					lock.unlock();
+					cv_.notify_all();
+				}
+			} catch(...) {
+				std::lock_guard<std::mutex> lock { mutex_ };
+				failed_ = std::current_exception();
+			}
+			{
+				std::lock_guard<std::mutex> lock { mutex_ };
+				done_ = true;
+			}
+			cv_.notify_all();
+		}
+
+		std::ifstream file_;
+		std::istream *source_;
+		boost::iostreams::filtering_istream in_;
+		std::string compression_;
+
+		std::mutex mutex_;
+		std::condition_variable cv_;
+		std::deque<std::vector<char>> queue_;
+		bool done_;
+		bool stop_;
+		std::exception_ptr failed_;
+		std::thread producer_;
+	};
+
+	/**
+	 * The part of a stream_input that hasn't been parsed yet, kept as one contiguous buffer
+	 * so the usual reader can work over it. Consumed bytes are dropped each time more is
+	 * pulled in, so it only grows past a few chunks for a single very large record.
+	 */
+	class stream_window {
+	public:
+		explicit stream_window(pmat::stream_input &in):in_(in),begin_{0},total_{0} { }
+
+		boost::asio::const_buffer data() const { return boost::asio::buffer(buf_.data() + begin_, buf_.size() - begin_); }
+		void consume(size_t n) { begin_ += n; }
+		/** Bytes taken in from the stream so far, after decompression */
+		size_t total() const { return total_ + buf_.size(); }
+
+		/**
+		 * Pulls in at least want more bytes, or at least as much again as is waiting, so a
+		 * record that keeps coming up short is only rescanned a logarithmic number of times.
+		 * False if nothing more arrived.
+		 */
+		bool more(size_t want = pmat::stream_input::chunk_size) {
+			buf_.erase(buf_.begin(), buf_.begin() + begin_);
+			total_ += begin_;
+			begin_ = 0;
+			const size_t had = buf_.size();
+			const size_t target = had + std::max(want, had);
+			while(buf_.size() < target)
+				if(!in_.read(buf_)) break;
+			return buf_.size() > had;
+		}
+
+	private:
+		pmat::stream_input &in_;
+		std::vector<char> buf_;
+		size_t begin_;
+		size_t total_;
+	};
+};
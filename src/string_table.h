@@ -0,0 +1,72 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include <boost/functional/hash.hpp>
+
+#include "pmat.h"
+#include "column.h"
+
+namespace pmat {
+	/**
+	 * Strings from the dump, each distinct one stored once and known by a small id.
+	 *
+	 * Used for hash keys - most hashes share their keys with plenty of others (object fields,
+	 * stash entries), so the hash bodies just hold a string_id_t per element - and for package,
+	 * glob and file names, which get compared and grouped on far more than they get printed.
+	 * The strings themselves aren't copied - they're expected to live in the dump mapping or
+	 * the state's arena.
+	 */
+	class string_table {
+	public:
+		/** The id for a string we've already seen, or no_string */
+		string_id_t find(pmat::str_t key) const {
+			auto it = ids_.find(key);
+			return it == ids_.cend() ? no_string : it->second;
+		}
+
+		/** Adds a string we don't have yet, it must outlive the table */
+		string_id_t add(pmat::str_t key) {
+			const auto id = static_cast<string_id_t>(strings_.size());
+			strings_.push_back(key);
+			ids_.emplace(key, id);
+			return id;
+		}
+
+		string_id_t intern(pmat::str_t key) {
+			const auto id = find(key);
+			return id == no_string ? add(key) : id;
+		}
+
+		/** The strings, for pmat::index_file. Call reindex() once they've been filled in. */
+		template<typename F>
+		void columns(F &&f) { f(strings_); }
+
+		/** Rebuilds the lookup side from the strings */
+		void reindex() {
+			ids_.clear();
+			ids_.reserve(strings_.size());
+			for(string_id_t id = 0; id < strings_.size(); ++id)
+				ids_.emplace(strings_[id], id);
+		}
+
+		/** The string for an id, empty for no_string */
+		pmat::str_t str(string_id_t id) const { return id == no_string ? pmat::str_t{} : strings_[id]; }
+		size_t size() const { return strings_.size(); }
+
+		/** Approximate bytes used by the index, not counting the strings */
+		size_t memory_used() const {
+			return strings_.capacity() * sizeof(pmat::str_t)
+				+ ids_.bucket_count() * sizeof(void *)
+				+ ids_.size() * (sizeof(std::pair<const pmat::str_t, string_id_t>) + 2 * sizeof(void *));
+		}
+
+	private:
+		struct hasher {
+			size_t operator()(pmat::str_t s) const { return boost::hash_range(s.begin(), s.end()); }
+		};
+
+		pmat::column<pmat::str_t> strings_;
+		std::unordered_map<pmat::str_t, string_id_t, hasher> ids_;
+	};
+};
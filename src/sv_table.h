@@ -0,0 +1,449 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <numeric>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "pmat.h"
+#include "column.h"
+#include "string_table.h"
+#include "Log.h"
+
+namespace pmat {
+	/** Index of an SV in the table - dense, and in address order once the table is sealed */
+	using sv_id_t = uint32_t;
+	static constexpr sv_id_t no_sv = ~sv_id_t{0};
+
+	/**
+	 * Every SV in the dump, stored as columns.
+	 *
+	 * The common fields (address, type, refcnt, size, blessed) get one array each, and
+	 * the type-specific part lives in a per-type side table, with body_ giving the index
+	 * into it. SVs are appended in file order while parsing; seal() then sorts everything
+	 * by address so lookups can binary search, after which an sv_id_t is just the position
+	 * in the address array.
+	 *
+	 * Magic records come separately in the dump, so they're held back until seal(), which
+	 * groups them by SV - see magic().
+	 *
+	 * Columns and side tables are pmat::column, so a sealed table can also be used
+	 * straight out of an index file - see columns().
+	 */
+	class sv_table {
+	public:
+		sv_table():sealed_{false} { }
+		sv_table(sv_table &&) = default;
+		sv_table &operator=(sv_table &&) = default;
+
+		/** Adds an SV that has nothing beyond the common fields */
+		void add(const pmat::sv &v) {
+			push(v, no_sv);
+		}
+
+		/** Adds an SV along with its type-specific body */
+		template<typename T>
+		void add(const pmat::sv &v, T &&body) {
+			using body_t = typename std::decay<T>::type;
+			assert(body_class(v.type) == body_index<body_t>::value);
+			auto &bodies = std::get<body_index<body_t>::value>(bodies_);
+			push(v, static_cast<sv_id_t>(bodies.size()));
+			bodies.emplace_back(std::forward<T>(body));
+		}
+
+		/** Adds a magic record, for whichever SV is at m.addr once the table is sealed */
+		void add_magic(const pmat::magic_t &m) {
+			assert(!sealed_);
+			pending_magic_.push_back(m);
+		}
+
+		/**
+		 * Adds an SV whose body hasn't been decoded yet, just where it starts in the dump.
+		 * See set_body(), and state_t::defer_bodies() for how it gets decoded later.
+		 */
+		void add_pending(const pmat::sv &v, uint64_t offset) {
+			push(v, no_sv);
+			/* Only sized once there's something pending, so a full load doesn't pay for it */
+			offset_.resize(address_.size() - 1);
+			offset_.push_back(offset);
+		}
+
+		/** Whether an SV still has a body waiting to be decoded */
+		bool pending(sv_id_t id) const {
+			return id < offset_.size() && offset_[id] != 0 && body_[id] == no_sv;
+		}
+		/** Where a pending SV's body starts in the dump */
+		uint64_t body_offset(sv_id_t id) const { return offset_[id]; }
+
+		/** Fills in the body for a pending SV */
+		template<typename T>
+		void set_body(sv_id_t id, T &&body) {
+			using body_t = typename std::decay<T>::type;
+			assert(pending(id) && body_class(type_[id]) == body_index<body_t>::value);
+			auto &bodies = std::get<body_index<body_t>::value>(bodies_);
+			body_[id] = static_cast<sv_id_t>(bodies.size());
+			bodies.emplace_back(std::forward<T>(body));
+		}
+
+		/** Makes room for n SVs in the columns */
+		void reserve(size_t n) {
+			address_.reserve(n);
+			type_.reserve(n);
+			refcnt_.reserve(n);
+			size_.reserve(n);
+			blessed_.reserve(n);
+			body_.reserve(n);
+		}
+		size_t capacity() const { return address_.capacity(); }
+
+		/**
+		 * Moves everything from another (unsealed) table onto the end of this one. Its hash
+		 * keys and names are interned into ours and the ids in its bodies rewritten to match.
+		 */
+		void append(sv_table &&other) {
+			assert(!sealed_ && !other.sealed_);
+			const auto keys = remap(keys_, other.keys_);
+			for(auto &hash : std::get<body_index<pmat::sv_hash>::value>(other.bodies_))
+				for(auto &k : hash.keys) k = keys[k];
+			const auto names = remap(names_, other.names_);
+			auto name = [&names](pmat::string_id_t &n) { if(n != pmat::no_string) n = names[n]; };
+			for(auto &stash : std::get<body_index<pmat::sv_stash>::value>(other.bodies_)) {
+				for(auto &k : stash.keys) k = keys[k];
+				name(stash.name);
+			}
+			for(auto &glob : std::get<body_index<pmat::sv_glob>::value>(other.bodies_)) {
+				name(glob.name);
+				name(glob.file);
+			}
+			for(auto &code : std::get<body_index<pmat::sv_code>::value>(other.bodies_)) {
+				name(code.file);
+				name(code.name);
+			}
+			std::array<sv_id_t, body_classes> base;
+			append_bodies(other, base, std::make_index_sequence<body_classes>{});
+			const size_t from = address_.size();
+			address_.insert(address_.end(), other.address_.begin(), other.address_.end());
+			type_.insert(type_.end(), other.type_.begin(), other.type_.end());
+			refcnt_.insert(refcnt_.end(), other.refcnt_.begin(), other.refcnt_.end());
+			size_.insert(size_.end(), other.size_.begin(), other.size_.end());
+			blessed_.insert(blessed_.end(), other.blessed_.begin(), other.blessed_.end());
+			body_.insert(body_.end(), other.body_.begin(), other.body_.end());
+			pending_magic_.insert(pending_magic_.end(), other.pending_magic_.begin(), other.pending_magic_.end());
+			if(!other.offset_.empty()) {
+				offset_.resize(from);
+				offset_.insert(offset_.end(), other.offset_.begin(), other.offset_.end());
+			}
+			for(size_t i = from; i < address_.size(); ++i) {
+				auto cls = body_class(type_[i]);
+				if(body_[i] != no_sv) body_[i] += base[cls];
+			}
+			other = sv_table { };
+		}
+
+		/**
+		 * Sorts the table by address. Where an address turns up more than once, the first
+		 * SV added wins and the others are reported and dropped.
+		 */
+		void seal() {
+			if(sealed_) return;
+			sealed_ = true;
+			if(!offset_.empty()) offset_.resize(address_.size());
+			if(!std::is_sorted(address_.cbegin(), address_.cend())) {
+				std::vector<sv_id_t> order(address_.size());
+				std::iota(order.begin(), order.end(), 0);
+				std::stable_sort(order.begin(), order.end(), [this](sv_id_t a, sv_id_t b) {
+					return address_[a] < address_[b];
+				});
+				permute(address_, order);
+				permute(type_, order);
+				permute(refcnt_, order);
+				permute(size_, order);
+				permute(blessed_, order);
+				permute(body_, order);
+				if(!offset_.empty()) permute(offset_, order);
+			}
+
+			size_t out = 0;
+			for(size_t i = 0; i < address_.size(); ++i) {
+				if(out > 0 && address_[out - 1] == address_[i]) {
+					ERROR << "Already have address " << pmat::to_string(address_[i]) << " occupied by type " << (int)type_[out - 1] << ", dropping type " << (int)type_[i];
+					continue;
+				}
+				if(out != i) {
+					address_[out] = address_[i];
+					type_[out] = type_[i];
+					refcnt_[out] = refcnt_[i];
+					size_[out] = size_[i];
+					blessed_[out] = blessed_[i];
+					body_[out] = body_[i];
+					if(!offset_.empty()) offset_[out] = offset_[i];
+				}
+				++out;
+			}
+			address_.resize(out);
+			type_.resize(out);
+			refcnt_.resize(out);
+			size_.resize(out);
+			blessed_.resize(out);
+			body_.resize(out);
+			if(!offset_.empty()) offset_.resize(out);
+			attach_magic();
+		}
+
+		bool sealed() const { return sealed_; }
+		size_t size() const { return address_.size(); }
+
+		/** Finds the SV at the given address, or no_sv if there isn't one */
+		sv_id_t find(pmat::ptr_t addr) const {
+			assert(sealed_);
+			auto it = std::lower_bound(address_.cbegin(), address_.cend(), addr);
+			if(it == address_.cend() || *it != addr) return no_sv;
+			return static_cast<sv_id_t>(it - address_.cbegin());
+		}
+
+		pmat::ptr_t address(sv_id_t id) const { return address_[id]; }
+		pmat::sv_type_t type(sv_id_t id) const { return type_[id]; }
+		uint32_t refcnt(sv_id_t id) const { return refcnt_[id]; }
+		uint64_t sv_size(sv_id_t id) const { return size_[id]; }
+		pmat::ptr_t blessed(sv_id_t id) const { return blessed_[id]; }
+
+		/** Magic attached to an SV, in dump order. Only available once the table is sealed. */
+		pmat::span<const pmat::sv_magic> magic(sv_id_t id) const {
+			if(magic_offsets_.empty()) return { };
+			return pmat::span<const pmat::sv_magic> { magic_.data() + magic_offsets_[id], static_cast<size_t>(magic_offsets_[id + 1] - magic_offsets_[id]) };
+		}
+		/** Magic records across all SVs */
+		size_t magic_count() const { return magic_.size(); }
+
+		/** The common fields for an SV, as a single object */
+		pmat::sv header(sv_id_t id) const {
+			pmat::sv v { type_[id], address_[id] };
+			v.refcnt = refcnt_[id];
+			v.size = size_[id];
+			v.blessed = blessed_[id];
+			return v;
+		}
+
+		/**
+		 * Changes the type of an SV in place. Only valid between types sharing a body,
+		 * which is how arrays get upgraded to PADLIST/PADNAMES/PAD.
+		 */
+		void retype(sv_id_t id, pmat::sv_type_t type) {
+			assert(body_class(type_[id]) == body_class(type));
+			type_[id] = type;
+		}
+
+		/** The type-specific part of an SV, T must match its type */
+		template<typename T>
+		const T &body(sv_id_t id) const {
+			assert(body_class(type_[id]) == body_index<T>::value && !pending(id));
+			return std::get<body_index<T>::value>(bodies_)[body_[id]];
+		}
+		template<typename T>
+		T &body(sv_id_t id) {
+			assert(body_class(type_[id]) == body_index<T>::value && !pending(id));
+			return std::get<body_index<T>::value>(bodies_)[body_[id]];
+		}
+
+		/** Hash keys for the hash and stash bodies */
+		pmat::string_table &keys() { return keys_; }
+		const pmat::string_table &keys() const { return keys_; }
+		/** Package, glob and file names for the stash, glob and code bodies */
+		pmat::string_table &names() { return names_; }
+		const pmat::string_table &names() const { return names_; }
+
+		/** Total key/value pairs across all hashes and stashes */
+		size_t hash_elements() const {
+			size_t n = 0;
+			for(const auto &hash : std::get<body_index<pmat::sv_hash>::value>(bodies_))
+				n += hash.keys.size();
+			for(const auto &stash : std::get<body_index<pmat::sv_stash>::value>(bodies_))
+				n += stash.keys.size();
+			return n;
+		}
+
+		/** Bytes held by the columns, side tables and key index, not counting what the bodies point to */
+		size_t memory_used() const {
+			size_t total = address_.capacity() * sizeof(pmat::ptr_t)
+				+ type_.capacity() * sizeof(pmat::sv_type_t)
+				+ refcnt_.capacity() * sizeof(uint32_t)
+				+ size_.capacity() * sizeof(uint64_t)
+				+ blessed_.capacity() * sizeof(pmat::ptr_t)
+				+ body_.capacity() * sizeof(sv_id_t)
+				+ offset_.capacity() * sizeof(uint64_t)
+				+ magic_offsets_.capacity() * sizeof(uint32_t)
+				+ magic_.capacity() * sizeof(pmat::sv_magic)
+				+ keys_.memory_used()
+				+ names_.memory_used();
+			bodies_memory(total, std::make_index_sequence<body_classes>{});
+			return total;
+		}
+
+		/**
+		 * Calls f on every column, side table and flag that makes up the table, always in
+		 * the same order, so they can be written out and borrowed back (pmat::index_file).
+		 */
+		template<typename F>
+		void columns(F &&f) {
+			f(sealed_);
+			f(address_);
+			f(type_);
+			f(refcnt_);
+			f(size_);
+			f(blessed_);
+			f(body_);
+			bodies_columns(f, std::make_index_sequence<body_classes>{});
+			keys_.columns(f);
+			names_.columns(f);
+			f(magic_offsets_);
+			f(magic_);
+		}
+
+	private:
+		using bodies_t = std::tuple<
+			pmat::column<pmat::sv_scalar>,
+			pmat::column<pmat::sv_ref>,
+			pmat::column<pmat::sv_glob>,
+			pmat::column<pmat::sv_array>,
+			pmat::column<pmat::sv_hash>,
+			pmat::column<pmat::sv_stash>,
+			pmat::column<pmat::sv_code>,
+			pmat::column<pmat::sv_io>,
+			pmat::column<pmat::sv_lvalue>
+		>;
+		static constexpr size_t body_classes = std::tuple_size<bodies_t>::value;
+
+		/** Which side table an SV type keeps its body in, or -1 for none */
+		static int body_class(pmat::sv_type_t type) {
+			switch(type) {
+			case pmat::sv_type_t::SVtSCALAR: return 0;
+			case pmat::sv_type_t::SVtREF: return 1;
+			case pmat::sv_type_t::SVtGLOB: return 2;
+			case pmat::sv_type_t::SVtARRAY:
+			case pmat::sv_type_t::SVtPADLIST:
+			case pmat::sv_type_t::SVtPADNAMES:
+			case pmat::sv_type_t::SVtPAD: return 3;
+			case pmat::sv_type_t::SVtHASH: return 4;
+			case pmat::sv_type_t::SVtSTASH: return 5;
+			case pmat::sv_type_t::SVtCODE: return 6;
+			case pmat::sv_type_t::SVtIO: return 7;
+			case pmat::sv_type_t::SVtLVALUE: return 8;
+			default: return -1;
+			}
+		}
+
+		template<typename T, size_t I = 0>
+		struct body_index : std::conditional<
+			std::is_same<pmat::column<T>, typename std::tuple_element<I, bodies_t>::type>::value,
+			std::integral_constant<int, I>,
+			body_index<T, I + 1>
+		>::type { };
+
+		void push(const pmat::sv &v, sv_id_t body) {
+			assert(!sealed_);
+			address_.push_back(v.address);
+			type_.push_back(v.type);
+			refcnt_.push_back(v.refcnt);
+			size_.push_back(v.size);
+			blessed_.push_back(v.blessed);
+			body_.push_back(body);
+		}
+
+		template<size_t... I>
+		void append_bodies(sv_table &other, std::array<sv_id_t, body_classes> &base, std::index_sequence<I...>) {
+			(void)std::initializer_list<int> { (append_body<I>(other, base), 0)... };
+		}
+		template<size_t I>
+		void append_body(sv_table &other, std::array<sv_id_t, body_classes> &base) {
+			auto &to = std::get<I>(bodies_);
+			auto &from = std::get<I>(other.bodies_);
+			base[I] = static_cast<sv_id_t>(to.size());
+			to.insert(to.end(), std::make_move_iterator(from.begin()), std::make_move_iterator(from.end()));
+		}
+
+		template<typename F, size_t... I>
+		void bodies_columns(F &f, std::index_sequence<I...>) {
+			(void)std::initializer_list<int> { (f(std::get<I>(bodies_)), 0)... };
+		}
+
+		template<size_t... I>
+		void bodies_memory(size_t &total, std::index_sequence<I...>) const {
+			(void)std::initializer_list<int> {
+				(total += std::get<I>(bodies_).capacity() * sizeof(typename std::tuple_element<I, bodies_t>::type::value_type), 0)...
+			};
+		}
+
+		/** Interns everything from one string table into another, giving the new id for each old one */
+		static std::vector<pmat::string_id_t> remap(pmat::string_table &into, const pmat::string_table &from) {
+			std::vector<pmat::string_id_t> ids(from.size());
+			for(pmat::string_id_t id = 0; id < ids.size(); ++id)
+				ids[id] = into.intern(from.str(id));
+			return ids;
+		}
+
+		/**
+		 * Groups the pending magic records by the SV they belong to, counting sort style,
+		 * so each SV's records are a run in magic_ starting at magic_offsets_[id]. Records
+		 * for addresses we have no SV for are dropped.
+		 */
+		void attach_magic() {
+			if(pending_magic_.empty()) return;
+			std::vector<sv_id_t> owner(pending_magic_.size());
+			std::vector<uint32_t> offsets(address_.size() + 1, 0);
+			size_t dropped = 0;
+			for(size_t i = 0; i < pending_magic_.size(); ++i) {
+				owner[i] = find(pending_magic_[i].addr);
+				if(owner[i] == no_sv) ++dropped;
+				else ++offsets[owner[i] + 1];
+			}
+			for(size_t id = 0; id < address_.size(); ++id)
+				offsets[id + 1] += offsets[id];
+
+			std::vector<pmat::sv_magic> magic(offsets.back());
+			std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+			for(size_t i = 0; i < pending_magic_.size(); ++i) {
+				if(owner[i] == no_sv) continue;
+				const auto &m = pending_magic_[i];
+				auto &out = magic[next[owner[i]]++];
+				out.obj = m.obj;
+				out.ptr = m.ptr;
+				out.type = m.type;
+				out.flags = m.flags;
+			}
+			if(dropped) WARN << "Dropped " << dropped << " magic records for SVs that aren't in the dump";
+			magic_offsets_ = pmat::column<uint32_t> { std::move(offsets) };
+			magic_ = pmat::column<pmat::sv_magic> { std::move(magic) };
+			pending_magic_ = pmat::column<pmat::magic_t> { };
+		}
+
+		template<typename T>
+		static void permute(pmat::column<T> &column, const std::vector<sv_id_t> &order) {
+			std::vector<T> out;
+			out.reserve(column.size());
+			for(auto i : order)
+				out.push_back(column[i]);
+			column = pmat::column<T> { std::move(out) };
+		}
+
+		pmat::column<pmat::ptr_t> address_;
+		pmat::column<pmat::sv_type_t> type_;
+		pmat::column<uint32_t> refcnt_;
+		pmat::column<uint64_t> size_;
+		pmat::column<pmat::ptr_t> blessed_;
+		pmat::column<sv_id_t> body_;
+		/* Dump offset of each body not decoded yet - empty unless something was added pending */
+		pmat::column<uint64_t> offset_;
+		bodies_t bodies_;
+		pmat::string_table keys_;
+		pmat::string_table names_;
+		/* Magic records as read, until seal() groups them by SV */
+		pmat::column<pmat::magic_t> pending_magic_;
+		/* Where each SV's magic starts in magic_ - empty if the dump had none */
+		pmat::column<uint32_t> magic_offsets_;
+		pmat::column<pmat::sv_magic> magic_;
+		bool sealed_;
+	};
+};
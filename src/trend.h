@@ -0,0 +1,208 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/io/ios_state.hpp>
+
+#include "state.h"
+
+namespace pmat {
+	/**
+	 * What we keep from each dump in a series: per-class totals, plus one row per SV with
+	 * just the values we track for growth. Around 25 bytes an SV, against several times
+	 * that for a loaded state.
+	 */
+	class snapshot_summary {
+	public:
+		explicit snapshot_summary(const pmat::state_t &state) {
+			const auto &svs = state.svs();
+			const size_t n = svs.size();
+			address.reserve(n);
+			type.reserve(n);
+			refcnt.reserve(n);
+			length.reserve(n);
+			cls.reserve(n);
+			std::map<std::pair<pmat::sv_type_t, pmat::ptr_t>, uint32_t> ids;
+			for(pmat::sv_id_t id = 0; id < n; ++id) {
+				auto it = ids.emplace(std::make_pair(svs.type(id), svs.blessed(id)), static_cast<uint32_t>(class_names.size()));
+				if(it.second) {
+					class_names.push_back(state.sv_blessed_type(id));
+					class_count.push_back(0);
+					class_bytes.push_back(0);
+				}
+				const auto c = it.first->second;
+				++class_count[c];
+				class_bytes[c] += svs.sv_size(id);
+				address.push_back(svs.address(id));
+				type.push_back(svs.type(id));
+				refcnt.push_back(svs.refcnt(id));
+				length.push_back(length_of(svs, id));
+				cls.push_back(c);
+			}
+		}
+
+		/** The size of an SV's contents we watch for growth: PV length, or element count */
+		static uint64_t length_of(const pmat::sv_table &svs, pmat::sv_id_t id) {
+			switch(svs.type(id)) {
+			case pmat::sv_type_t::SVtSCALAR: return svs.body<pmat::sv_scalar>(id).pvlen;
+			case pmat::sv_type_t::SVtARRAY:
+			case pmat::sv_type_t::SVtPADLIST:
+			case pmat::sv_type_t::SVtPADNAMES:
+			case pmat::sv_type_t::SVtPAD: return svs.body<pmat::sv_array>(id).count;
+			case pmat::sv_type_t::SVtHASH: return svs.body<pmat::sv_hash>(id).count;
+			case pmat::sv_type_t::SVtSTASH: return svs.body<pmat::sv_stash>(id).count;
+			default: return 0;
+			}
+		}
+
+		size_t memory_used() const {
+			return address.capacity() * sizeof(pmat::ptr_t) + type.capacity() * sizeof(pmat::sv_type_t)
+				+ refcnt.capacity() * sizeof(uint32_t) + length.capacity() * sizeof(uint64_t)
+				+ cls.capacity() * sizeof(uint32_t);
+		}
+
+		/* One entry per SV, in address order */
+		std::vector<pmat::ptr_t> address;
+		std::vector<pmat::sv_type_t> type;
+		std::vector<uint32_t> refcnt;
+		std::vector<uint64_t> length;
+		std::vector<uint32_t> cls;
+		/* One entry per class */
+		std::vector<std::string> class_names;
+		std::vector<uint64_t> class_count;
+		std::vector<uint64_t> class_bytes;
+	};
+
+	/**
+	 * Growth patterns across a time-ordered series of dumps - the "apply successive deltas
+	 * and look for patterns" idea from notes.txt.
+	 *
+	 * Summaries are folded in one at a time. Per-class totals are kept for every snapshot,
+	 * but per-SV we only carry the SVs that have been in every dump so far and are still
+	 * growing, so memory goes down as the series goes on rather than up.
+	 */
+	class trend {
+	public:
+		trend():snapshots_{0} { }
+
+		/** Adds the next dump in the series */
+		void add(const pmat::snapshot_summary &s) {
+			std::vector<uint32_t> remap(s.class_names.size());
+			for(size_t c = 0; c < remap.size(); ++c) {
+				auto it = class_ids_.emplace(s.class_names[c], static_cast<uint32_t>(names_.size()));
+				if(it.second) {
+					names_.push_back(s.class_names[c]);
+					series_.emplace_back(snapshots_, point { 0, 0 });
+				}
+				remap[c] = it.first->second;
+			}
+			for(auto &points : series_) points.push_back(point { 0, 0 });
+			for(size_t c = 0; c < remap.size(); ++c)
+				series_[remap[c]].back() = point { s.class_count[c], s.class_bytes[c] };
+
+			if(snapshots_++ == 0) {
+				tracked_.reserve(s.address.size());
+				for(size_t i = 0; i < s.address.size(); ++i) {
+					tracked_.push_back(tracked {
+						s.address[i], s.refcnt[i], s.refcnt[i], s.length[i], s.length[i],
+						remap[s.cls[i]], s.type[i], true, true
+					});
+				}
+				return;
+			}
+
+			/* Merge with the SVs still being followed, dropping any that stopped growing */
+			size_t out = 0, j = 0;
+			for(size_t i = 0; i < tracked_.size(); ++i) {
+				auto t = tracked_[i];
+				while(j < s.address.size() && s.address[j] < t.address) ++j;
+				if(j == s.address.size() || s.address[j] != t.address || s.type[j] != t.type || remap[s.cls[j]] != t.cls)
+					continue;
+				t.refcnt_growing = t.refcnt_growing && s.refcnt[j] >= t.refcnt_last;
+				t.length_growing = t.length_growing && s.length[j] >= t.length_last;
+				t.refcnt_last = s.refcnt[j];
+				t.length_last = s.length[j];
+				if(t.refcnt_growing || t.length_growing) tracked_[out++] = t;
+			}
+			tracked_.resize(out);
+			tracked_.shrink_to_fit();
+		}
+
+		size_t snapshots() const { return snapshots_; }
+
+		/**
+		 * Classes whose SV count went up (or stayed level) at every step and ended higher,
+		 * largest growth in bytes first, then the top SVs whose refcount or length did the same.
+		 */
+		void report(std::ostream &out, size_t top) const {
+			boost::io::ios_all_saver ias { out };
+			out << "Trend over " << snapshots_ << " snapshots" << std::endl;
+			out << "Classes growing at every snapshot:" << std::endl;
+			out << std::setiosflags(std::ios::left) << std::setw(24) << "Type" << " | " << std::setw(21) << "SVs" << " | " << "Bytes" << std::endl;
+			std::vector<size_t> classes;
+			for(size_t c = 0; c < names_.size(); ++c) {
+				const auto &points = series_[c];
+				bool growing = points.back().count > points.front().count;
+				for(size_t i = 1; growing && i < points.size(); ++i)
+					growing = points[i].count >= points[i - 1].count;
+				if(growing) classes.push_back(c);
+			}
+			/* Biggest growth in bytes first, as for a diff */
+			const auto byte_growth = [this](size_t c) {
+				return static_cast<int64_t>(series_[c].back().bytes) - static_cast<int64_t>(series_[c].front().bytes);
+			};
+			std::stable_sort(classes.begin(), classes.end(), [&byte_growth](size_t l, size_t r) { return byte_growth(l) > byte_growth(r); });
+			for(const auto c : classes) {
+				const auto &points = series_[c];
+				out << std::setw(24) << names_[c] << " | "
+					<< std::setw(21) << (std::to_string(points.front().count) + " -> " + std::to_string(points.back().count)) << " | "
+					<< points.front().bytes << " -> " << points.back().bytes << std::endl;
+			}
+
+			struct hit {
+				const tracked *t;
+				const char *what;
+				uint64_t first, last;
+			};
+			std::vector<hit> hits;
+			for(const auto &t : tracked_) {
+				if(t.refcnt_growing && t.refcnt_last > t.refcnt_first)
+					hits.push_back(hit { &t, "refcount", t.refcnt_first, t.refcnt_last });
+				if(t.length_growing && t.length_last > t.length_first)
+					hits.push_back(hit { &t, t.type == pmat::sv_type_t::SVtSCALAR ? "PV length" : "elements", t.length_first, t.length_last });
+			}
+			std::sort(hits.begin(), hits.end(), [](const hit &a, const hit &b) { return a.last - a.first > b.last - b.first; });
+			out << "SVs growing at every snapshot (" << hits.size() << " in all, showing " << std::min(top, hits.size()) << "):" << std::endl;
+			out << std::setw(24) << "Type" << " | " << std::setw(18) << "Address" << " | " << std::setw(10) << "What" << " | " << "Change" << std::endl;
+			for(size_t i = 0; i < std::min(top, hits.size()); ++i) {
+				const auto &h = hits[i];
+				out << std::setw(24) << names_[h.t->cls] << " | " << std::setw(18) << pmat::to_string(h.t->address) << " | "
+					<< std::setw(10) << h.what << " | " << h.first << " -> " << h.last << std::endl;
+			}
+		}
+
+	private:
+		struct point {
+			uint64_t count, bytes;
+		};
+		struct tracked {
+			pmat::ptr_t address;
+			uint32_t refcnt_first, refcnt_last;
+			uint64_t length_first, length_last;
+			uint32_t cls;
+			pmat::sv_type_t type;
+			bool refcnt_growing, length_growing;
+		};
+
+		size_t snapshots_;
+		std::vector<std::string> names_;
+		std::map<std::string, uint32_t> class_ids_;
+		/* Per class, one point per snapshot */
+		std::vector<std::vector<point>> series_;
+		std::vector<tracked> tracked_;
+	};
+};